@@ -18,7 +18,7 @@ def parser_fasta(f):
 		if line[0] == '>':
 			# begining new record...
 			record[header] = ''.join(seqs)
-			header = line.split()[1]
+			header = line[1:]
 			seqs = []
 		else:
 			seqs.append(line)
@@ -55,9 +55,12 @@ if __name__ == '__main__':
 	parser.add_argument('-n', nargs='?', type=int, help='Number of sequences, default 10', default=10)
 	parser.add_argument('-m', nargs='?', type=int, help='The length of the sequences, default 100', default=100)
 	parser.add_argument('-d', nargs='?', type=int, help='Maximum edit distance from reference, default 0', default=0)
+	parser.add_argument('-s', '--seed', nargs='?', type=int, help='Seed for the random number generator, default random')
 	parser.add_argument('-l', "--log", nargs='?', type=argparse.FileType('w'), help="Log file to write samples and sample positions to.")
 
 	args = parser.parse_args()
+	if args.seed is not None:
+		random.seed(args.seed)
 
 	ref = parser_fasta(args.reference[0])
 
@@ -0,0 +1,230 @@
+"""
+Program for measuring the running time and resource use of a read-mapper.
+
+The command is run once cold, a number of times to warm up, and then the
+number of times we measure. For each run we record the wall-clock, user
+and system time, the peak resident set size, page faults and context
+switches. The results go to a JSON file, with the median and a confidence
+interval for each measure, so we can tell real differences from noise.
+"""
+
+import argparse
+import datetime
+import json
+import math
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+
+MEASURES = ['wall', 'user', 'sys', 'max_rss_kb',
+			'minor_faults', 'major_faults',
+			'voluntary_switches', 'involuntary_switches']
+
+
+def drop_caches():
+	"""Drop the OS page cache, if we are allowed to, so the first run is cold."""
+	try:
+		os.sync()
+		with open('/proc/sys/vm/drop_caches', 'w') as f:
+			f.write('3\n')
+		return True
+	except OSError:
+		return False
+
+
+class CommandFailed(Exception):
+	pass
+
+
+class CommandTimedOut(Exception):
+	pass
+
+
+def run_once(command, stdout, stderr, timeout=None):
+	"""
+	Run the command and return the measures for the run. Raises
+	CommandFailed if it fails and CommandTimedOut if we have to kill
+	it after timeout seconds.
+	"""
+	start = time.perf_counter()
+	process = subprocess.Popen(command, stdout=stdout, stderr=stderr)
+	timer = None
+	if timeout is not None:
+		timer = threading.Timer(timeout, process.kill)
+		timer.start()
+	_, status, usage = os.wait4(process.pid, 0)
+	wall = time.perf_counter() - start
+	process.returncode = os.waitstatus_to_exitcode(status)
+	if timer is not None:
+		timer.cancel()
+		if wall >= timeout and process.returncode < 0:
+			raise CommandTimedOut("{} did not finish in {} seconds.".format(' '.join(command), timeout))
+	if process.returncode != 0:
+		raise CommandFailed("{} failed with exit code {}.".format(' '.join(command), process.returncode))
+
+	# ru_maxrss is in kilobytes on Linux but in bytes on macOS
+	max_rss = usage.ru_maxrss // 1024 if sys.platform == 'darwin' else usage.ru_maxrss
+	return {
+		'wall': wall,
+		'user': usage.ru_utime,
+		'sys': usage.ru_stime,
+		'max_rss_kb': max_rss,
+		'minor_faults': usage.ru_minflt,
+		'major_faults': usage.ru_majflt,
+		'voluntary_switches': usage.ru_nvcsw,
+		'involuntary_switches': usage.ru_nivcsw,
+	}
+
+
+def run_with_stats(command, stdout, stderr, timeout=None, perf_counters=False):
+	"""
+	Run one of our mappers with --stats and return the measures for
+	the run together with the mapper's own statistics: the time spent
+	in each phase and counts of the work it did, and with perf_counters
+	the hardware counters for each phase.
+	"""
+	with tempfile.TemporaryDirectory() as tmp:
+		stats_file = os.path.join(tmp, 'stats.json')
+		options = ['--stats', stats_file] + (['--perf-counters'] if perf_counters else [])
+		# the options go before the arguments; not all getopts reorder them
+		measures = run_once(command[:1] + options + command[1:],
+							stdout, stderr, timeout)
+		with open(stats_file) as f:
+			return measures, json.load(f)
+
+
+def median(xs):
+	xs = sorted(xs)
+	n = len(xs)
+	if n % 2 == 1:
+		return xs[n // 2]
+	return (xs[n // 2 - 1] + xs[n // 2]) / 2
+
+
+def median_interval(xs, level):
+	"""
+	Distribution-free confidence interval for the median: the order
+	statistics x_(j) and x_(n-j+1), with j the largest rank where the
+	binomial(n, 1/2) probability of the interval covering the median
+	is at least level. With few samples we cannot reach the level, and
+	then we report the full range and the level we did get.
+	"""
+	xs = sorted(xs)
+	n = len(xs)
+
+	def coverage(j):
+		# P(j <= B < n - j + 1) for B ~ binomial(n, 1/2), 1-based j
+		return sum(math.comb(n, i) for i in range(j, n - j + 1)) / 2 ** n
+
+	j = 1
+	while j + 1 <= n - j and coverage(j + 1) >= level:
+		j += 1
+	return xs[j - 1], xs[n - j], coverage(j)
+
+
+def summarise(samples, level):
+	summary = {}
+	for measure in MEASURES:
+		xs = [sample[measure] for sample in samples]
+		low, high, achieved = median_interval(xs, level)
+		mean = sum(xs) / len(xs)
+		sd = math.sqrt(sum((x - mean) ** 2 for x in xs) / (len(xs) - 1)) if len(xs) > 1 else 0.0
+		summary[measure] = {
+			'median': median(xs),
+			'ci_low': low,
+			'ci_high': high,
+			'ci_level': achieved,
+			'mean': mean,
+			'sd': sd,
+			'min': min(xs),
+			'max': max(xs),
+		}
+	return summary
+
+
+def load_results(filename):
+	if filename is None or not os.path.exists(filename):
+		return {'benchmarks': {}}
+	with open(filename) as f:
+		return json.load(f)
+
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(prog='benchmark', usage='%(prog)s [options] command [arguments]',
+									 description="Measure the running time and resource use of a command.")
+	parser.add_argument('command', nargs=argparse.REMAINDER, help="The command to measure.")
+	parser.add_argument('--name', help="Name of the benchmark, default the command")
+	parser.add_argument('-n', '--runs', type=int, help='Number of measured runs, default 10', default=10)
+	parser.add_argument('-w', '--warmup', type=int, help='Number of warm-up runs after the cold run, default 1', default=1)
+	parser.add_argument('-c', '--confidence', type=float, help='Confidence level for the intervals, default 0.95', default=0.95)
+	parser.add_argument('--drop-caches', action='store_true', help="Drop the page cache before the cold run (needs root).")
+	parser.add_argument('-o', '--json', help="JSON file to add the results to, default stdout.")
+	parser.add_argument('-r', '--report', type=argparse.FileType('a'),
+						help="Report to append the wall-clock time and peak memory of the measured runs to, as 'name time max_rss_kb' lines.")
+	parser.add_argument('-l', '--log', type=argparse.FileType('a'), help="Log file for the command's standard error.")
+	parser.add_argument('--stats', action='store_true',
+						help="The command is one of our mappers; collect its --stats output for the measured runs.")
+	parser.add_argument('--perf-counters', action='store_true',
+						help="With --stats, also have the mapper count hardware events per phase.")
+
+	args = parser.parse_args()
+	if not args.command:
+		parser.error("no command to measure")
+	if args.runs < 1:
+		parser.error("we need at least one measured run")
+	if args.perf_counters and not args.stats:
+		parser.error("--perf-counters needs --stats")
+	name = args.name if args.name else ' '.join(args.command)
+	stderr = args.log if args.log else subprocess.DEVNULL
+
+	dropped = drop_caches() if args.drop_caches else False
+	if args.drop_caches and not dropped:
+		print("Could not drop the page cache; the cold run may be warm.", file=sys.stderr)
+
+	try:
+		cold = run_once(args.command, subprocess.DEVNULL, stderr)
+		for _ in range(args.warmup):
+			run_once(args.command, subprocess.DEVNULL, stderr)
+		samples, mapper_stats = [], []
+		for _ in range(args.runs):
+			if args.stats:
+				sample, stats = run_with_stats(args.command, subprocess.DEVNULL, stderr,
+											   perf_counters=args.perf_counters)
+				mapper_stats.append(stats)
+			else:
+				sample = run_once(args.command, subprocess.DEVNULL, stderr)
+			samples.append(sample)
+	except CommandFailed as e:
+		sys.exit(str(e))
+
+	results = load_results(args.json)
+	results['benchmarks'][name] = {
+		'command': args.command,
+		'date': datetime.datetime.now().isoformat(timespec='seconds'),
+		'host': platform.node(),
+		'platform': platform.platform(),
+		'warmup_runs': args.warmup,
+		'caches_dropped': dropped,
+		'cold': cold,
+		'runs': samples,
+		'summary': summarise(samples, args.confidence),
+	}
+	if args.stats:
+		results['benchmarks'][name]['mapper_stats'] = mapper_stats
+
+	if args.json:
+		with open(args.json, 'w') as f:
+			json.dump(results, f, indent=2)
+			f.write('\n')
+	else:
+		json.dump(results, sys.stdout, indent=2)
+		print()
+
+	if args.report:
+		for sample in samples:
+			print("{} {:.4f} {}".format(name, sample['wall'], sample['max_rss_kb']), file=args.report)
@@ -11,7 +11,9 @@ mappers="bwa match_readmapper ac_readmapper bw_readmapper"
 
 # file name for report
 report_file=../evaluation-report-exact.txt
+json_file=../evaluation-report-exact.json
 log_file=../evaluation-exact.log
+accuracy_file=../evaluation-accuracy-exact.txt
 
 # max edit distance to explore
 d=0
@@ -19,12 +21,21 @@ d=0
 # number of time measurements to do
 N=5
 
+# number of runs to warm up the caches before we measure; the first,
+# cold, run is kept apart in the JSON results
+warmup=1
+
 # Reference genome
 reference=../data/gorGor3-small-noN.fa
 
 # Reads
 reads=../data/sim-reads-d2-tiny.fq
 
+# Where the reads came from: the log from simulate-fastq.py -l. If you
+# give one, we also check the mappers' hits against it and report the
+# sensitivity and precision next to the running time.
+truth=
+
 ## =============================================================
 
 ## It shouldn't be necessary to touch any of the code below.
@@ -67,15 +78,35 @@ if [ -e $reads ]; then
 else
 	failure_tick "Could not find the reads file. "
 fi
+if [ -n "$truth" ]; then
+	printf "Testing that the truth file $(tput setaf 4)$(tput bold)${truth}$(tput sgr0) exists "
+	if [ -e $truth ]; then
+		success
+	else
+		failure_tick "Could not find the truth file. "
+	fi
+	printf "Building $(tput setaf 4)$(tput bold)test_tools/sam_accuracy$(tput sgr0) "
+	if (cd ../test_tools && make sam_accuracy) > /dev/null 2>&1; then
+		success
+	else
+		failure_tick "Could not build the accuracy evaluator."
+	fi
+fi
 
 ## Run evaluation of all mappers...
 if [ -e $report_file ]; then
 	mv $report_file{,.bak}
 fi
+if [ -e $json_file ]; then
+	mv $json_file{,.bak}
+fi
 if [ -e $log_file ]; then
 	rm $log_file
 fi
-printf "%-${mapper_field_length}s %10s\n" mapper time > $report_file
+if [ -e $accuracy_file ]; then
+	mv $accuracy_file{,.bak}
+fi
+printf "%-${mapper_field_length}s %10s %10s\n" mapper time max_rss_kb > $report_file
 
 touch $log_file
 
@@ -110,17 +141,40 @@ for mapper in $mappers; do
 		printf "   • Read-mapping using $(tput setaf 4)$(tput bold)mappers_src/${mapper}$(tput sgr0) "
 		mapper_cmd=../mappers_src/${mapper}
 	fi
-	for ((i = 0; i < $N; i++)); do
-		walltime=`command time -p ${mapper_cmd} -d $d ${reference} ${reads} 2>&1 1> /dev/null | awk '/^real/ { print $2 }'`
-		printf "%-${mapper_field_length}s %10s\n" ${mapper} ${walltime} >> $report_file
-	done
-	success
+	python3 benchmark.py --name ${mapper} --runs $N --warmup $warmup \
+		--json $json_file --report $report_file --log $log_file \
+		${mapper_cmd} -d $d ${reference} ${reads}
+	if [ $? -eq 0 ]; then
+		success
+	else
+		failure_tick "Read-mapping failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+	fi
+
+	### Measuring accuracy ---------------------------------------------------------------------------
+	if [ -n "$truth" ]; then
+		printf "   • Checking the hits against $(tput setaf 4)$(tput bold)${truth}$(tput sgr0) "
+		# only the first mapper writes the header
+		header_option=
+		if [ -s $accuracy_file ]; then
+			header_option=--no-header
+		fi
+		${mapper_cmd} -d $d ${reference} ${reads} 2>> $log_file | \
+			../test_tools/sam_accuracy $header_option --label ${mapper} ${truth} - >> $accuracy_file
+		if [ $? -eq 0 ]; then
+			success
+		else
+			failure_tick "Checking the accuracy failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+		fi
+	fi
 
 	printf "   • DONE "
 	success
 done
 
 header=`head -n 1 $report_file`
+if [ -n "$truth" ]; then
+	header=`printf "%s %11s %10s" "$header" sensitivity precision`
+fi
 major_rule=`printf "%${#header}s" |tr " " "="`
 minor_rule=`printf "%${#header}s" |tr " " "-"`
 
@@ -129,7 +183,13 @@ echo "$(tput setaf 2)$(tput bold)Results of the evaluation:$(tput sgr0)"
 echo "$(tput setaf 4)$(tput bold)${major_rule}$(tput sgr0)"
 echo "$(tput setaf 4)$(tput bold)${header}$(tput sgr0)"
 echo "$(tput setaf 4)$(tput bold)${minor_rule}$(tput sgr0)"
-tail -n +2 $report_file
+tail -n +2 $report_file | while read mapper walltime rss; do
+	accuracy=
+	if [ -n "$truth" ]; then
+		accuracy=`awk -v m=${mapper} '$1 == m && $2 == "all" { printf "%11s %10s", $7, $10 }' $accuracy_file`
+	fi
+	printf "%-${mapper_field_length}s %10s %10s %s\n" ${mapper} ${walltime} ${rss} "${accuracy}"
+done
 echo "$(tput setaf 4)$(tput bold)${minor_rule}$(tput sgr0)"
 echo
 
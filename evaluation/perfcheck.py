@@ -0,0 +1,243 @@
+"""
+Program for catching performance regressions in the read-mappers.
+
+We run a small, pinned set of benchmarks and compare the median
+wall-clock time of each with a baseline stored next to this script. If
+a mapper has become slower than its baseline by more than the
+tolerance, we report it and exit with a non-zero status, so `make
+perfcheck` fails. Timings on a developer machine are noisy, so we only
+call it a regression if the confidence interval for the median is above
+the baseline as well; with the default five runs, that means every run
+was slower than the baseline.
+
+The benchmarks don't depend on the data in the repository: we generate
+the reference from a fixed seed and simulate the reads from it with
+test_tools/simulate_reads, which gives the same reads for the same seed
+on any machine. The running times still depend on the machine, of
+course. The baseline in the repository, perf-baseline.json, is the
+reference for the machine it was recorded on; on any other machine,
+record your own with --update (`make perfcheck_baseline`), which goes in
+perf-baseline.local.json and is used instead of the shared one when it
+is there. A baseline recorded on another host isn't compared with at
+all.
+
+The exit status is 0 if no benchmark is slower than its baseline, 1 if
+one is or if a mapper fails, and 3 if there is no usable baseline,
+because it is missing or was recorded on another host.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import random
+import subprocess
+import sys
+
+from benchmark import run_once, summarise, CommandFailed
+
+
+EVALUATION_DIR = os.path.dirname(os.path.abspath(__file__))
+MAPPERS_DIR = os.path.join(EVALUATION_DIR, '..', 'mappers_src')
+TEST_TOOLS_DIR = os.path.join(EVALUATION_DIR, '..', 'test_tools')
+SIMULATOR = os.path.join(TEST_TOOLS_DIR, 'simulate_reads')
+SHARED_BASELINE = os.path.join(EVALUATION_DIR, 'perf-baseline.json')
+LOCAL_BASELINE = os.path.join(EVALUATION_DIR, 'perf-baseline.local.json')
+LINE_WIDTH = 60
+
+EXIT_REGRESSION = 1
+EXIT_NO_BASELINE = 3
+
+# The pinned data: changing any of this invalidates the baseline.
+GENOME_SIZE = 200000
+READ_LENGTH = 100
+SEED = 1
+
+# name, mapper, edit distance, number of reads, extra options; the
+# online mappers scan the whole genome for each read, so they get
+# fewer reads to keep each run around a second
+BENCHMARKS = [
+	('ac_readmapper-d1', 'ac_readmapper', 1, 100, []),
+	('bw_readmapper-d0', 'bw_readmapper', 0, 20000, []),
+	('bw_readmapper-d1', 'bw_readmapper', 1, 20000, []),
+	('bw_readmapper-d2', 'bw_readmapper', 2, 20000, []),
+	('match_readmapper-d0', 'match_readmapper', 0, 500, ['-a', 'kmp']),
+]
+
+
+def random_reference(filename):
+	rng = random.Random(SEED)
+	genome = ''.join(rng.choices('ACGT', k=GENOME_SIZE))
+	with open(filename, 'w') as f:
+		print('>ref', file=f)
+		for i in range(0, GENOME_SIZE, LINE_WIDTH):
+			print(genome[i:i + LINE_WIDTH], file=f)
+
+
+def prepare_data(data_dir, log):
+	"""Make the reference, index it for bw_readmapper, and simulate the reads."""
+	os.makedirs(data_dir, exist_ok=True)
+	reference = os.path.join(data_dir, 'ref-{}-s{}.fa'.format(GENOME_SIZE, SEED))
+	if not os.path.exists(reference):
+		random_reference(reference + '.tmp')
+		os.rename(reference + '.tmp', reference)
+	subprocess.run(['bash', os.path.join(EVALUATION_DIR, 'bw_readmapper.preprocess'), reference],
+				   stdout=log, stderr=log, check=True)
+
+	subprocess.run(['make', '-C', TEST_TOOLS_DIR, 'simulate_reads'], stdout=subprocess.DEVNULL, check=True)
+	reads = {}
+	for d, count in sorted(set((b[2], b[3]) for b in BENCHMARKS)):
+		filename = os.path.join(data_dir, 'reads-m{}-d{}-n{}-s{}.fq'.format(READ_LENGTH, d, count, SEED))
+		if not os.path.exists(filename):
+			subprocess.run([SIMULATOR, '-n', str(count), '-m', str(READ_LENGTH), '-d', str(d),
+							'-s', str(SEED), '-t', str(os.cpu_count() or 1), '-o', filename + '.tmp',
+							reference], check=True)
+			os.rename(filename + '.tmp', filename)
+		reads[(d, count)] = filename
+	return reference, reads
+
+
+def mapper_arguments(mapper, d, count, options):
+	"""The command line without the data files, as we record it in the baseline."""
+	return [mapper] + options + ['-d', str(d), 'reads-m{}-d{}-n{}-s{}.fq'.format(READ_LENGTH, d, count, SEED)]
+
+
+def run_benchmarks(names, reference, reads, runs, warmup, log):
+	results = {}
+	for name, mapper, d, count, options in BENCHMARKS:
+		if names and name not in names:
+			continue
+		arguments = mapper_arguments(mapper, d, count, options)
+		command = [os.path.join(MAPPERS_DIR, mapper)] + arguments[1:-1] + [reference, reads[(d, count)]]
+		print("{} ".format(name), end='', file=sys.stderr, flush=True)
+		for _ in range(warmup):
+			run_once(command, subprocess.DEVNULL, log)
+		samples = [run_once(command, subprocess.DEVNULL, log) for _ in range(runs)]
+		summary = summarise(samples, 0.95)
+		print("{:.3f}s".format(summary['wall']['median']), file=sys.stderr)
+		results[name] = {
+			'command': arguments,
+			'wall': summary['wall']['median'],
+			'wall_ci_low': summary['wall']['ci_low'],
+			'wall_ci_high': summary['wall']['ci_high'],
+			'max_rss_kb': summary['max_rss_kb']['median'],
+		}
+	return results
+
+
+def relative_change(baseline, current):
+	return (current - baseline) / baseline if baseline > 0 else 0.0
+
+
+def compare(baseline, results, tolerance):
+	"""Print the per-benchmark deltas and return the names of the regressions."""
+	name_length = max(len(name) for name in results)
+	print("{:<{}} {:>10} {:>10} {:>8} {:>12} {:>8}  {}".format(
+		'benchmark', name_length, 'baseline', 'current', 'delta', 'max_rss_kb', 'delta', 'status'))
+	regressions = []
+	for name, result in results.items():
+		expected = baseline['benchmarks'].get(name)
+		if expected is None or expected['command'] != result['command']:
+			# a new or changed benchmark has nothing to be compared with
+			print("{:<{}} {:>10} {:>10.4f} {:>8} {:>12} {:>8}  {}".format(
+				name, name_length, 'NA', result['wall'], 'NA', result['max_rss_kb'], 'NA', 'no baseline'))
+			continue
+		delta = relative_change(expected['wall'], result['wall'])
+		rss_delta = relative_change(expected['max_rss_kb'], result['max_rss_kb'])
+		if delta > tolerance and result['wall_ci_low'] > expected['wall']:
+			status = 'REGRESSION'
+			regressions.append(name)
+		elif delta > tolerance:
+			status = 'slower, but within the noise'
+		elif delta < -tolerance:
+			status = 'faster'
+		else:
+			status = 'ok'
+		print("{:<{}} {:>10.4f} {:>10.4f} {:>+7.1f}% {:>12} {:>+7.1f}%  {}".format(
+			name, name_length, expected['wall'], result['wall'], 100 * delta,
+			result['max_rss_kb'], 100 * rss_delta, status))
+	return regressions
+
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(prog='perfcheck', usage='%(prog)s [options]',
+									 description="Compare the running time of the mappers with a stored baseline.",
+									 epilog="Exits with status 1 if a benchmark is slower than its baseline "
+									 "or a mapper fails, and with status 3 if there is no usable baseline.")
+	parser.add_argument('-b', '--baseline',
+						help="Baseline JSON file, default evaluation/perf-baseline.local.json if it exists "
+						"and evaluation/perf-baseline.json if not; --update writes the local one by default")
+	parser.add_argument('-t', '--tolerance', type=float,
+						help="How much slower than the baseline a benchmark may be, as a fraction, default 0.1",
+						default=0.1)
+	parser.add_argument('-n', '--runs', type=int, help='Number of measured runs per benchmark, default 5', default=5)
+	parser.add_argument('-w', '--warmup', type=int, help='Number of warm-up runs per benchmark, default 1', default=1)
+	parser.add_argument('--benchmarks', help="Comma-separated benchmarks to run, default all")
+	parser.add_argument('--update', action='store_true', help="Record the results as the new baseline.")
+	parser.add_argument('--data-dir', help="Where to put the generated data, default perfcheck-data",
+						default='perfcheck-data')
+	parser.add_argument('-l', '--log', help="Log file for the mappers' output, default perfcheck.log",
+						default='perfcheck.log')
+
+	args = parser.parse_args()
+	if args.runs < 1:
+		parser.error("we need at least one measured run")
+	names = args.benchmarks.split(',') if args.benchmarks else []
+	unknown = set(names) - set(b[0] for b in BENCHMARKS)
+	if unknown:
+		parser.error("unknown benchmarks: {}".format(', '.join(sorted(unknown))))
+	if args.baseline is None:
+		if args.update or os.path.exists(LOCAL_BASELINE):
+			args.baseline = LOCAL_BASELINE
+		else:
+			args.baseline = SHARED_BASELINE
+	if not args.update:
+		if not os.path.exists(args.baseline):
+			print("There is no baseline in {}; record one for this machine with `make perfcheck_baseline`."
+				  .format(args.baseline), file=sys.stderr)
+			sys.exit(EXIT_NO_BASELINE)
+		with open(args.baseline) as f:
+			baseline = json.load(f)
+		if baseline.get('host') != platform.node():
+			# times from another machine say nothing about this change
+			print("The baseline in {} was recorded on {}, not on this machine, so there is nothing to "
+				  "compare with; record one for this machine with `make perfcheck_baseline`."
+				  .format(args.baseline, baseline.get('host')), file=sys.stderr)
+			sys.exit(EXIT_NO_BASELINE)
+
+	# the preprocessing script expects the mappers in the path
+	os.environ['PATH'] = os.path.abspath(MAPPERS_DIR) + os.pathsep + os.environ['PATH']
+
+	try:
+		with open(args.log, 'a') as log:
+			reference, reads = prepare_data(args.data_dir, log)
+			results = run_benchmarks(names, reference, reads, args.runs, args.warmup, log)
+	except (CommandFailed, subprocess.CalledProcessError) as e:
+		sys.exit(str(e))
+
+	if args.update:
+		baseline = {'benchmarks': {}}
+		if os.path.exists(args.baseline):
+			with open(args.baseline) as f:
+				baseline = json.load(f)
+		baseline.update({
+			'date': datetime.datetime.now().isoformat(timespec='seconds'),
+			'host': platform.node(),
+			'platform': platform.platform(),
+			'runs': args.runs,
+			'warmup_runs': args.warmup,
+		})
+		baseline['benchmarks'].update(results)
+		with open(args.baseline, 'w') as f:
+			json.dump(baseline, f, indent=2)
+			f.write('\n')
+		print("Updated the baseline in {}.".format(args.baseline), file=sys.stderr)
+		sys.exit(0)
+
+	regressions = compare(baseline, results, args.tolerance)
+	if regressions:
+		print("{} slower than the baseline by more than {:.0f}%: {}".format(
+			'One benchmark is' if len(regressions) == 1 else '{} benchmarks are'.format(len(regressions)),
+			100 * args.tolerance, ', '.join(regressions)), file=sys.stderr)
+		sys.exit(EXIT_REGRESSION)
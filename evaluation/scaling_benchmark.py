@@ -0,0 +1,212 @@
+"""
+Program for measuring how the read-mappers scale.
+
+We simulate read sets, with test_tools/simulate_reads, for all combinations
+of read length, edit distance, number of reads and genome size, run each
+mapper on each of them, and report the running time and throughput (reads
+and bases per second). The results go to a JSON file and a tab-separated
+table that analyse-scaling.R plots as scaling curves.
+
+Some mappers fall off a cliff for long reads or large edit distances, so
+we give each run a time limit. If a mapper does not finish a configuration
+in time, we don't try it on any configuration that is at least as large in
+every dimension.
+"""
+
+import argparse
+import glob
+import json
+import os
+import subprocess
+import sys
+
+from benchmark import run_once, summarise, CommandFailed, CommandTimedOut
+
+
+EVALUATION_DIR = os.path.dirname(os.path.abspath(__file__))
+MAPPERS_DIR = os.path.join(EVALUATION_DIR, '..', 'mappers_src')
+TEST_TOOLS_DIR = os.path.join(EVALUATION_DIR, '..', 'test_tools')
+SIMULATOR = os.path.join(TEST_TOOLS_DIR, 'simulate_reads')
+LINE_WIDTH = 60
+
+TABLE_COLUMNS = ['mapper', 'genome_size', 'read_length', 'd', 'reads', 'status',
+				 'wall', 'wall_ci_low', 'wall_ci_high', 'user', 'sys', 'max_rss_kb',
+				 'reads_per_second', 'bases_per_second']
+
+
+def int_list(text):
+	return [int(float(x)) for x in text.split(',')]
+
+
+def all_mappers():
+	"""The mappers the build puts in mappers_src: one per directory ending in _src."""
+	mappers = []
+	for src in sorted(glob.glob(os.path.join(MAPPERS_DIR, '*_src'))):
+		name = os.path.basename(src)[:-len('_src')]
+		if os.access(os.path.join(MAPPERS_DIR, name), os.X_OK):
+			mappers.append(name)
+	return mappers
+
+
+def mapper_command(mapper):
+	"""
+	Like the evaluation scripts, we use the mapper's run-script if it has
+	one. The scripts are run through bash, as the shell that runs them in
+	the evaluation scripts would.
+	"""
+	run_script = os.path.join(EVALUATION_DIR, mapper + '.run')
+	if os.access(run_script, os.X_OK):
+		return ['bash', run_script]
+	return [os.path.join(MAPPERS_DIR, mapper)]
+
+
+def preprocess(mapper, reference, log):
+	script = os.path.join(EVALUATION_DIR, mapper + '.preprocess')
+	if os.access(script, os.X_OK):
+		subprocess.run(['bash', script, reference], stdout=log, stderr=log, check=True)
+
+
+def read_fasta(filename):
+	sequences = []
+	with open(filename) as f:
+		for line in f:
+			line = line.strip()
+			if line and line[0] != '>':
+				sequences.append(line)
+	return ''.join(sequences)
+
+
+def reference_of_size(reference, size, data_dir):
+	"""A reference with the first size bases of the given reference."""
+	if size is None:
+		return os.path.abspath(reference)
+	filename = os.path.join(data_dir, 'ref-{}.fa'.format(size))
+	if not os.path.exists(filename):
+		genome = read_fasta(reference)
+		if size > len(genome):
+			sys.exit("The reference only has {} bases; we can't make a genome of {}.".format(len(genome), size))
+		with open(filename, 'w') as f:
+			print('>ref', file=f)
+			for i in range(0, size, LINE_WIDTH):
+				print(genome[i:min(i + LINE_WIDTH, size)], file=f)
+	return filename
+
+
+def simulated_reads(reference, genome_size, length, d, count, seed, data_dir):
+	filename = os.path.join(data_dir, 'reads-g{}-m{}-d{}-n{}.fq'.format(genome_size, length, d, count))
+	if not os.path.exists(filename):
+		subprocess.run([SIMULATOR, '-n', str(count), '-m', str(length), '-d', str(d),
+						'-s', str(seed), '-t', str(os.cpu_count() or 1), '-o', filename + '.tmp',
+						reference], check=True)
+		os.rename(filename + '.tmp', filename)
+	return filename
+
+
+def dominated(config, failures):
+	"""Is config at least as large as a configuration that already timed out?"""
+	return any(all(c >= f for c, f in zip(config, failure)) for failure in failures)
+
+
+def table_row(mapper, genome_size, length, d, count, status, summary):
+	row = [mapper, genome_size, length, d, count, status]
+	if summary is None:
+		return row + ['NA'] * (len(TABLE_COLUMNS) - len(row))
+	wall = summary['wall']['median']
+	return row + [
+		'{:.4f}'.format(wall),
+		'{:.4f}'.format(summary['wall']['ci_low']),
+		'{:.4f}'.format(summary['wall']['ci_high']),
+		'{:.4f}'.format(summary['user']['median']),
+		'{:.4f}'.format(summary['sys']['median']),
+		summary['max_rss_kb']['median'],
+		'{:.1f}'.format(count / wall),
+		'{:.1f}'.format(count * length / wall),
+	]
+
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(prog='scaling_benchmark', usage='%(prog)s [options] reference',
+									 description="Measure how the read-mappers scale with the size of the data.")
+	parser.add_argument('reference', help="Reference genome to simulate reads from.")
+	parser.add_argument('--mappers', help="Comma-separated mappers to run, default all in mappers_src")
+	parser.add_argument('--lengths', type=int_list, help='Read lengths, default 50,100,150,200,250',
+						default=[50, 100, 150, 200, 250])
+	parser.add_argument('--distances', type=int_list, help='Edit distances, default 0,1,2,3', default=[0, 1, 2, 3])
+	parser.add_argument('--counts', type=int_list, help='Numbers of reads, default 1e3,1e4,1e5,1e6',
+						default=[1000, 10000, 100000, 1000000])
+	parser.add_argument('--genome-sizes', type=int_list,
+						help='Genome sizes, as prefixes of the reference, default the full reference')
+	parser.add_argument('-n', '--runs', type=int, help='Number of measured runs per configuration, default 3', default=3)
+	parser.add_argument('-w', '--warmup', type=int, help='Number of warm-up runs per configuration, default 0', default=0)
+	parser.add_argument('-t', '--timeout', type=float, help='Time limit in seconds for a single run, default 600',
+						default=600)
+	parser.add_argument('-s', '--seed', type=int, help='Seed for simulating reads, default 1', default=1)
+	parser.add_argument('--data-dir', help="Where to put simulated data, default scaling-data", default='scaling-data')
+	parser.add_argument('-o', '--json', help="JSON file for the results, default scaling-report.json",
+						default='scaling-report.json')
+	parser.add_argument('-r', '--report', help="Table of the results, default scaling-report.txt",
+						default='scaling-report.txt')
+	parser.add_argument('-l', '--log', help="Log file for the mappers' output, default scaling.log",
+						default='scaling.log')
+
+	args = parser.parse_args()
+	# the preprocessing and run scripts expect the mappers in the path
+	os.environ['PATH'] = os.path.abspath(MAPPERS_DIR) + os.pathsep + os.environ['PATH']
+	mappers = args.mappers.split(',') if args.mappers else all_mappers()
+	genome_sizes = args.genome_sizes if args.genome_sizes else [None]
+	os.makedirs(args.data_dir, exist_ok=True)
+	subprocess.run(['make', '-C', TEST_TOOLS_DIR, 'simulate_reads'], stdout=subprocess.DEVNULL, check=True)
+
+	results = []
+	with open(args.log, 'a') as log, open(args.report, 'w') as report:
+		print('\t'.join(TABLE_COLUMNS), file=report)
+
+		for size in genome_sizes:
+			reference = reference_of_size(args.reference, size, args.data_dir)
+			genome_size = size if size is not None else len(read_fasta(reference))
+
+			for mapper in mappers:
+				print("{} on a genome of {} bases".format(mapper, genome_size), file=sys.stderr)
+				preprocess(mapper, reference, log)
+				failures = []
+
+				for length in sorted(args.lengths):
+					for d in sorted(args.distances):
+						for count in sorted(args.counts):
+							config = (length, d, count)
+							status, samples, summary = 'ok', [], None
+							if dominated(config, failures):
+								status = 'skipped'
+							else:
+								reads = simulated_reads(reference, genome_size, length, d, count,
+														args.seed, args.data_dir)
+								command = mapper_command(mapper) + ['-d', str(d), reference, reads]
+								try:
+									for _ in range(args.warmup):
+										run_once(command, subprocess.DEVNULL, log, args.timeout)
+									for _ in range(args.runs):
+										samples.append(run_once(command, subprocess.DEVNULL, log, args.timeout))
+									summary = summarise(samples, 0.95)
+								except CommandTimedOut:
+									status = 'timeout'
+									failures.append(config)
+								except CommandFailed:
+									status = 'failed'
+									failures.append(config)
+
+							print("  m={} d={} n={}: {}{}".format(
+								length, d, count, status,
+								" {:.3f}s".format(summary['wall']['median']) if summary else ''),
+								file=sys.stderr)
+							results.append({
+								'mapper': mapper, 'genome_size': genome_size,
+								'read_length': length, 'd': d, 'reads': count,
+								'status': status, 'runs': samples, 'summary': summary,
+							})
+							row = table_row(mapper, genome_size, length, d, count, status, summary)
+							print('\t'.join(str(x) for x in row), file=report)
+							report.flush()
+
+	with open(args.json, 'w') as f:
+		json.dump({'timeout': args.timeout, 'seed': args.seed, 'results': results}, f, indent=2)
+		f.write('\n')
@@ -25,6 +25,9 @@ reference=../data/gorGor3-small-noN.fa
 # Reads
 reads=../data/sim-reads-d2-tiny.fq
 
+# Reads with N's in them
+n_reads=../data/sim-reads-n-tiny.fq
+
 ## =============================================================
 
 ## It shouldn't be necessary to touch any of the code below.
@@ -60,6 +63,20 @@ if [ -e $reads ]; then
 else
 	failure_tick "Could not find the reads file. "
 fi
+printf "Testing that the reads file $(tput setaf 4)$(tput bold)${n_reads}$(tput sgr0) exists "
+if [ -e $n_reads ]; then
+	success
+else
+	failure_tick "Could not find the reads file. "
+fi
+
+printf "Building $(tput setaf 4)$(tput bold)test_tools/sam_compare$(tput sgr0) "
+if (cd ../test_tools && make sam_compare) > /dev/null 2>&1; then
+	success
+else
+	failure_tick "Could not build the SAM comparison tool."
+	exit 1
+fi
 
 ## Run evaluation of all mappers...
 if [ -e $report_file ]; then
@@ -98,7 +115,7 @@ else
 	### Constructing reference SAM --------------------------------------------------------------------
 	if [ -x ${ref_mapper}.run ]; then
 		printf "   • Read-mapping using $(tput setaf 4)$(tput bold)evaluation/${ref_mapper}.run$(tput sgr0) "
-		./${ref_mapper}.run -d $d ${reference} ${reads} 2> $log_file | sort > ${ref_mapper}-approx.sam
+		./${ref_mapper}.run -d $d ${reference} ${reads} 2> $log_file > ${ref_mapper}-approx.sam
 		if [ $? -eq 0 ]; then
    			success
 		else
@@ -112,7 +129,7 @@ else
 	else
 		# if we don't have a run script we call the read-mapper directly
 		printf "   • Read-mapping using $(tput setaf 4)$(tput bold)mappers_src/${ref_mapper}$(tput sgr0) "
-		${ref_mapper} -d $d ${reference} ${reads} 2> $log_file | sort > ${ref_mapper}-approx.sam
+		${ref_mapper} -d $d ${reference} ${reads} 2> $log_file > ${ref_mapper}-approx.sam
 		if [ $? -eq 0 ]; then
 			success
 		else
@@ -151,7 +168,7 @@ for mapper in $mappers; do
 		### Constructing reference SAM --------------------------------------------------------------------
 		if [ -x ${mapper}.run ]; then
 			printf "   • Read-mapping using $(tput setaf 4)$(tput bold)evaluation/${mapper}.run$(tput sgr0) "
-			./${mapper}.run -d $d ${reference} ${reads}  2> $log_file | sort > ${mapper}-approx.sam
+			./${mapper}.run -d $d ${reference} ${reads}  2> $log_file > ${mapper}-approx.sam
 			if [ $? -eq 0 ]; then
    				success
 			else
@@ -165,7 +182,7 @@ for mapper in $mappers; do
 		else
 			# if we don't have a run script we call the read-mapper directly
 			printf "   • Read-mapping using $(tput setaf 4)$(tput bold)mappers_src/${mapper}$(tput sgr0) "
-			${mapper} -d $d ${reference} ${reads}  2> $log_file | sort > ${mapper}-approx.sam
+			${mapper} -d $d ${reference} ${reads}  2> $log_file > ${mapper}-approx.sam
 			if [ $? -eq 0 ]; then
 				success
 			else
@@ -177,9 +194,13 @@ for mapper in $mappers; do
 	fi
 	## Compare to reference results
 	printf "   • Comparing $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) to $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) "
-	if ( cmp ${ref_mapper}-approx.sam ${mapper}-approx.sam ); then
+	comparison=`../test_tools/sam_compare ${ref_mapper}-approx.sam ${mapper}-approx.sam 2>&1`
+	if [ $? -eq 0 ]; then
 		success
 	else
+		printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+		echo "$comparison" | sed 's/^/\t/'
+		printf "\t"
 		failure "$(tput bold)${mapper}$(tput sgr0) differs from $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0)"
 		exit 1
 	fi
@@ -187,5 +208,38 @@ for mapper in $mappers; do
 	success
 done
 
+## Reads with N's
+# N is not in the reference, so it can only be matched with an edit
+echo "Mapping reads with N's in them: "
+for mapper in $ref_mapper $mappers; do
+	printf "   • Read-mapping using $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) "
+	if [ -x ${mapper}.run ]; then
+		./${mapper}.run -d $d ${reference} ${n_reads} 2> $log_file > ${mapper}-approx-n.sam
+	else
+		${mapper} -d $d ${reference} ${n_reads} 2> $log_file > ${mapper}-approx-n.sam
+	fi
+	if [ $? -ne 0 ]; then
+		failure_tick "Read-mapping failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+		cat ${log_file}
+		exit 1
+	fi
+	success
+done
+for mapper in $mappers; do
+	printf "   • Comparing $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) to $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) "
+	comparison=`../test_tools/sam_compare ${ref_mapper}-approx-n.sam ${mapper}-approx-n.sam 2>&1`
+	if [ $? -eq 0 ]; then
+		success
+	else
+		printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+		echo "$comparison" | sed 's/^/\t/'
+		printf "\t"
+		failure "$(tput bold)${mapper}$(tput sgr0) differs from $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) on reads with N's"
+		exit 1
+	fi
+done
+printf "   • DONE "
+success
+
 echo -n "All tests passed! "
 success
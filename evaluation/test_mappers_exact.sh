@@ -25,6 +25,9 @@ reference=../data/gorGor3-small-noN.fa
 # Reads
 reads=../data/sim-reads-d2-tiny.fq
 
+# Reads with N's in them
+n_reads=../data/sim-reads-n-tiny.fq
+
 ## =============================================================
 
 ## It shouldn't be necessary to touch any of the code below.
@@ -61,9 +64,24 @@ else
 	failure_tick "Could not find the reads file. "
 	exit 1
 fi
+printf "Testing that the reads file $(tput setaf 4)$(tput bold)${n_reads}$(tput sgr0) exists "
+if [ -e $n_reads ]; then
+	success
+else
+	failure_tick "Could not find the reads file. "
+	exit 1
+fi
 
 
 
+printf "Building $(tput setaf 4)$(tput bold)test_tools/sam_compare$(tput sgr0) "
+if (cd ../test_tools && make sam_compare) > /dev/null 2>&1; then
+	success
+else
+	failure_tick "Could not build the SAM comparison tool."
+	exit 1
+fi
+
 ## Run evaluation of all mappers...
 if [ -e $report_file ]; then
 	rm $report_file
@@ -101,7 +119,7 @@ else
 	### Constructing reference SAM --------------------------------------------------------------------
 	if [ -x ${ref_mapper}.run ]; then
 		printf "   • Read-mapping using $(tput setaf 4)$(tput bold)evaluation/${ref_mapper}.run$(tput sgr0) "
-		./${ref_mapper}.run -d $d ${reference} ${reads} 2> $log_file | sort > ${ref_mapper}-exact.sam
+		./${ref_mapper}.run -d $d ${reference} ${reads} 2> $log_file > ${ref_mapper}-exact.sam
 		if [ $? -eq 0 ]; then
    			success
 		else
@@ -115,7 +133,7 @@ else
 	else
 		# if we don't have a run script we call the read-mapper directly
 		printf "   • Read-mapping using $(tput setaf 4)$(tput bold)mappers_src/${ref_mapper}$(tput sgr0) "
-		${ref_mapper} -d $d ${reference} ${reads} 2> $log_file | sort > ${ref_mapper}-exact.sam
+		${ref_mapper} -d $d ${reference} ${reads} 2> $log_file > ${ref_mapper}-exact.sam
 		if [ $? -eq 0 ]; then
 			success
 		else
@@ -154,7 +172,7 @@ for mapper in $mappers; do
 		### Constructing reference SAM --------------------------------------------------------------------
 		if [ -x ${mapper}.run ]; then
 			printf "   • Read-mapping using $(tput setaf 4)$(tput bold)evaluation/${mapper}.run$(tput sgr0) "
-			./${mapper}.run -d $d ${reference} ${reads}  2> $log_file | sort > ${mapper}-exact.sam
+			./${mapper}.run -d $d ${reference} ${reads}  2> $log_file > ${mapper}-exact.sam
 			if [ $? -eq 0 ]; then
    				success
 			else
@@ -168,7 +186,7 @@ for mapper in $mappers; do
 		else
 			# if we don't have a run script we call the read-mapper directly
 			printf "   • Read-mapping using $(tput setaf 4)$(tput bold)mappers_src/${mapper}$(tput sgr0) "
-			${mapper} -d $d ${reference} ${reads}  2> $log_file | sort > ${mapper}-exact.sam
+			${mapper} -d $d ${reference} ${reads}  2> $log_file > ${mapper}-exact.sam
 			if [ $? -eq 0 ]; then
 				success
 			else
@@ -180,9 +198,13 @@ for mapper in $mappers; do
 	fi
 	## Compare to reference results
 	printf "   • Comparing $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) to $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) "
-	if ( cmp ${ref_mapper}-exact.sam ${mapper}-exact.sam ); then
+	comparison=`../test_tools/sam_compare ${ref_mapper}-exact.sam ${mapper}-exact.sam 2>&1`
+	if [ $? -eq 0 ]; then
 		success
 	else
+		printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+		echo "$comparison" | sed 's/^/\t/'
+		printf "\t"
 		failure "$(tput bold)${mapper}$(tput sgr0) differs from $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0)"
 		exit 1
 	fi
@@ -190,5 +212,136 @@ for mapper in $mappers; do
 	success
 done
 
+## Reads with N's
+# N is not in the reference, so it can only be matched with an edit
+echo "Mapping reads with N's in them: "
+for mapper in $ref_mapper $mappers; do
+	printf "   • Read-mapping using $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) "
+	if [ -x ${mapper}.run ]; then
+		./${mapper}.run -d $d ${reference} ${n_reads} 2> $log_file > ${mapper}-exact-n.sam
+	else
+		${mapper} -d $d ${reference} ${n_reads} 2> $log_file > ${mapper}-exact-n.sam
+	fi
+	if [ $? -ne 0 ]; then
+		failure_tick "Read-mapping failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+		cat ${log_file}
+		exit 1
+	fi
+	success
+done
+for mapper in $mappers; do
+	printf "   • Comparing $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) to $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) "
+	comparison=`../test_tools/sam_compare ${ref_mapper}-exact-n.sam ${mapper}-exact-n.sam 2>&1`
+	if [ $? -eq 0 ]; then
+		success
+	else
+		printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+		echo "$comparison" | sed 's/^/\t/'
+		printf "\t"
+		failure "$(tput bold)${mapper}$(tput sgr0) differs from $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) on reads with N's"
+		exit 1
+	fi
+done
+printf "   • DONE "
+success
+
+## Reading from pipes
+echo "Reading the input from pipes: "
+for mapper in $ref_mapper $mappers; do
+	# mappers with a run script may not read their input as a stream
+	if [ -e ${mapper}.run ]; then
+		continue
+	fi
+	printf "   • Reads through a pipe to $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) "
+	cat ${reads} | ${mapper} -d $d ${reference} /dev/stdin 2> $log_file > ${mapper}-exact-pipe.sam
+	if [ $? -ne 0 ]; then
+		failure_tick "Read-mapping failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+		cat ${log_file}
+		exit 1
+	fi
+	comparison=`../test_tools/sam_compare ${mapper}-exact.sam ${mapper}-exact-pipe.sam 2>&1`
+	if [ $? -eq 0 ]; then
+		success
+	else
+		printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+		echo "$comparison" | sed 's/^/\t/'
+		printf "\t"
+		failure "$(tput bold)${mapper}$(tput sgr0) maps reads from a pipe differently"
+		exit 1
+	fi
+	printf "   • Compressed reads through a pipe to $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) "
+	gzip -c ${reads} | ${mapper} -d $d ${reference} /dev/stdin 2> $log_file > ${mapper}-exact-pipe.sam
+	if [ $? -ne 0 ]; then
+		failure_tick "Read-mapping failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+		cat ${log_file}
+		exit 1
+	fi
+	comparison=`../test_tools/sam_compare ${mapper}-exact.sam ${mapper}-exact-pipe.sam 2>&1`
+	if [ $? -eq 0 ]; then
+		success
+	else
+		printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+		echo "$comparison" | sed 's/^/\t/'
+		printf "\t"
+		failure "$(tput bold)${mapper}$(tput sgr0) maps compressed reads from a pipe differently"
+		exit 1
+	fi
+	rm ${mapper}-exact-pipe.sam
+done
+# only the online mappers read the reference itself; bw_readmapper
+# needs its preprocessed tables next to the reference file
+printf "   • Reference through a pipe to $(tput setaf 4)$(tput bold)${ref_mapper}$(tput sgr0) "
+${ref_mapper} -d $d <(cat ${reference}) ${reads} 2> $log_file > ${ref_mapper}-exact-pipe.sam
+if [ $? -ne 0 ]; then
+	failure_tick "Read-mapping failed. Check $(tput setaf 4)$(tput bold)`basename ${log_file}`$(tput sgr0) for further information."
+	cat ${log_file}
+	exit 1
+fi
+comparison=`../test_tools/sam_compare ${ref_mapper}-exact.sam ${ref_mapper}-exact-pipe.sam 2>&1`
+if [ $? -eq 0 ]; then
+	success
+else
+	printf "$(tput setaf 1)$(tput bold)✘$(tput sgr0)\n"
+	echo "$comparison" | sed 's/^/\t/'
+	printf "\t"
+	failure "$(tput bold)${ref_mapper}$(tput sgr0) maps against a reference from a pipe differently"
+	exit 1
+fi
+rm ${ref_mapper}-exact-pipe.sam
+printf "   • DONE "
+success
+
+## Reusing the .fai index of a reference
+# A reference rewritten right after it was indexed has the same time
+# stamp as its index, so the mappers must notice from the contents
+# that the index no longer fits. GGGGCC is in b in the first reference
+# and only in a, at position 21, in the second.
+echo "Reusing the index of a rewritten reference: "
+fai_dir=`mktemp -d`
+printf "@q\nGGGGCC\n+\n~~~~~~\n" > ${fai_dir}/q.fq
+for mapper in $ref_mapper $mappers; do
+	# mappers with their own preprocessing don't use the .fai index alone
+	if [ -e ${mapper}.run ] || [ -e ${mapper}.preprocess ]; then
+		continue
+	fi
+	printf "   • $(tput setaf 4)$(tput bold)${mapper}$(tput sgr0) "
+	printf ">a\nACGTACGTAC\nGTACGT\n>b\nTTTTGGGGCC\n" > ${fai_dir}/r.fa
+	rm -f ${fai_dir}/r.fa.fai
+	${mapper} -d 0 ${fai_dir}/r.fa ${fai_dir}/q.fq > /dev/null 2> $log_file
+	printf ">a\nACGTACGTACGTA\nCGTACGTGGGGCC\n>b\nAAAAAAAAAA\n" > ${fai_dir}/r.fa
+	touch -r ${fai_dir}/r.fa.fai ${fai_dir}/r.fa
+	hits=`${mapper} -d 0 ${fai_dir}/r.fa ${fai_dir}/q.fq 2> $log_file | grep -v '^@' | cut -f3,4 | tr '\t\n' ': '`
+	if [ "$hits" == "a:21 " ]; then
+		success
+	else
+		failure_tick "$(tput bold)${mapper}$(tput sgr0) used a stale index and reported ${hits:-no hits} instead of a:21"
+		rm -r ${fai_dir}
+		exit 1
+	fi
+done
+rm -r ${fai_dir}
+printf "   • DONE "
+success
+
 echo -n "All tests passed! "
 success
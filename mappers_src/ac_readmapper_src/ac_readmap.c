@@ -6,11 +6,18 @@
 
 #include "fasta.h"
 #include "fastq.h"
+#include "input_file.h"
 #include "sam.h"
-#include "string_vector_vector.h"
+#include "string_pool.h"
+#include "size_vector.h"
 #include "aho_corasick.h"
 #include "edit_distance_generator.h"
 #include "options.h"
+#include "hit_list.h"
+#include "read_cache.h"
+#include "strings.h"
+#include "read_trimming.h"
+#include "mapper_stats.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -18,138 +25,235 @@
 #include <getopt.h>
 #include <assert.h>
 
-struct search_info {
-    struct fasta_records *records;
-    struct options *options;
-    FILE *sam_file;
-};
-
-static struct search_info *empty_search_info(struct options *options)
-{
-    struct search_info *info =
-        (struct search_info*)malloc(sizeof(struct search_info));
-    info->options = options;
-    info->records = empty_fasta_records();
-    return info;
-}
-
-static void delete_search_info(struct search_info *info)
-{
-    delete_fasta_records(info->records);
-    free(info);
-}
+#define READ_CACHE_BATCH_SIZE 100000
 
 struct read_search_info {
     const char *ref_name;
-    const char *read_name;
     const char *read;
-    const char *quality;
-    FILE *sam_file;
+    struct hit_list *hits;
     
-    struct string_vector *patterns;
-    struct string_vector_vector *cigars;
+    // The patterns and CIGARs go in pools that we clear between reads,
+    // so we don't allocate for each pattern. A pattern can have several
+    // CIGARs; they form a list, from first_cigar through next_cigar, in
+    // the order we generated them.
+    struct string_pool *patterns;
+    struct size_vector *first_cigar;
+    struct size_vector *last_cigar;
+    struct string_pool *cigars;
+    struct size_vector *next_cigar;
     struct trie *patterns_trie;
+    
+    // Both the neighbours of the read and of its reverse complement
+    // go in the same trie. We generate the reverse strand's neighbours
+    // last, so the CIGARs from first_reverse_cigar and on are for the
+    // reverse strand.
+    size_t first_reverse_cigar;
 };
 
+#define NO_CIGAR ((size_t)-1)
+
 static struct read_search_info *empty_read_search_info()
 {
     struct read_search_info *info =
         (struct read_search_info*)malloc(sizeof(struct read_search_info));
     
     info->ref_name = 0;
-    info->read_name = 0;
     info->read = 0;
-    info->quality = 0;
+    info->hits = 0;
     
-    info->patterns = empty_string_vector(256); // arbitrary start size...
-    info->cigars = empty_string_vector_vector(256); // arbitrary start size...
-    info->patterns_trie = empty_trie();
+    // the buffers keep the subsystem when they grow
+    enum stats_memory subsystem = set_memory_subsystem(MEM_CLOUD);
+    info->patterns = empty_string_pool(256); // arbitrary start size...
+    info->first_cigar = empty_size_vector(256);
+    info->last_cigar = empty_size_vector(256);
+    info->cigars = empty_string_pool(256);
+    info->next_cigar = empty_size_vector(256);
+    set_memory_subsystem(subsystem);
+    info->patterns_trie = 0;
+    info->first_reverse_cigar = NO_CIGAR;
     
     return info;
 }
 
 static void delete_read_search_info(struct read_search_info *info)
 {
-    delete_string_vector(info->patterns);
-    delete_string_vector_vector(info->cigars);
-    delete_trie(info->patterns_trie);
+    delete_string_pool(info->patterns);
+    delete_size_vector(info->first_cigar);
+    delete_size_vector(info->last_cigar);
+    delete_string_pool(info->cigars);
+    delete_size_vector(info->next_cigar);
+    if (info->patterns_trie) delete_trie(info->patterns_trie);
+    free(info);
+}
+
+// get ready for the next read, keeping the memory we have
+static void clear_read_search_info(struct read_search_info *info)
+{
+    clear_string_pool(info->patterns);
+    clear_size_vector(info->first_cigar);
+    clear_size_vector(info->last_cigar);
+    clear_string_pool(info->cigars);
+    clear_size_vector(info->next_cigar);
+    if (info->patterns_trie) delete_trie(info->patterns_trie);
+    enum stats_memory subsystem = set_memory_subsystem(MEM_TRIE);
+    info->patterns_trie = empty_trie();
+    set_memory_subsystem(subsystem);
+    info->first_reverse_cigar = NO_CIGAR;
+}
+
+struct search_info {
+    struct fasta_records *records;
+    struct options *options;
+    struct sam_writer *sam_writer;
+    struct read_cache *read_cache;
+    struct read_search_info *read_search_info; // reused for each read
+};
+
+static struct search_info *empty_search_info(struct options *options)
+{
+    struct search_info *info =
+        (struct search_info*)malloc(sizeof(struct search_info));
+    info->options = options;
+    info->records = empty_fasta_records();
+    info->read_cache = empty_read_cache(READ_CACHE_BATCH_SIZE);
+    info->read_search_info = empty_read_search_info();
+    return info;
+}
+
+static void delete_search_info(struct search_info *info)
+{
+    delete_fasta_records(info->records);
+    delete_read_cache(info->read_cache);
+    delete_read_search_info(info->read_search_info);
     free(info);
 }
 
 static void build_trie_callback(const char *pattern, const char *cigar, void * data)
 {
     struct read_search_info *info = (struct read_search_info*)data;
+    count_stat(COUNT_PATTERNS, 1);
+    switch_timer(TIME_CLOUD_GENERATION, TIME_AUTOMATON_BUILD);
+    size_t cigar_index = add_pool_string(info->cigars, cigar);
+    add_size(info->next_cigar, NO_CIGAR);
     
     // patterns generated when we explore the neighbourhood of a read are not unique
     // so we need to check if we have seen it before
-    if (string_in_trie(info->patterns_trie, pattern)) {
+    struct trie *node = get_trie_node(info->patterns_trie, pattern);
+    if (node && node->string_label >= 0) {
         // The pattern is already in the tree, but if we are called here
         // we have a new CIGAR for the same pattern.
-        struct trie *node = get_trie_node(info->patterns_trie, pattern);
-        add_string_copy_to_vector(info->cigars, node->string_label, cigar);
+        size_t index = (size_t)node->string_label;
+        info->next_cigar->sizes[info->last_cigar->sizes[index]] = cigar_index;
+        info->last_cigar->sizes[index] = cigar_index;
 
     } else {
-        // NB: the order is important here -- info->patterns->used will be updated
-        // when we add the pattern to the vector, so we insert in the trie first.
-        int index = append_vector(info->cigars);
-        add_string_to_trie(info->patterns_trie, pattern, index);
-        add_string_copy(info->patterns, pattern);
-        add_string_copy_to_vector(info->cigars, index, cigar);
+        size_t index = add_pool_string(info->patterns, pattern);
+        enum stats_memory subsystem = set_memory_subsystem(MEM_TRIE);
+        add_string_to_trie(info->patterns_trie, pattern, (int)index);
+        set_memory_subsystem(subsystem);
+        add_size(info->first_cigar, cigar_index);
+        add_size(info->last_cigar, cigar_index);
     }
+    switch_timer(TIME_AUTOMATON_BUILD, TIME_CLOUD_GENERATION);
 }
 
 static void match_callback(int string_label, size_t index, void * data)
 {
     struct read_search_info *info = (struct read_search_info*)data;
-    const char *str = info->patterns->strings[string_label];
-    struct string_vector *cigars = info->cigars->string_vectors[string_label];
-    size_t n = strlen(str);
+    size_t n = pool_string_length(info->patterns, (size_t)string_label);
     size_t start_index = index - n + 1 + 1; // +1 for start correction and +1 for 1-indexed
-    for (int i = 0; i < cigars->used; i++) {
-        sam_line(info->sam_file,
-                 info->read_name, info->ref_name, start_index,
-                 cigars->strings[i],
-                 info->read,
-                 info->quality);
+    for (size_t i = info->first_cigar->sizes[string_label];
+         i != NO_CIGAR; i = info->next_cigar->sizes[i]) {
+        add_hit(info->hits, info->ref_name, start_index,
+                pool_string(info->cigars, i),
+                i >= info->first_reverse_cigar);
     }
 }
 
 static void read_callback(const char *read_name,
-                          const char *read,
+                          const char *sequence,
                           const char *quality,
                           void * callback_data) {
     struct search_info *search_info = (struct search_info*)callback_data;
+    struct options *options = search_info->options;
+    count_stat(COUNT_READS, 1);
+    
+    // we search for the trimmed and masked read
+    size_t length = strlen(sequence);
+    size_t clip = quality_trim_length(quality, length, options->trim_quality);
+    char read[length - clip + 1];
+    size_t no_ns = mask_read(sequence, read, length - clip);
+    
+    // we only search for a read the first time we see it in a batch
+    struct hit_list *hits = cached_hits(search_info->read_cache, read);
+    if (!hits && options->max_n >= 0 && no_ns > (size_t)options->max_n) {
+        // we don't search for it, so it has no hits
+        hits = new_cached_hits(search_info->read_cache, read);
     
-    // I allocate and deallocate the info all the time... I might
-    // be able to save some time by not doing this, but compared to
-    // building and removeing the trie, I don't think it will be much.
-    struct read_search_info *info = empty_read_search_info();
-    info->sam_file = search_info->sam_file;
-    info->read = read;
-    info->quality = quality;
-    
-    generate_all_neighbours(read, "ACGT", search_info->options->edit_distance,
-                            build_trie_callback, info, search_info->options);
-    compute_failure_links(info->patterns_trie);
-    
-    info->read_name = read_name;
-    for (int i = 0; i < search_info->records->names->used; ++i) {
-        info->ref_name = search_info->records->names->strings[i];
-        const char *ref = search_info->records->sequences->strings[i];
-        size_t n = search_info->records->seq_sizes->sizes[i];
-        aho_corasick_match(ref, n, info->patterns_trie, match_callback, info);
+    } else if (!hits) {
+        hits = new_cached_hits(search_info->read_cache, read);
+        count_stat(COUNT_READS_SEARCHED, 1);
+        
+        // inserting the neighbours in the trie counts as building the
+        // automaton; build_trie_callback() switches timers for it
+        switch_timer(TIME_FASTQ_PARSE, TIME_AUTOMATON_BUILD);
+        struct read_search_info *info = search_info->read_search_info;
+        clear_read_search_info(info);
+        switch_timer(TIME_AUTOMATON_BUILD, TIME_CLOUD_GENERATION);
+        info->read = read;
+        info->hits = hits;
+        
+        generate_all_neighbours(read, "ACGT", search_info->options->edit_distance,
+                                build_trie_callback, info, search_info->options);
+        // the reverse strand's neighbours go in the same automaton
+        if (!search_info->options->forward_only) {
+            size_t n = strlen(read);
+            char rev_read[n + 1];
+            reverse_complement(read, rev_read, n);
+            info->first_reverse_cigar = info->cigars->used;
+            generate_all_neighbours(rev_read, "ACGT",
+                                    search_info->options->edit_distance,
+                                    build_trie_callback, info,
+                                    search_info->options);
+        }
+        switch_timer(TIME_CLOUD_GENERATION, TIME_AUTOMATON_BUILD);
+        enum stats_memory subsystem = set_memory_subsystem(MEM_TRIE);
+        compute_failure_links(info->patterns_trie);
+        set_memory_subsystem(subsystem);
+        switch_timer(TIME_AUTOMATON_BUILD, TIME_SEARCH);
+        
+        for (int i = 0; i < search_info->records->names->used; ++i) {
+            info->ref_name = pool_string(search_info->records->names, i);
+            const char *ref = search_info->records->sequences->strings[i];
+            size_t n = search_info->records->seq_sizes->sizes[i];
+            aho_corasick_match(ref, n, info->patterns_trie, match_callback, info);
+        }
+        count_stat(COUNT_HITS, hits->used);
+        switch_timer(TIME_SEARCH, TIME_FASTQ_PARSE);
     }
     
-    delete_read_search_info(info);
+    switch_timer(TIME_FASTQ_PARSE, TIME_SAM_OUTPUT);
+    write_hits(search_info->sam_writer, hits, read_name, sequence, quality, clip);
+    switch_timer(TIME_SAM_OUTPUT, TIME_FASTQ_PARSE);
 }
 
 int main(int argc, char * argv[])
 {
     const char *prog_name = argv[0];
+    // before getopt_long() reorders the arguments
+    char *command_line = sam_command_line(argc, argv);
+    const char *output = 0;
+    const char *stats_file = 0;
+    bool perf_counters = false;
+    enum sam_format output_format = SAM_FORMAT;
+    int no_threads = 1;
     
     struct options options;
     options.edit_distance = 0;
     options.extended_cigars = false;
+    options.forward_only = false;
+    options.trim_quality = 0;
+    options.max_n = -1;
     options.verbose = false;
     
     int opt;
@@ -157,16 +261,37 @@ int main(int argc, char * argv[])
         { "help",       no_argument,            NULL,           'h' },
         { "distance",   required_argument,      NULL,           'd' },
         { "extended-cigar",   no_argument,      NULL,           'x' },
+        { "forward-only",     no_argument,      NULL,           'f' },
+        { "trim-quality", required_argument,    NULL,           'q' },
+        { "max-n",      required_argument,      NULL,           'N' },
+        { "output",     required_argument,      NULL,           'o' },
+        { "output-format", required_argument,   NULL,           'O' },
+        { "threads",    required_argument,      NULL,           't' },
+        { "stats",      required_argument,      NULL,           'S' },
+        { "perf-counters", no_argument,         NULL,           'P' },
         { NULL,         0,                      NULL,            0  }
     };
-    while ((opt = getopt_long(argc, argv, "hd:x", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hd:xfq:N:o:O:t:S:P", longopts, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 printf("Usage: %s [options] ref.fa reads.fq\n\n", prog_name);
                 printf("Options:\n");
                 printf("\t-h | --help:\t\t Show this message.\n");
                 printf("\t-x | --extended-cigar:\t Use extended CIGAR format in SAM output.\n");
+                printf("\t-f | --forward-only:\t Don't search for the reverse complement of the reads.\n");
+                printf("\t-q | --trim-quality:\t Trim the 3' end of reads where the quality is below this\n"
+                       "\t\t\t and soft-clip it in the output (default 0, no trimming).\n");
+                printf("\t-N | --max-n:\t\t Skip reads with more Ns than this (default no limit).\n");
                 printf("\t-d | --distance:\t Maximum edit distance for the search.\n");
+                printf("\t-o | --output:\t\t Write the SAM output to this file (default stdout).\n");
+                printf("\t-O | --output-format:\t Output format, sam (default) or bam.\n");
+                printf("\t-t | --threads:\t\t Number of threads for BAM compression (default 1).\n");
+                printf("\t-S | --stats:\t\t Write the time spent in each phase, counts of the\n"
+                       "\t\t\t work done and the peak memory use, as JSON, to this\n"
+                       "\t\t\t file.\n");
+                printf("\t-P | --perf-counters:\t Also count cycles, instructions, cache misses, branch\n"
+                       "\t\t\t mispredictions and TLB misses per phase, with the\n"
+                       "\t\t\t hardware counters. Needs --stats and Linux.\n");
                 printf("\n\n");
                 return EXIT_SUCCESS;
                 
@@ -177,7 +302,46 @@ int main(int argc, char * argv[])
             case 'x':
                 options.extended_cigars = true;
                 break;
+            
+            case 'f':
+                options.forward_only = true;
+                break;
+            
+            case 'q':
+                options.trim_quality = atoi(optarg);
+                break;
+            
+            case 'N':
+                options.max_n = atoi(optarg);
+                break;
+                
+            case 'o':
+                output = optarg;
+                break;
+                
+            case 'O':
+                if (!parse_sam_format(optarg, &output_format)) {
+                    fprintf(stderr, "Unknown output format %s.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
                 
+            case 't':
+                no_threads = atoi(optarg);
+                if (no_threads < 1) {
+                    fprintf(stderr, "The number of threads must be positive.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+                
+            case 'S':
+                stats_file = optarg;
+                break;
+            
+            case 'P':
+                perf_counters = true;
+                break;
+            
             default:
                 fprintf(stderr, "Usage: %s [options] ref.fa reads.fq\n", prog_name);
                 return EXIT_FAILURE;
@@ -190,28 +354,69 @@ int main(int argc, char * argv[])
         fprintf(stderr, "Usage: %s [options] ref.fa reads.fq\n", prog_name);
         return EXIT_FAILURE;
     }
-    
-    FILE *fasta_file = fopen(argv[0], "r");
-    if (!fasta_file) {
-        fprintf(stderr, "Could not open %s.\n", argv[0]);
+    if (perf_counters && !stats_file) {
+        fprintf(stderr, "--perf-counters needs --stats to write the counts to.\n");
         return EXIT_FAILURE;
     }
+    if (stats_file) enable_stats();
+    if (perf_counters && !enable_perf_counters())
+        fprintf(stderr, "Could not open any hardware performance counters.\n");
     
-    FILE *fastq_file = fopen(argv[1], "r");
+    struct input_file *fastq_file = open_input_file(argv[1]);
     if (!fastq_file) {
         fprintf(stderr, "Could not open %s.\n", argv[1]);
         return EXIT_FAILURE;
     }
     
     struct search_info *search_info = empty_search_info(&options);
-    read_fasta_records(search_info->records, fasta_file);
-    fclose(fasta_file);
+    start_timer(TIME_INDEX_LOAD);
+    if (0 != load_fasta_records(search_info->records, argv[0])) {
+        fprintf(stderr, "Could not read FASTA file.\n");
+        close_input_file(fastq_file);
+        delete_search_info(search_info);
+        return EXIT_FAILURE;
+    }
+    stop_timer(TIME_INDEX_LOAD);
     
-    search_info->sam_file = stdout;
+    FILE *sam_file = stdout;
+    if (output) {
+        sam_file = fopen(output, "w");
+        if (!sam_file) {
+            fprintf(stderr, "Could not open %s.\n", output);
+            return EXIT_FAILURE;
+        }
+    }
+    // The search always builds extended CIGARs, since we need the
+    // mismatches for the NM tag; the writer collapses them to 'M'
+    // operations unless we were asked for extended CIGARs.
+    search_info->sam_writer = empty_sam_writer(sam_file, output_format,
+                                               options.extended_cigars,
+                                               (size_t)no_threads);
+    options.extended_cigars = true;
+    write_sam_header(search_info->sam_writer,
+                     search_info->records->names,
+                     search_info->records->seq_sizes,
+                     "ac_readmapper", command_line);
+    free(command_line);
     
-    scan_fastq(fastq_file, read_callback, search_info);
+    // the read callback switches from parsing to the other phases
+    // and back again
+    start_timer(TIME_FASTQ_PARSE);
+    scan_fastq(fastq_file->file, read_callback, search_info);
+    stop_timer(TIME_FASTQ_PARSE);
+    // the writer flushes the last of the output when we delete it
+    start_timer(TIME_SAM_OUTPUT);
+    delete_sam_writer(search_info->sam_writer);
+    stop_timer(TIME_SAM_OUTPUT);
     delete_search_info(search_info);
-    fclose(fastq_file);
+    close_input_file(fastq_file);
+    if (sam_file != stdout)
+        fclose(sam_file);
+    
+    if (stats_file && 0 != write_stats(stats_file, "ac_readmapper")) {
+        fprintf(stderr, "Could not write statistics to %s.\n", stats_file);
+        return EXIT_FAILURE;
+    }
     
     return EXIT_SUCCESS;
 }
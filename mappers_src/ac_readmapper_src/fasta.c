@@ -1,39 +1,61 @@
+// for mmap(), fstat() and st_mtim
+#define _POSIX_C_SOURCE 200809L
 
 #include "fasta.h"
 #include "strings.h"
+#include "input_file.h"
+#include "mapper_stats.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 struct fasta_records *empty_fasta_records()
 {
     struct fasta_records *records =
-        (struct fasta_records*)malloc(sizeof(struct fasta_records));
-    records->names = empty_string_vector(10); // arbitrary size...
+        (struct fasta_records*)tracked_malloc(sizeof(struct fasta_records));
+    records->names = empty_string_pool(10); // arbitrary size...
     records->sequences = empty_string_vector(10); // arbitrary size...
     records->seq_sizes = empty_size_vector(10); // arbitrary size...
+    records->mapping = 0;
+    records->mapping_size = 0;
     return records;
 }
 
 void delete_fasta_records(struct fasta_records *records)
 {
-    delete_string_vector(records->names);
+    if (records->mapping) {
+        // the sequences that point into the mapping are not ours to free
+        for (size_t i = 0; i < records->sequences->used; i++) {
+            char *seq = records->sequences->strings[i];
+            if (seq >= records->mapping &&
+                seq < records->mapping + records->mapping_size)
+                records->sequences->strings[i] = 0;
+        }
+        munmap(records->mapping, records->mapping_size);
+        count_memory(MEM_REFERENCE, records->mapping_size, true);
+    }
+    delete_string_pool(records->names);
     delete_string_vector(records->sequences);
     delete_size_vector(records->seq_sizes);
-    free(records);
+    tracked_free(records);
 }
 
 #define MAX_LINE_SIZE 1024
 int read_fasta_records(struct fasta_records *records, FILE *file)
 {
     char buffer[MAX_LINE_SIZE];
-    fgets(buffer, MAX_LINE_SIZE, file);
-    if (buffer[0] != '>') return -1;
+    if (!fgets(buffer, MAX_LINE_SIZE, file) || buffer[0] != '>') return -1;
+    enum stats_memory subsystem = set_memory_subsystem(MEM_REFERENCE);
     
     size_t seq_size = MAX_LINE_SIZE;
     size_t n = 0;
-    char *seq = malloc(seq_size);
+    char *seq = tracked_malloc(seq_size);
     
     // copy the name from the header
     char *header  = strtok(buffer+1, "\n");
@@ -43,9 +65,10 @@ int read_fasta_records(struct fasta_records *records, FILE *file)
         
         if (buffer[0] == '>') {
             // new sequence...
-            add_string_copy(records->names, name); free(name);
+            add_pool_string(records->names, name); tracked_free(name);
+            seq[n] = '\0';
             add_string_copy(records->sequences, seq); // don't free...reuse by setting n = 0
-            add_size(records->seq_sizes, strlen(seq));
+            add_size(records->seq_sizes, n);
             n = 0;
             
             header  = strtok(buffer+1, "\n");
@@ -61,18 +84,360 @@ int read_fasta_records(struct fasta_records *records, FILE *file)
             
             if (n == seq_size) {
                 seq_size *= 2;
-                seq = (char*)realloc(seq, seq_size);
+                seq = (char*)tracked_realloc(seq, seq_size);
             }
         }
     }
     
     // handle last record...
-    add_string_copy(records->names, name);
+    seq[n] = '\0';
+    add_pool_string(records->names, name);
     add_string_copy(records->sequences, seq);
-    add_size(records->seq_sizes, strlen(seq));
+    add_size(records->seq_sizes, n);
+
+    tracked_free(name);
+    tracked_free(seq);
+    set_memory_subsystem(subsystem);
+    
+    return 0;
+}
+
+/*
+ Loading memory mapped files. The index has the same format as the
+ .fai files from samtools faidx: a line per sequence with its name, its
+ length, the offset of its first base in the file, and the number of
+ bases and of bytes on each of its lines. With the index we know where
+ all the lines of a sequence are without looking at the bases, so we
+ copy them with memcpy(). A sequence on a single line we don't copy at
+ all: we put a '\0' over the newline after it and use it where it is.
+ The mapping is private, so that only changes our copy of the page.
+ */
+
+struct fai_entry {
+    char *name;
+    size_t length;
+    size_t offset;
+    size_t line_bases;
+    size_t line_width;
+};
+
+struct fai_index {
+    struct fai_entry *entries;
+    size_t size;
+    size_t used;
+};
+
+static struct fai_index *empty_fai_index(void)
+{
+    struct fai_index *index = (struct fai_index*)tracked_malloc(sizeof(struct fai_index));
+    index->size = 16; // arbitrary size...
+    index->used = 0;
+    index->entries = (struct fai_entry*)tracked_malloc(index->size * sizeof(struct fai_entry));
+    return index;
+}
+
+static void clear_fai_index(struct fai_index *index)
+{
+    for (size_t i = 0; i < index->used; i++) {
+        tracked_free(index->entries[i].name);
+    }
+    index->used = 0;
+}
+
+static void delete_fai_index(struct fai_index *index)
+{
+    clear_fai_index(index);
+    tracked_free(index->entries);
+    tracked_free(index);
+}
+
+static void add_fai_entry(struct fai_index *index, struct fai_entry entry)
+{
+    if (index->used == index->size) {
+        index->size *= 2;
+        index->entries = (struct fai_entry*)tracked_realloc(index->entries,
+                                                            index->size * sizeof(struct fai_entry));
+    }
+    index->entries[index->used++] = entry;
+}
+
+static bool is_line_end(const char *data, size_t size, size_t pos)
+{
+    return pos == size || data[pos] == '\n' || data[pos] == '\r';
+}
+
+// Does the entry describe the sequence whose header starts at header in
+// the file as it is now? The time stamps can't tell us if the file was
+// rewritten right after we indexed it, so we check that the header has
+// the entry's name, that the lines end where the entry says they do,
+// and that the next header, or the end of the file, comes right after
+// the sequence. We return where that is in next_header.
+static bool valid_fai_entry(const struct fai_entry *entry,
+                            const char *data, size_t size,
+                            size_t header, size_t *next_header)
+{
+    if (header >= size || data[header] != '>' ||
+        entry->offset <= header + 1 || entry->offset > size ||
+        data[entry->offset - 1] != '\n' ||
+        memchr(data + header, '\n', entry->offset - 1 - header))
+        return false;
+    
+    size_t name_begin = header + 1;
+    size_t name_length = strlen(entry->name);
+    while (name_begin < entry->offset - 1 && isspace((unsigned char)data[name_begin]))
+        name_begin++;
+    if (name_begin + name_length >= entry->offset ||
+        memcmp(data + name_begin, entry->name, name_length) != 0 ||
+        !isspace((unsigned char)data[name_begin + name_length]))
+        return false;
+    
+    size_t end = entry->offset; // just after the last base
+    if (entry->length > 0) {
+        if (entry->line_bases == 0 || entry->line_width < entry->line_bases)
+            return false;
+        size_t full_lines = (entry->length - 1) / entry->line_bases;
+        for (size_t line = 0; line < full_lines; line++) {
+            size_t newline = entry->offset + line * entry->line_width + entry->line_bases;
+            if (newline >= size || !is_line_end(data, size, newline))
+                return false;
+        }
+        end = entry->offset + full_lines * entry->line_width
+              + (entry->length - 1) % entry->line_bases + 1;
+        if (end > size || !is_line_end(data, size, end))
+            return false;
+    }
+    
+    while (end < size && is_line_end(data, size, end))
+        end++;
+    *next_header = end;
+    return true;
+}
+
+static bool newer_or_same(const struct stat *a, const struct stat *b)
+{
+    return a->st_mtim.tv_sec > b->st_mtim.tv_sec ||
+           (a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+            a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec);
+}
+
+// Read the index if it is there, at least as new as the FASTA file,
+// and matches the (mapped) file.
+static bool read_fai_index(struct fai_index *index, const char *fai_filename,
+                           const struct stat *fasta_stat,
+                           const char *data, size_t size)
+{
+    struct stat fai_stat;
+    if (stat(fai_filename, &fai_stat) != 0 ||
+        !newer_or_same(&fai_stat, fasta_stat))
+        return false;
+    
+    FILE *file = fopen(fai_filename, "r");
+    if (!file) return false;
+    
+    char name[MAX_LINE_SIZE];
+    unsigned long long length, offset, line_bases, line_width;
+    size_t header = 0;
+    int matched;
+    while ((matched = fscanf(file, "%1023s %llu %llu %llu %llu",
+                             name, &length, &offset,
+                             &line_bases, &line_width)) == 5) {
+        struct fai_entry entry = {
+            string_copy(name), (size_t)length, (size_t)offset,
+            (size_t)line_bases, (size_t)line_width
+        };
+        add_fai_entry(index, entry);
+        if (!valid_fai_entry(&entry, data, size, header, &header)) {
+            matched = 0;
+            break;
+        }
+    }
+    fclose(file);
+    
+    // the entries must cover the whole file
+    return matched == EOF && index->used > 0 && header == size;
+}
+
+static void write_fai_index(const struct fai_index *index, const char *fai_filename)
+{
+    // if we cannot write it, e.g. because the directory is read-only,
+    // we will just build it again next time.
+    FILE *file = fopen(fai_filename, "w");
+    if (!file) return;
+    for (size_t i = 0; i < index->used; i++) {
+        const struct fai_entry *entry = &index->entries[i];
+        fprintf(file, "%s\t%zu\t%zu\t%zu\t%zu\n", entry->name, entry->length,
+                entry->offset, entry->line_bases, entry->line_width);
+    }
+    if (fclose(file) != 0)
+        remove(fai_filename);
+}
+
+// Find the end of the line starting at pos and where the next begins.
+static size_t line_end(const char *data, size_t size, size_t pos, size_t *next)
+{
+    const char *newline = memchr(data + pos, '\n', size - pos);
+    if (!newline) {
+        *next = size;
+        return size;
+    }
+    *next = (size_t)(newline - data) + 1;
+    return (size_t)(newline - data);
+}
+
+// Build the index from the mapped file. This fails if the lines of a
+// sequence are not all the same length (except for the last), since
+// then we cannot describe it in the index.
+static bool build_fai_index(struct fai_index *index, const char *data, size_t size)
+{
+    if (size == 0 || data[0] != '>') return false;
+    
+    size_t pos = 0;
+    while (pos < size) {
+        // the header: the name is the first word after '>'
+        size_t next;
+        size_t end = line_end(data, size, pos, &next);
+        size_t name_begin = pos + 1;
+        while (name_begin < end && isspace((unsigned char)data[name_begin]))
+            name_begin++;
+        size_t name_end = name_begin;
+        while (name_end < end && !isspace((unsigned char)data[name_end]))
+            name_end++;
+        
+        struct fai_entry entry;
+        entry.name = (char*)tracked_malloc(name_end - name_begin + 1);
+        memcpy(entry.name, data + name_begin, name_end - name_begin);
+        entry.name[name_end - name_begin] = '\0';
+        entry.length = 0;
+        entry.offset = next;
+        entry.line_bases = entry.line_width = 0;
+        add_fai_entry(index, entry);
+        struct fai_entry *e = &index->entries[index->used - 1];
+        
+        // the sequence lines, up to the next header
+        bool ended = false; // seen a short or an empty line
+        pos = next;
+        while (pos < size && data[pos] != '>') {
+            end = line_end(data, size, pos, &next);
+            size_t width = next - pos;
+            size_t bases = end - pos;
+            if (bases > 0 && data[end - 1] == '\r')
+                bases--;
+            pos = next;
+            
+            if (bases == 0) {
+                ended = true;
+                continue;
+            }
+            if (ended) return false;
+            
+            if (e->line_bases == 0) {
+                e->line_bases = bases;
+                e->line_width = width;
+            } else if (bases > e->line_bases ||
+                       (end < size && // the last line may lack a newline
+                        width - bases != e->line_width - e->line_bases)) {
+                return false;
+            }
+            if (bases < e->line_bases)
+                ended = true;
+            e->length += bases;
+        }
+    }
+    
+    return true;
+}
 
-    free(name);
-    free(seq);
+// The sequence of an index entry, either pointing into the mapping or copied.
+static char *fai_sequence(const struct fai_entry *entry, char *data, size_t size)
+{
+    size_t end = entry->offset + entry->length;
+    if (entry->length > 0 && entry->length <= entry->line_bases &&
+        end < size && (data[end] == '\n' || data[end] == '\r')) {
+        data[end] = '\0';
+        return data + entry->offset;
+    }
+    
+    char *seq = (char*)tracked_malloc(entry->length + 1);
+    size_t copied = 0;
+    const char *line = data + entry->offset;
+    while (copied < entry->length) {
+        size_t n = entry->length - copied;
+        if (n > entry->line_bases) n = entry->line_bases;
+        memcpy(seq + copied, line, n);
+        copied += n;
+        line += entry->line_width;
+    }
+    seq[entry->length] = '\0';
+    return seq;
+}
+
+static int read_fasta_file(struct fasta_records *records, const char *filename)
+{
+    struct input_file *input = open_input_file(filename);
+    if (!input) return -1;
+    int result = read_fasta_records(records, input->file);
+    close_input_file(input);
+    return result;
+}
+
+static int map_fasta_records(struct fasta_records *records, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    
+    struct stat fasta_stat;
+    char *data = MAP_FAILED;
+    if (fstat(fd, &fasta_stat) == 0 && S_ISREG(fasta_stat.st_mode) &&
+        fasta_stat.st_size > 0) {
+        data = mmap(0, (size_t)fasta_stat.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED)
+        return read_fasta_file(records, filename);
+    
+    size_t size = (size_t)fasta_stat.st_size;
+    if (size >= 2 && (unsigned char)data[0] == 0x1f &&
+        (unsigned char)data[1] == 0x8b) {
+        // gzip'ed, so we have to decompress it
+        munmap(data, size);
+        return read_fasta_file(records, filename);
+    }
+    
+    struct fai_index *index = empty_fai_index();
+    char fai_filename[strlen(filename) + 5];
+    sprintf(fai_filename, "%s.fai", filename);
+    if (!read_fai_index(index, fai_filename, &fasta_stat, data, size)) {
+        clear_fai_index(index);
+        if (!build_fai_index(index, data, size)) {
+            // we have to look at every line after all
+            delete_fai_index(index);
+            munmap(data, size);
+            return read_fasta_file(records, filename);
+        }
+        write_fai_index(index, fai_filename);
+    }
+    
+    records->mapping = data;
+    records->mapping_size = size;
+    // we count all of the mapping, although only the pages we touch
+    // are ever read into memory
+    count_memory(MEM_REFERENCE, size, false);
+    for (size_t i = 0; i < index->used; i++) {
+        const struct fai_entry *entry = &index->entries[i];
+        add_pool_string(records->names, entry->name);
+        add_string(records->sequences, fai_sequence(entry, data, size));
+        add_size(records->seq_sizes, entry->length);
+    }
+    delete_fai_index(index);
     
     return 0;
 }
+
+int load_fasta_records(struct fasta_records *records, const char *filename)
+{
+    enum stats_memory subsystem = set_memory_subsystem(MEM_REFERENCE);
+    int result = map_fasta_records(records, filename);
+    set_memory_subsystem(subsystem);
+    return result;
+}
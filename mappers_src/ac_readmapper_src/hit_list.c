@@ -0,0 +1,192 @@
+
+#include "hit_list.h"
+#include "cigar.h"
+#include "strings.h"
+#include "mapper_stats.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct hit_list *empty_hit_list(size_t initial_size)
+{
+    struct hit_list *hits = (struct hit_list*)tracked_malloc(sizeof(struct hit_list));
+    hits->size = initial_size;
+    hits->used = 0;
+    hits->ref_names = (const char**)tracked_malloc(initial_size * sizeof(const char*));
+    hits->positions = (size_t*)tracked_malloc(initial_size * sizeof(size_t));
+    hits->reverse = (bool*)tracked_malloc(initial_size * sizeof(bool));
+    hits->cigars = (size_t*)tracked_malloc(initial_size * sizeof(size_t));
+    
+    hits->cigar_buffer_size = 16 * initial_size; // arbitrary size...
+    hits->cigar_buffer_used = 0;
+    hits->cigar_buffer = (char*)tracked_malloc(hits->cigar_buffer_size);
+    
+    return hits;
+}
+
+void delete_hit_list(struct hit_list *hits)
+{
+    tracked_free(hits->ref_names);
+    tracked_free(hits->positions);
+    tracked_free(hits->reverse);
+    tracked_free(hits->cigars);
+    tracked_free(hits->cigar_buffer);
+    tracked_free(hits);
+}
+
+void clear_hit_list(struct hit_list *hits)
+{
+    hits->used = 0;
+    hits->cigar_buffer_used = 0;
+}
+
+void add_hit(struct hit_list *hits, const char *ref_name,
+             size_t pos, const char *cigar, bool reverse)
+{
+    if (hits->used == hits->size) {
+        hits->size *= 2;
+        hits->ref_names = (const char**)tracked_realloc(hits->ref_names, hits->size * sizeof(const char*));
+        hits->positions = (size_t*)tracked_realloc(hits->positions, hits->size * sizeof(size_t));
+        hits->reverse = (bool*)tracked_realloc(hits->reverse, hits->size * sizeof(bool));
+        hits->cigars = (size_t*)tracked_realloc(hits->cigars, hits->size * sizeof(size_t));
+    }
+    
+    size_t cigar_length = strlen(cigar) + 1;
+    while (hits->cigar_buffer_used + cigar_length > hits->cigar_buffer_size) {
+        hits->cigar_buffer_size *= 2;
+        hits->cigar_buffer = (char*)tracked_realloc(hits->cigar_buffer, hits->cigar_buffer_size);
+    }
+    memcpy(hits->cigar_buffer + hits->cigar_buffer_used, cigar, cigar_length);
+    
+    hits->ref_names[hits->used] = ref_name;
+    hits->positions[hits->used] = pos;
+    hits->reverse[hits->used] = reverse;
+    hits->cigars[hits->used] = hits->cigar_buffer_used;
+    hits->used++;
+    hits->cigar_buffer_used += cigar_length;
+}
+
+/*
+ The SAM fields that depend on the other hits for the read. The best
+ hits are those with the fewest edits, and of those we pick the first
+ by reference, position, strand and CIGAR as the primary hit, so the choice
+ does not depend on the order the search found them in. The rest are
+ secondary.
+ 
+ The mapping quality of the primary hit follows BWA's approximation
+ from the number of best and second-best hits. Since we report every
+ alignment within the edit distance, the same place usually shows up
+ with several CIGARs, so we only count the hits that don't overlap the
+ primary hit on the same strand. Secondary hits get a mapping quality of 0.
+ */
+
+#define MAX_MAPQ 37
+
+static int compare_hits(const struct hit_list *hits, size_t i, size_t j)
+{
+    int cmp = strcmp(hits->ref_names[i], hits->ref_names[j]);
+    if (cmp != 0) return cmp;
+    if (hits->positions[i] != hits->positions[j])
+        return hits->positions[i] < hits->positions[j] ? -1 : 1;
+    if (hits->reverse[i] != hits->reverse[j])
+        return hits->reverse[i] ? 1 : -1;
+    return strcmp(hit_cigar(hits, i), hit_cigar(hits, j));
+}
+
+static bool overlaps(const struct hit_list *hits, size_t i, size_t j,
+                     size_t read_length)
+{
+    if (hits->reverse[i] != hits->reverse[j])
+        return false;
+    if (hits->ref_names[i] != hits->ref_names[j] &&
+        strcmp(hits->ref_names[i], hits->ref_names[j]) != 0)
+        return false;
+    size_t pi = hits->positions[i], pj = hits->positions[j];
+    return (pi < pj ? pj - pi : pi - pj) < read_length;
+}
+
+static unsigned mapping_quality(size_t other_best, size_t second_best)
+{
+    if (other_best > 0) return 0;
+    if (second_best == 0) return MAX_MAPQ;
+    int penalty = (int)(4.343 * log((double)second_best) + 0.5);
+    return penalty < 23 ? (unsigned)(23 - penalty) : 0;
+}
+
+void write_hits(struct sam_writer *writer, const struct hit_list *hits,
+                const char *qname, const char *seq, const char *qual,
+                size_t clip)
+{
+    if (hits->used == 0) return;
+    
+    size_t best = (size_t)-1, no_best = 0, primary = 0;
+    for (size_t i = 0; i < hits->used; i++) {
+        size_t edits = cigar_edit_distance(hit_cigar(hits, i));
+        if (edits < best) {
+            best = edits;
+            no_best = 1;
+            primary = i;
+        } else if (edits == best) {
+            no_best++;
+            if (compare_hits(hits, i, primary) < 0)
+                primary = i;
+        }
+    }
+    
+    size_t read_length = strlen(seq);
+    size_t other_best = 0, second_best = 0;
+    for (size_t i = 0; i < hits->used; i++) {
+        if (overlaps(hits, i, primary, read_length - clip)) continue;
+        size_t edits = cigar_edit_distance(hit_cigar(hits, i));
+        if (edits == best) other_best++;
+        else if (edits == best + 1) second_best++;
+    }
+    
+    // the read as it aligns on the reverse strand, if we need it
+    bool any_reverse = false;
+    for (size_t i = 0; i < hits->used; i++) {
+        any_reverse |= hits->reverse[i];
+    }
+    size_t qual_length = strlen(qual);
+    char rev_seq[any_reverse ? read_length + 1 : 1];
+    char rev_qual[any_reverse ? qual_length + 1 : 1];
+    if (any_reverse) {
+        reverse_complement(seq, rev_seq, read_length);
+        reverse_string(qual, rev_qual, qual_length);
+    }
+    
+    struct sam_hit_info info;
+    info.no_best_hits = no_best;
+    for (size_t i = 0; i < hits->used; i++) {
+        info.edit_distance = cigar_edit_distance(hit_cigar(hits, i));
+        info.score = -(long)info.edit_distance;
+        if (i == primary) {
+            info.flag = 0;
+            info.mapq = mapping_quality(other_best, second_best);
+        } else {
+            info.flag = SAM_SECONDARY;
+            info.mapq = 0;
+        }
+        
+        // the trimmed 3' end is at the front on the reverse strand
+        const char *cigar = hit_cigar(hits, i);
+        char clipped_cigar[clip > 0 ? strlen(cigar) + 44 : 1];
+        if (clip > 0) {
+            soft_clip_cigar(cigar,
+                            hits->reverse[i] ? clip : 0,
+                            hits->reverse[i] ? 0 : clip,
+                            clipped_cigar);
+            cigar = clipped_cigar;
+        }
+        
+        if (hits->reverse[i]) {
+            info.flag |= SAM_REVERSE;
+            sam_line(writer, qname, hits->ref_names[i], hits->positions[i],
+                     cigar, rev_seq, rev_qual, &info);
+        } else {
+            sam_line(writer, qname, hits->ref_names[i], hits->positions[i],
+                     cigar, seq, qual, &info);
+        }
+    }
+}
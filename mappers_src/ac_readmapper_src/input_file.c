@@ -0,0 +1,146 @@
+
+// for fdopen() and pipe()
+#define _POSIX_C_SOURCE 200809L
+
+#include "input_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ We recognise gzip files on their magic bytes. For those, a thread
+ reads and decompresses the file and writes the decompressed data to a
+ pipe, and the parsers read from the other end of the pipe, so the
+ decompression runs alongside the parsing and searching. Uncompressed
+ files are read directly.
+ 
+ We can only look at the magic bytes and go back if we can seek in the
+ file. Pipes, /dev/stdin and process substitutions we always read
+ through the thread; zlib passes data that isn't gzip'ed through
+ unchanged, so this works whether they are compressed or not.
+ */
+
+#define DECOMPRESSION_BLOCK_SIZE (1 << 18)
+
+static bool write_all(int fd, const char *data, size_t n)
+{
+    while (n > 0) {
+        ssize_t written = write(fd, data, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        n -= (size_t)written;
+    }
+    return true;
+}
+
+static bool stopped(struct input_file *input)
+{
+    pthread_mutex_lock(&input->lock);
+    bool stop = input->stop;
+    pthread_mutex_unlock(&input->lock);
+    return stop;
+}
+
+static void *decompress(void *data)
+{
+    struct input_file *input = (struct input_file*)data;
+    char *block = malloc(DECOMPRESSION_BLOCK_SIZE);
+    
+    while (!stopped(input)) {
+        int n = gzread(input->gz_file, block, DECOMPRESSION_BLOCK_SIZE);
+        if (n < 0) {
+            int errnum;
+            fprintf(stderr, "Error decompressing input: %s.\n",
+                    gzerror(input->gz_file, &errnum));
+            exit(1);
+        }
+        if (n == 0) break;
+        if (!write_all(input->pipe_fd, block, (size_t)n)) break;
+    }
+    
+    free(block);
+    gzclose(input->gz_file);
+    close(input->pipe_fd); // the reader sees end of file
+    return 0;
+}
+
+static bool is_seekable(int fd)
+{
+    return lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+// Only for files we can seek in, so we can put back the bytes we read.
+static bool is_gzip(int fd)
+{
+    unsigned char magic[2];
+    ssize_t n;
+    do {
+        n = read(fd, magic, 2);
+    } while (n < 0 && errno == EINTR);
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        perror("Could not rewind input file");
+        exit(1);
+    }
+    return n == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+struct input_file *open_input_file(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+    
+    struct input_file *input =
+        (struct input_file*)malloc(sizeof(struct input_file));
+    input->compressed = !is_seekable(fd) || is_gzip(fd);
+    input->stop = false;
+    
+    if (!input->compressed) {
+        input->file = fdopen(fd, "r");
+        return input;
+    }
+    
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("Could not create pipe for decompression");
+        exit(1);
+    }
+    input->gz_file = gzdopen(fd, "rb");
+    input->pipe_fd = pipe_fds[1];
+    input->file = fdopen(pipe_fds[0], "r");
+    pthread_mutex_init(&input->lock, 0);
+    if (!input->gz_file ||
+        0 != pthread_create(&input->thread, 0, decompress, input)) {
+        fprintf(stderr, "Could not start decompressing %s.\n", filename);
+        exit(1);
+    }
+    
+    return input;
+}
+
+void close_input_file(struct input_file *input)
+{
+    if (input->compressed) {
+        // If we haven't read all of the file, we tell the thread to stop
+        // and empty the pipe so it isn't stuck writing to it.
+        pthread_mutex_lock(&input->lock);
+        input->stop = true;
+        pthread_mutex_unlock(&input->lock);
+        
+        char buffer[4096];
+        int fd = fileno(input->file);
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+            if (n < 0 && errno != EINTR) break;
+        }
+        
+        pthread_join(input->thread, 0);
+        pthread_mutex_destroy(&input->lock);
+    }
+    fclose(input->file);
+    free(input);
+}
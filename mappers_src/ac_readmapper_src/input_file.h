@@ -0,0 +1,31 @@
+
+#ifndef INPUT_FILE_H
+#define INPUT_FILE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <zlib.h>
+
+// An input file that is transparently decompressed if it is gzip'ed
+// (this includes BGZF files). You read the (decompressed) data from
+// file, either through stdio or through its file descriptor. The file
+// can be a pipe.
+struct input_file {
+    FILE *file;
+    bool compressed; // gzip'ed, or a pipe that might be
+    
+    // Compressed files are decompressed by a separate thread that
+    // writes the data to a pipe we read from in file.
+    gzFile gz_file;
+    int pipe_fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    bool stop;
+};
+
+// Returns null if the file cannot be opened.
+struct input_file *open_input_file(const char *filename);
+void close_input_file(struct input_file *input);
+
+#endif
@@ -0,0 +1,171 @@
+
+// for syscall()
+#define _DEFAULT_SOURCE
+
+#include "perf_counters.h"
+
+#include <string.h>
+
+const char *perf_counter_names[NO_PERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "cache_references",
+    "cache_misses",
+    "branch_misses",
+    "dtlb_misses"
+};
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ Counters we want to compare -- instructions per cycle, misses per
+ reference -- are opened together as a group, so the kernel schedules
+ them at the same time and we can read them with a single read() on the
+ group leader, the first counter in the group we could open. The
+ members are read in the order we opened them.
+
+ A group the hardware can't fit in its counters never runs, so we keep
+ the groups small enough for CPUs with only four general-purpose
+ counters. If the groups don't all fit at once, the kernel takes turns
+ with them, and we scale each group's counts on its own.
+ */
+#define NO_GROUPS 3
+#define GROUP_SIZE 2
+static const enum perf_counter groups[NO_GROUPS][GROUP_SIZE] = {
+    { PERF_CYCLES, PERF_INSTRUCTIONS },
+    { PERF_CACHE_REFERENCES, PERF_CACHE_MISSES },
+    { PERF_BRANCH_MISSES, PERF_DTLB_MISSES }
+};
+
+static bool counters_open = false;
+static int leader_fd[NO_GROUPS]; // -1 if no counter in the group opened
+static int no_open[NO_GROUPS];
+static int counter_group[NO_PERF_COUNTERS]; // -1 if not open
+static int group_index[NO_PERF_COUNTERS];
+
+static void set_event(struct perf_event_attr *attr, enum perf_counter counter)
+{
+    attr->type = PERF_TYPE_HARDWARE;
+    switch (counter) {
+        case PERF_CYCLES:           attr->config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PERF_INSTRUCTIONS:     attr->config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PERF_CACHE_REFERENCES: attr->config = PERF_COUNT_HW_CACHE_REFERENCES; break;
+        case PERF_CACHE_MISSES:     attr->config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case PERF_BRANCH_MISSES:    attr->config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case PERF_DTLB_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_DTLB |
+                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        default: break;
+    }
+}
+
+static int open_counter(enum perf_counter counter, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    set_event(&attr, counter);
+    attr.disabled = group_fd == -1; // the leader starts the group
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP |
+                       PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+bool open_perf_counters(void)
+{
+    for (int i = 0; i < NO_PERF_COUNTERS; i++) {
+        counter_group[i] = -1;
+    }
+    for (int g = 0; g < NO_GROUPS; g++) {
+        leader_fd[g] = -1;
+        no_open[g] = 0;
+        for (int j = 0; j < GROUP_SIZE; j++) {
+            enum perf_counter counter = groups[g][j];
+            int fd = open_counter(counter, leader_fd[g]);
+            if (fd < 0) continue;
+            if (leader_fd[g] == -1) leader_fd[g] = fd;
+            counter_group[counter] = g;
+            group_index[counter] = no_open[g]++;
+        }
+        if (leader_fd[g] == -1) continue;
+    
+        ioctl(leader_fd[g], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader_fd[g], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        counters_open = true;
+    }
+    return counters_open;
+}
+
+bool perf_counter_available(enum perf_counter counter)
+{
+    return counters_open && counter_group[counter] >= 0;
+}
+
+// Reads the group into counts, or marks its counters unavailable.
+static void read_group(int g, uint64_t counts[NO_PERF_COUNTERS])
+{
+    // nr, time enabled, time running, and a value per counter
+    uint64_t buffer[3 + GROUP_SIZE];
+    ssize_t expected = (ssize_t)((3 + no_open[g]) * sizeof(uint64_t));
+    bool ok = read(leader_fd[g], buffer, sizeof(buffer)) == expected;
+    // a group the kernel never got to schedule has only zeros
+    if (ok && buffer[1] > 0 && buffer[2] == 0) ok = false;
+    
+    double scale = 1.0;
+    if (ok && buffer[2] > 0 && buffer[2] < buffer[1])
+        scale = (double)buffer[1] / (double)buffer[2];
+    for (int j = 0; j < GROUP_SIZE; j++) {
+        enum perf_counter counter = groups[g][j];
+        if (counter_group[counter] != g)
+            continue; // not open
+        if (!ok)
+            counts[counter] = PERF_COUNTER_UNAVAILABLE;
+        else if (scale == 1.0)
+            counts[counter] = buffer[3 + group_index[counter]];
+        else
+            counts[counter] = (uint64_t)(scale * (double)buffer[3 + group_index[counter]]);
+    }
+}
+
+void read_perf_counters(uint64_t counts[NO_PERF_COUNTERS])
+{
+    for (int i = 0; i < NO_PERF_COUNTERS; i++) {
+        counts[i] = PERF_COUNTER_UNAVAILABLE;
+    }
+    if (!counters_open) return;
+    for (int g = 0; g < NO_GROUPS; g++) {
+        if (leader_fd[g] != -1) read_group(g, counts);
+    }
+}
+
+#else
+
+bool open_perf_counters(void)
+{
+    return false;
+}
+
+bool perf_counter_available(enum perf_counter counter)
+{
+    return false;
+}
+
+void read_perf_counters(uint64_t counts[NO_PERF_COUNTERS])
+{
+    for (int i = 0; i < NO_PERF_COUNTERS; i++) {
+        counts[i] = PERF_COUNTER_UNAVAILABLE;
+    }
+}
+
+#endif
@@ -1,9 +1,411 @@
 
 #include "sam.h"
+#include "cigar.h"
 
-void sam_line(FILE *file, const char *qname, const char *rname,
-              size_t pos, const char *cigar, const char *seq, const char *qual)
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool parse_sam_format(const char *name, enum sam_format *format)
+{
+    if (strcmp(name, "sam") == 0) {
+        *format = SAM_FORMAT;
+        return true;
+    }
+    if (strcmp(name, "bam") == 0) {
+        *format = BAM_FORMAT;
+        return true;
+    }
+    return false;
+}
+
+struct sam_writer *empty_sam_writer(FILE *file, enum sam_format format,
+                                    bool extended_cigars, size_t no_threads)
+{
+    struct sam_writer *writer =
+        (struct sam_writer*)malloc(sizeof(struct sam_writer));
+    writer->file = file;
+    writer->format = format;
+    writer->extended_cigars = extended_cigars;
+    writer->size = SAM_BUFFER_SIZE;
+    writer->used = 0;
+    writer->buffer = (char*)malloc(writer->size);
+    
+    writer->bgzf = 0;
+    writer->ref_names = 0;
+    writer->last_ref = 0;
+    if (format == BAM_FORMAT)
+        writer->bgzf = empty_bgzf_writer(file, no_threads);
+    
+    return writer;
+}
+
+void delete_sam_writer(struct sam_writer *writer)
+{
+    flush_sam_writer(writer);
+    if (writer->bgzf)
+        delete_bgzf_writer(writer->bgzf);
+    free(writer->buffer);
+    free(writer);
+}
+
+void flush_sam_writer(struct sam_writer *writer)
+{
+    if (writer->used == 0) return;
+    if (fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+        perror("Could not write SAM output");
+        exit(1);
+    }
+    writer->used = 0;
+}
+
+// Make sure there is room for n more characters in the buffer. For
+// BAM we only use the buffer for one record at a time.
+static void reserve(struct sam_writer *writer, size_t n)
+{
+    if (writer->used + n <= writer->size) return;
+    flush_sam_writer(writer);
+    if (n > writer->size) {
+        // a single line longer than the buffer
+        writer->size = n;
+        writer->buffer = (char*)realloc(writer->buffer, writer->size);
+    }
+}
+
+static char *put_string(char *out, const char *string, size_t length)
+{
+    memcpy(out, string, length);
+    return out + length;
+}
+
+static char *put_number(char *out, size_t number)
+{
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+static char *put_signed(char *out, long number)
+{
+    if (number < 0) {
+        *out++ = '-';
+        return put_number(out, (size_t)-number);
+    }
+    return put_number(out, (size_t)number);
+}
+
+// The columns are QNAME FLAG RNAME POS MAPQ CIGAR RNEXT PNEXT TLEN SEQ QUAL.
+static void bam_line(struct sam_writer *writer, const char *qname,
+                     const char *rname, size_t pos, const char *cigar,
+                     const char *seq, const char *qual,
+                     const struct sam_hit_info *info);
+
+void sam_line(struct sam_writer *writer, const char *qname, const char *rname,
+              size_t pos, const char *cigar, const char *seq, const char *qual,
+              const struct sam_hit_info *info)
+{
+    char collapsed[writer->extended_cigars ? 1 : strlen(cigar) + 1];
+    if (!writer->extended_cigars) {
+        collapse_cigar(cigar, collapsed);
+        cigar = collapsed;
+    }
+    
+    if (writer->format == BAM_FORMAT) {
+        bam_line(writer, qname, rname, pos, cigar, seq, qual, info);
+        return;
+    }
+    
+    size_t qname_length = strlen(qname);
+    size_t rname_length = strlen(rname);
+    size_t cigar_length = strlen(cigar);
+    size_t seq_length = strlen(seq);
+    size_t qual_length = strlen(qual);
+    
+    // 20 digits for each number and 40 characters for the fixed
+    // fields, tabs and tag names
+    reserve(writer, qname_length + rname_length + cigar_length +
+                    seq_length + qual_length + 6 * 20 + 40);
+    
+    char *out = writer->buffer + writer->used;
+    out = put_string(out, qname, qname_length);
+    *out++ = '\t';
+    out = put_number(out, info->flag);
+    *out++ = '\t';
+    out = put_string(out, rname, rname_length);
+    *out++ = '\t';
+    out = put_number(out, pos);
+    *out++ = '\t';
+    out = put_number(out, info->mapq);
+    *out++ = '\t';
+    out = put_string(out, cigar, cigar_length);
+    out = put_string(out, "\t*\t0\t0\t", 7);
+    out = put_string(out, seq, seq_length);
+    *out++ = '\t';
+    out = put_string(out, qual, qual_length);
+    out = put_string(out, "\tNM:i:", 6);
+    out = put_number(out, info->edit_distance);
+    out = put_string(out, "\tAS:i:", 6);
+    out = put_signed(out, info->score);
+    out = put_string(out, "\tX0:i:", 6);
+    out = put_number(out, info->no_best_hits);
+    *out++ = '\n';
+    
+    writer->used = (size_t)(out - writer->buffer);
+}
+
+/*
+ BAM output. The format is described in the SAM/BAM specification at
+ https://samtools.github.io/hts-specs/SAMv1.pdf; all integers are
+ little-endian.
+ */
+
+static unsigned char *put_int32(unsigned char *out, long value)
+{
+    unsigned long v = (unsigned long)value;
+    out[0] = (unsigned char)(v & 0xff);
+    out[1] = (unsigned char)((v >> 8) & 0xff);
+    out[2] = (unsigned char)((v >> 16) & 0xff);
+    out[3] = (unsigned char)((v >> 24) & 0xff);
+    return out + 4;
+}
+
+static unsigned char *put_uint16(unsigned char *out, unsigned value)
+{
+    out[0] = (unsigned char)(value & 0xff);
+    out[1] = (unsigned char)((value >> 8) & 0xff);
+    return out + 2;
+}
+
+char *sam_command_line(int argc, char *argv[])
+{
+    size_t length = 1;
+    for (int i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    char *command_line = (char*)malloc(length);
+    char *out = command_line;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0) *out++ = ' ';
+        out = put_string(out, argv[i], strlen(argv[i]));
+    }
+    *out = '\0';
+    return command_line;
+}
+
+// an integer tag; we always use the 'i' (int32) type
+static unsigned char *put_int_tag(unsigned char *out, const char *tag, long value)
+{
+    out[0] = (unsigned char)tag[0];
+    out[1] = (unsigned char)tag[1];
+    out[2] = 'i';
+    return put_int32(out + 3, value);
+}
+
+void write_sam_header(struct sam_writer *writer,
+                      struct string_pool *ref_names,
+                      struct size_vector *ref_lengths,
+                      const char *program_name,
+                      const char *command_line)
+{
+    writer->ref_names = ref_names;
+    
+    size_t text_size = 64 + 2 * strlen(program_name) + strlen(command_line);
+    for (size_t i = 0; i < ref_names->used; i++) {
+        text_size += pool_string_length(ref_names, i) + 40;
+    }
+    char *text = (char*)malloc(text_size);
+    char *t = text;
+    t += sprintf(t, "@HD\tVN:1.6\tSO:unsorted\n");
+    for (size_t i = 0; i < ref_names->used; i++) {
+        t += sprintf(t, "@SQ\tSN:%s\tLN:%zu\n",
+                     pool_string(ref_names, i), ref_lengths->sizes[i]);
+    }
+    t += sprintf(t, "@PG\tID:%s\tPN:%s\tCL:%s\n",
+                 program_name, program_name, command_line);
+    size_t text_length = (size_t)(t - text);
+    
+    if (writer->format != BAM_FORMAT) {
+        reserve(writer, text_length);
+        memcpy(writer->buffer + writer->used, text, text_length);
+        writer->used += text_length;
+        free(text);
+        return;
+    }
+    
+    // BAM has the same text header, followed by the references
+    // once more in binary.
+    unsigned char int_buffer[4];
+    bgzf_write(writer->bgzf, "BAM\1", 4);
+    put_int32(int_buffer, (long)text_length);
+    bgzf_write(writer->bgzf, int_buffer, 4);
+    bgzf_write(writer->bgzf, text, text_length);
+    put_int32(int_buffer, (long)ref_names->used);
+    bgzf_write(writer->bgzf, int_buffer, 4);
+    for (size_t i = 0; i < ref_names->used; i++) {
+        size_t name_length = pool_string_length(ref_names, i) + 1;
+        put_int32(int_buffer, (long)name_length);
+        bgzf_write(writer->bgzf, int_buffer, 4);
+        bgzf_write(writer->bgzf, pool_string(ref_names, i), name_length);
+        put_int32(int_buffer, (long)ref_lengths->sizes[i]);
+        bgzf_write(writer->bgzf, int_buffer, 4);
+    }
+    
+    free(text);
+}
+
+static long ref_id(struct sam_writer *writer, const char *rname)
+{
+    // the hits use the names from the FASTA records, so we can
+    // usually recognise them on the pointer alone.
+    struct string_pool *names = writer->ref_names;
+    if (writer->last_ref < names->used &&
+        (pool_string(names, writer->last_ref) == rname ||
+         strcmp(pool_string(names, writer->last_ref), rname) == 0))
+        return (long)writer->last_ref;
+    for (size_t i = 0; i < names->used; i++) {
+        if (pool_string(names, i) == rname) {
+            writer->last_ref = i;
+            return (long)i;
+        }
+    }
+    for (size_t i = 0; i < names->used; i++) {
+        if (strcmp(pool_string(names, i), rname) == 0) {
+            writer->last_ref = i;
+            return (long)i;
+        }
+    }
+    fprintf(stderr, "Unknown reference %s in BAM output.\n", rname);
+    exit(1);
+}
+
+// the operation codes for CIGAR ops in BAM, or -1
+static int cigar_op_code(char op)
+{
+    switch (op) {
+        case 'M': return 0;
+        case 'I': return 1;
+        case 'D': return 2;
+        case 'N': return 3;
+        case 'S': return 4;
+        case 'H': return 5;
+        case 'P': return 6;
+        case '=': return 7;
+        case 'X': return 8;
+        default:  return -1;
+    }
+}
+
+// the 4-bit code for a base in BAM; anything we don't know is N
+static unsigned char base_code(char base)
+{
+    static const char *codes = "=ACMGRSVTWYHKDBN";
+    if (base >= 'a' && base <= 'z') base = (char)(base - 'a' + 'A');
+    for (unsigned char i = 0; i < 16; i++) {
+        if (codes[i] == base) return i;
+    }
+    return 15;
+}
+
+// The bin of the BAM index for the region [beg, end).
+static unsigned reg2bin(long beg, long end)
+{
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (unsigned)(beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (unsigned)(beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (unsigned)(beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (unsigned)(beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (unsigned)(beg >> 26);
+    return 0;
+}
+
+// fixed-size part of a BAM record, including block_size
+#define BAM_CORE_SIZE 36
+// the NM, AS and X0 tags, each a two-letter name, 'i' and an int32
+#define BAM_TAGS_SIZE (3 * 7)
+// longest read name BAM can hold, without the '\0'
+#define BAM_MAX_NAME_LENGTH 254
+
+static void bam_line(struct sam_writer *writer, const char *qname,
+                     const char *rname, size_t pos, const char *cigar,
+                     const char *seq, const char *qual,
+                     const struct sam_hit_info *info)
 {
-    fprintf(file, "%s\t0\t%s\t%zu\t0\t%s\t*\t0\t0\t%s\t%s\n",
-            qname, rname, pos, cigar, seq, qual);
+    size_t name_length = strlen(qname);
+    if (name_length > BAM_MAX_NAME_LENGTH)
+        name_length = BAM_MAX_NAME_LENGTH;
+    size_t seq_length = strlen(seq);
+    size_t no_ops = 0;
+    for (const char *c = cigar; *c; c++) {
+        if (cigar_op_code(*c) >= 0) no_ops++;
+    }
+    
+    size_t record_size = BAM_CORE_SIZE + name_length + 1 + 4 * no_ops +
+                         (seq_length + 1) / 2 + seq_length + BAM_TAGS_SIZE;
+    reserve(writer, record_size);
+    unsigned char *record = (unsigned char*)writer->buffer;
+    
+    // variable-length fields first, so we know the alignment length
+    unsigned char *out = record + BAM_CORE_SIZE;
+    memcpy(out, qname, name_length);
+    out += name_length;
+    *out++ = '\0';
+    
+    long ref_length = 0;
+    size_t op_length = 0;
+    for (const char *c = cigar; *c; c++) {
+        if (*c >= '0' && *c <= '9') {
+            op_length = 10 * op_length + (size_t)(*c - '0');
+            continue;
+        }
+        int code = cigar_op_code(*c);
+        if (code < 0) continue;
+        if (code == 0 || code == 2 || code == 3 || code == 7 || code == 8)
+            ref_length += (long)op_length;
+        out = put_int32(out, (long)(op_length << 4 | (size_t)code));
+        op_length = 0;
+    }
+    
+    for (size_t i = 0; i < seq_length; i += 2) {
+        unsigned char high = base_code(seq[i]);
+        unsigned char low = (i + 1 < seq_length) ? base_code(seq[i + 1]) : 0;
+        *out++ = (unsigned char)(high << 4 | low);
+    }
+    
+    if (strlen(qual) == seq_length) {
+        for (size_t i = 0; i < seq_length; i++) {
+            *out++ = (unsigned char)(qual[i] - 33);
+        }
+    } else {
+        // no qualities ('*')
+        memset(out, 0xff, seq_length);
+        out += seq_length;
+    }
+    
+    out = put_int_tag(out, "NM", (long)info->edit_distance);
+    out = put_int_tag(out, "AS", info->score);
+    out = put_int_tag(out, "X0", (long)info->no_best_hits);
+    assert(out == record + record_size);
+    
+    long beg = (long)pos - 1; // BAM positions are 0-based
+    long end = beg + (ref_length > 0 ? ref_length : 1);
+    out = record;
+    out = put_int32(out, (long)(record_size - 4));   // block_size
+    out = put_int32(out, ref_id(writer, rname));     // refID
+    out = put_int32(out, beg);                       // pos
+    *out++ = (unsigned char)(name_length + 1);       // l_read_name
+    *out++ = (unsigned char)info->mapq;              // mapq
+    out = put_uint16(out, reg2bin(beg, end));        // bin
+    out = put_uint16(out, (unsigned)no_ops);         // n_cigar_op
+    out = put_uint16(out, info->flag);               // flag
+    out = put_int32(out, (long)seq_length);          // l_seq
+    out = put_int32(out, -1);                        // next_refID
+    out = put_int32(out, -1);                        // next_pos
+    out = put_int32(out, 0);                         // tlen
+    
+    bgzf_write(writer->bgzf, record, record_size);
 }
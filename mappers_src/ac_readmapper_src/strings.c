@@ -1,5 +1,6 @@
 
 #include "strings.h"
+#include "mapper_stats.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -9,7 +10,7 @@
 char *string_copy(const char *s)
 {
     size_t n = strlen(s) + 1;
-    char *copy = (char *)malloc(n);
+    char *copy = (char *)tracked_malloc(n);
     strcpy(copy, s);
     return copy;
 }
@@ -33,7 +34,7 @@ char *trim_whitespace(char *str)
         end++;
     
     // Write new null terminator, in case we haven't reached the end of str
-    *(end+1) = 0;
+    *end = 0;
     
     // move the non-whitespace token to the front of str.
     char *dst;
@@ -43,3 +44,34 @@ char *trim_whitespace(char *str)
     
     return str;
 }
+
+static char complement(char base)
+{
+    switch (base) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        case 'a': return 't';
+        case 'c': return 'g';
+        case 'g': return 'c';
+        case 't': return 'a';
+        default:  return 'N';
+    }
+}
+
+void reverse_complement(const char *from, char *to, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        to[i] = complement(from[n - 1 - i]);
+    }
+    to[n] = '\0';
+}
+
+void reverse_string(const char *from, char *to, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        to[i] = from[n - 1 - i];
+    }
+    to[n] = '\0';
+}
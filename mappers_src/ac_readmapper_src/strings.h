@@ -2,6 +2,8 @@
 #ifndef STRINGS_H
 #define STRINGS_H
 
+#include <stddef.h>
+
 /* Here are just some utility routines for manipulating strings. */
 // remove leading whitespace and update str to the first non-whitespace token.
 // modifies the str inplace and returns it as well (so you can use it when
@@ -13,4 +15,12 @@ char *trim_whitespace(char *str);
 // this is essentially strdup, but strdup is not standard C, so we use this...
 char *string_copy(const char *s);
 
+// Write the reverse complement of the first n characters of from to
+// to, which must have room for n + 1 characters. Anything but ACGT
+// (in either case) is complemented to N.
+void reverse_complement(const char *from, char *to, size_t n);
+
+// Write the first n characters of from to to in reverse order.
+void reverse_string(const char *from, char *to, size_t n);
+
 #endif
@@ -6,11 +6,17 @@
 
 #include "fasta.h"
 #include "fastq.h"
+#include "input_file.h"
 #include "sam.h"
 #include "search.h"
+#include "strings.h"
+#include "read_trimming.h"
+#include "read_cache.h"
 #include "suffix_array.h"
 #include "suffix_array_records.h"
+#include "external_construction.h"
 #include "options.h"
+#include "mapper_stats.h"
 
 #include <getopt.h>
 #include <stdbool.h>
@@ -18,6 +24,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define DEFAULT_KMER_LENGTH 10
+
 static void print_usage(const char *prog_name, FILE *file)
 {
     fprintf(file, "Usage: %s -p | --preprocess ref.fa\n"
@@ -27,30 +35,93 @@ static void print_usage(const char *prog_name, FILE *file)
     fprintf(file, "Options:\n");
     fprintf(file, "\t-h | --help:\t\t Show this message.\n");
     fprintf(file, "\t-p | --preprocess:\t Preprocess a reference genome.\n");
+    fprintf(file, "\nPreprocessing options:\n");
+    fprintf(file, "\t-k | --kmer-length:\t Length of k-mers in the lookup table (default %d).\n",
+            DEFAULT_KMER_LENGTH);
+    fprintf(file, "\t-t | --threads:\t Number of threads to use (default 1).\n");
+    fprintf(file, "\t\t\t Also used for BAM compression when searching.\n");
+    fprintf(file, "\t-m | --max-memory:\t Build the index in batches using at most this\n"
+                  "\t\t\t much memory besides the reference itself,\n"
+                  "\t\t\t e.g. 512M or 8G (single threaded). Long tandem\n"
+                  "\t\t\t repeats make this slow; runs of N are fine.\n");
     fprintf(file, "\nSearch options:\n");
     fprintf(file, "\t-d | --distance:\t Maximum edit distance for the search.\n");
     fprintf(file, "\t-x | --extended-cigar:\t Use extended CIGAR notation in SAM output.\n");
+    fprintf(file, "\t-f | --forward-only:\t Don't search for the reverse complement of the reads.\n");
+    fprintf(file, "\t-q | --trim-quality:\t Trim the 3' end of reads where the quality is below this\n"
+                  "\t\t\t and soft-clip it in the output (default 0, no trimming).\n");
+    fprintf(file, "\t-N | --max-n:\t\t Skip reads with more Ns than this (default no limit).\n");
+    fprintf(file, "\t-o | --output:\t\t Write the SAM output to this file (default stdout).\n");
+    fprintf(file, "\t-O | --output-format:\t Output format, sam (default) or bam.\n");
+    fprintf(file, "\t-S | --stats:\t\t Write the time spent in each phase, counts of the\n"
+                  "\t\t\t work done and the peak memory use, as JSON, to this\n"
+                  "\t\t\t file. This also works when preprocessing.\n");
+    fprintf(file, "\t-P | --perf-counters:\t Also count cycles, instructions, cache misses, branch\n"
+                  "\t\t\t mispredictions and TLB misses per phase, with the\n"
+                  "\t\t\t hardware counters, when searching. Needs --stats and Linux.\n");
     fprintf(file, "\n\n");
 }
 
-#define FASTQ_BUFFER_SIZE 1024
+// Parse a memory size such as 4096, 512K, 100M or 8G. Returns 0 if
+// the size is not valid.
+static size_t parse_memory_size(const char *size)
+{
+    char *end;
+    unsigned long long value = strtoull(size, &end, 10);
+    size_t unit = 1;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': unit = (size_t)1 << 10; end++; break;
+        case 'm': case 'M': unit = (size_t)1 << 20; end++; break;
+        case 'g': case 'G': unit = (size_t)1 << 30; end++; break;
+        default: return 0;
+    }
+    if (*end != '\0' || end == size)
+        return 0;
+    return (size_t)value * unit;
+}
+
+#define READ_CACHE_BATCH_SIZE 100000
 
 int main(int argc, char *argv[]) {
+
+    // before getopt_long() reorders the arguments
+    char *command_line = sam_command_line(argc, argv);
     
     int opt;
     struct options options;
     options.verbose = false;
     options.extended_cigars = false;
+    options.forward_only = false;
     options.edit_distance = 0;
+    options.trim_quality = 0;
+    options.max_n = -1;
     bool preprocess = false;
+    const char *output = 0;
+    const char *stats_file = 0;
+    bool perf_counters = false;
+    enum sam_format output_format = SAM_FORMAT;
+    size_t kmer_length = DEFAULT_KMER_LENGTH;
+    int no_threads = 1;
+    size_t max_memory = 0;
     
     static struct option longopts[] = {
         {"help", no_argument, NULL, 'h'},
         {"preprocess", no_argument, NULL, 'p'},
+        {"kmer-length", required_argument, NULL, 'k'},
+        {"threads", required_argument, NULL, 't'},
+        {"max-memory", required_argument, NULL, 'm'},
         {"distance", required_argument, NULL, 'd'},
         {"extended-cigar", no_argument, NULL, 'x'},
+        {"forward-only", no_argument, NULL, 'f'},
+        {"trim-quality", required_argument, NULL, 'q'},
+        {"max-n", required_argument, NULL, 'N'},
+        {"output", required_argument, NULL, 'o'},
+        {"output-format", required_argument, NULL, 'O'},
+        {"stats", required_argument, NULL, 'S'},
+        {"perf-counters", no_argument, NULL, 'P'},
         {NULL, 0, NULL, 0}};
-    while ((opt = getopt_long(argc, argv, "hpd:x", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hpk:t:m:d:xfq:N:o:O:S:P", longopts, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0], stdout);
@@ -60,6 +131,26 @@ int main(int argc, char *argv[]) {
                 preprocess = true;
                 break;
                 
+            case 'k':
+                kmer_length = (size_t)atoi(optarg);
+                break;
+                
+            case 't':
+                no_threads = atoi(optarg);
+                if (no_threads < 1) {
+                    fprintf(stderr, "The number of threads must be positive.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+                
+            case 'm':
+                max_memory = parse_memory_size(optarg);
+                if (max_memory == 0) {
+                    fprintf(stderr, "Invalid memory size %s.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+                
             case 'd':
                 options.edit_distance = atoi(optarg);
                 break;
@@ -67,7 +158,38 @@ int main(int argc, char *argv[]) {
             case 'x':
                 options.extended_cigars = true;
                 break;
+            
+            case 'f':
+                options.forward_only = true;
+                break;
+            
+            case 'q':
+                options.trim_quality = atoi(optarg);
+                break;
+            
+            case 'N':
+                options.max_n = atoi(optarg);
+                break;
                 
+            case 'o':
+                output = optarg;
+                break;
+                
+            case 'O':
+                if (!parse_sam_format(optarg, &output_format)) {
+                    fprintf(stderr, "Unknown output format %s.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+                
+            case 'S':
+                stats_file = optarg;
+                break;
+            
+            case 'P':
+                perf_counters = true;
+                break;
+            
             default:
                 print_usage(argv[0], stderr);
                 return EXIT_FAILURE;
@@ -75,57 +197,70 @@ int main(int argc, char *argv[]) {
     }
     argc -= optind;
     argv += optind;
+    if (perf_counters && !stats_file) {
+        fprintf(stderr, "--perf-counters needs --stats to write the counts to.\n");
+        return EXIT_FAILURE;
+    }
     
     if (preprocess) {
         if (argc != 1) {
             print_usage(argv[0], stderr);
             return EXIT_FAILURE;
         }
-        
-        FILE *fasta_file = fopen(argv[0], "r");
-        if (!fasta_file) {
-            fprintf(stderr, "Could not open %s.\n", argv[0]);
-            return EXIT_FAILURE;
-        }
+        if (stats_file) enable_stats();
         
         struct fasta_records *records = empty_fasta_records();
-        if (0 != read_fasta_records(records, fasta_file)) {
+        if (0 != load_fasta_records(records, argv[0])) {
             fprintf(stderr, "Could not read FASTA file.\n");
             return EXIT_FAILURE;
         }
-        fclose(fasta_file);
         
-        struct suffix_array_records *sa_records =
-        build_suffix_array_records(records);
-        write_suffix_array_records(sa_records, records, argv[0]);
+        if (max_memory > 0) {
+            if (no_threads > 1)
+                fprintf(stderr, "Warning: --max-memory builds the index in a single thread; "
+                        "ignoring --threads %d.\n", no_threads);
+            if (0 != build_suffix_array_files(records, kmer_length,
+                                              max_memory, argv[0])) {
+                fprintf(stderr, "Could not build the index within %lu bytes.\n",
+                        max_memory);
+                delete_fasta_records(records);
+                return EXIT_FAILURE;
+            }
+        } else {
+            struct suffix_array_records *sa_records =
+            build_suffix_array_records(records, kmer_length, (size_t)no_threads);
+            write_suffix_array_records(sa_records, records, argv[0]);
+            delete_suffix_array_records(sa_records);
+        }
         
-        delete_suffix_array_records(sa_records);
         delete_fasta_records(records);
         
-    } else {
-        if (argc != 2) {
-            print_usage(argv[0], stderr);
+        if (stats_file && 0 != write_stats(stats_file, "bw_readmapper")) {
+            fprintf(stderr, "Could not write statistics to %s.\n", stats_file);
             return EXIT_FAILURE;
         }
         
-        FILE *fasta_file = fopen(argv[0], "r");
-        if (!fasta_file) {
-            fprintf(stderr, "Could not open %s.\n", argv[0]);
+    } else {
+        if (argc != 2) {
+            print_usage(argv[0], stderr);
             return EXIT_FAILURE;
         }
+        if (stats_file) enable_stats();
+        if (perf_counters && !enable_perf_counters())
+            fprintf(stderr, "Could not open any hardware performance counters.\n");
         
-        FILE *fastq_file = fopen(argv[1], "r");
+        struct input_file *fastq_file = open_input_file(argv[1]);
         if (!fastq_file) {
             fprintf(stderr, "Could not open %s.\n", argv[1]);
             return EXIT_FAILURE;
         }
         
+        start_timer(TIME_INDEX_LOAD);
         struct fasta_records *fasta_records = empty_fasta_records();
-        if (0 != read_fasta_records(fasta_records, fasta_file)) {
+        if (0 != load_fasta_records(fasta_records, argv[0])) {
             fprintf(stderr, "Could not read FASTA file.\n");
             return EXIT_FAILURE;
         }
-        fclose(fasta_file);
         
         struct suffix_array_records *sa_records = empty_suffix_array_records();
         if (0 != read_suffix_array_records(sa_records, fasta_records, argv[0])) {
@@ -133,34 +268,105 @@ int main(int argc, char *argv[]) {
             delete_fasta_records(fasta_records);
             return EXIT_FAILURE;
         }
+        stop_timer(TIME_INDEX_LOAD);
         
-        FILE *samfile = stdout;
-        char read_name_buffer[FASTQ_BUFFER_SIZE];
-        char read_buffer[FASTQ_BUFFER_SIZE];
-        char quality_buffer[FASTQ_BUFFER_SIZE];
-        while (fastq_parse_next_record(fastq_file, (char*)&read_name_buffer,
-                                       (char*)&read_buffer, (char*)&quality_buffer)) {
+        FILE *sam_file = stdout;
+        if (output) {
+            sam_file = fopen(output, "w");
+            if (!sam_file) {
+                fprintf(stderr, "Could not open %s.\n", output);
+                return EXIT_FAILURE;
+            }
+        }
+        // The search always builds extended CIGARs, since we need the
+        // mismatches for the NM tag; the writer collapses them to 'M'
+        // operations unless we were asked for extended CIGARs.
+        struct sam_writer *sam_writer = empty_sam_writer(sam_file, output_format,
+                                                         options.extended_cigars,
+                                                         (size_t)no_threads);
+        options.extended_cigars = true;
+        write_sam_header(sam_writer, fasta_records->names,
+                         fasta_records->seq_sizes,
+                         "bw_readmapper", command_line);
+        struct read_cache *read_cache = empty_read_cache(READ_CACHE_BATCH_SIZE);
+        struct fastq_parser *fastq_parser = empty_fastq_parser(fastq_file->file);
+        struct fastq_record record;
+        start_timer(TIME_FASTQ_PARSE);
+        while (fastq_next_record(fastq_parser, &record)) {
+            count_stat(COUNT_READS, 1);
+            
+            // we search for the trimmed and masked read
+            size_t clip = quality_trim_length(record.quality,
+                                              record.sequence_length,
+                                              options.trim_quality);
+            size_t read_length = record.sequence_length - clip;
+            char read[read_length + 1];
+            size_t no_ns = mask_read(record.sequence, read, read_length);
             
-            size_t n = strlen(read_buffer) + (size_t)options.edit_distance;
-            char cigar[n + 1], cigar_buffer[n + 1];
-            cigar[n] = cigar_buffer[n] = '\0';
+            // we only search for a read the first time we see it in a batch
+            struct hit_list *hits = cached_hits(read_cache, read);
+            if (!hits && options.max_n >= 0 && no_ns > (size_t)options.max_n) {
+                // we don't search for it, so it has no hits
+                hits = new_cached_hits(read_cache, read);
             
-            size_t no_records = fasta_records->names->used;
-            for (size_t seq_no = 0; seq_no < no_records; seq_no++) {
-                char *ref_name = fasta_records->names->strings[seq_no];
-                struct suffix_array *sa = sa_records->suffix_arrays[seq_no];
+            } else if (!hits) {
+                hits = new_cached_hits(read_cache, read);
+                count_stat(COUNT_READS_SEARCHED, 1);
+                switch_timer(TIME_FASTQ_PARSE, TIME_SEARCH);
+                
+                // the reverse strand is searched as the reverse
+                // complement of the read against the same index
+                char rev_read[read_length + 1];
+                reverse_complement(read, rev_read, read_length);
+                int no_strands = options.forward_only ? 1 : 2;
                 
-                search(read_name_buffer, read_buffer, strlen(read_buffer), quality_buffer, ref_name, 0,
-                       sa->length - 1, options.edit_distance, cigar, cigar_buffer + n - 1, sa,
-                       samfile, &options);
+                size_t no_records = fasta_records->names->used;
+                for (size_t seq_no = 0; seq_no < no_records; seq_no++) {
+                    const char *ref_name = pool_string(fasta_records->names, seq_no);
+                    struct suffix_array *sa = sa_records->suffix_arrays[seq_no];
+                    
+                    for (int strand = 0; strand < no_strands; strand++) {
+                        bool reverse = strand == 1;
+                        const char *pattern = reverse ? rev_read : read;
+                        if (bidirectional_search(pattern, ref_name, reverse,
+                                                 options.edit_distance, sa,
+                                                 hits, &options))
+                            continue;
+                    
+                        backward_search(pattern, ref_name, reverse,
+                                        options.edit_distance, sa,
+                                        hits, &options);
+                    }
+                }
+                count_stat(COUNT_HITS, hits->used);
+                switch_timer(TIME_SEARCH, TIME_FASTQ_PARSE);
             }
             
+            switch_timer(TIME_FASTQ_PARSE, TIME_SAM_OUTPUT);
+            write_hits(sam_writer, hits, record.name, record.sequence,
+                       record.quality, clip);
+            switch_timer(TIME_SAM_OUTPUT, TIME_FASTQ_PARSE);
         }
+        stop_timer(TIME_FASTQ_PARSE);
         
+        delete_fastq_parser(fastq_parser);
+        // the writer flushes the last of the output when we delete it
+        start_timer(TIME_SAM_OUTPUT);
+        delete_sam_writer(sam_writer);
+        stop_timer(TIME_SAM_OUTPUT);
+        if (sam_file != stdout)
+            fclose(sam_file);
+        delete_read_cache(read_cache);
         delete_fasta_records(fasta_records);
         delete_suffix_array_records(sa_records);
-        fclose(fastq_file);
+        close_input_file(fastq_file);
+        
+        if (stats_file && 0 != write_stats(stats_file, "bw_readmapper")) {
+            fprintf(stderr, "Could not write statistics to %s.\n", stats_file);
+            return EXIT_FAILURE;
+        }
     }
     
+    free(command_line);
     return EXIT_SUCCESS;
 }
@@ -2,22 +2,97 @@
 #include "cigar.h"
 
 #include <string.h>
-#include <stdio.h>
 
-static const char *scan(const char *cigar)
+// write the number without going through printf()
+static char *put_number(char *to, size_t number)
 {
-    const char *p = cigar;
-    while (*p == *cigar)
-        ++p;
-    return p;
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+    while (n > 0) *to++ = digits[--n];
+    return to;
 }
 
-void simplify_cigar(const char *from, char *to)
+void init_edit_script(struct edit_script *script,
+                      char *ops, size_t *lengths, size_t start)
 {
+    script->ops = ops;
+    script->lengths = lengths;
+    script->begin = script->end = start;
+}
+
+void edit_script_cigar(const struct edit_script *script, char *to)
+{
+    for (size_t i = script->begin; i < script->end; i++) {
+        to = put_number(to, script->lengths[i]);
+        *to++ = script->ops[i];
+    }
+    *to = '\0';
+}
+
+// read the length of the operation at cigar and move past it
+static size_t op_length(const char **cigar)
+{
+    size_t length = 0;
+    while (**cigar >= '0' && **cigar <= '9') {
+        length = 10 * length + (size_t)(**cigar - '0');
+        (*cigar)++;
+    }
+    return length;
+}
+
+size_t cigar_edit_distance(const char *cigar)
+{
+    size_t edits = 0;
+    while (*cigar) {
+        size_t length = op_length(&cigar);
+        char op = *cigar++;
+        if (op == 'X' || op == 'I' || op == 'D')
+            edits += length;
+    }
+    return edits;
+}
+
+void collapse_cigar(const char *from, char *to)
+{
+    size_t matches = 0;
     while (*from) {
-        const char *next = scan(from);
-        to = to + sprintf(to, "%lu%c", next - from, *from);
-        from = next;
+        size_t length = op_length(&from);
+        char op = *from++;
+        if (op == '=' || op == 'X' || op == 'M') {
+            matches += length;
+            continue;
+        }
+        if (matches > 0) {
+            to = put_number(to, matches);
+            *to++ = 'M';
+            matches = 0;
+        }
+        to = put_number(to, length);
+        *to++ = op;
+    }
+    if (matches > 0) {
+        to = put_number(to, matches);
+        *to++ = 'M';
+    }
+    *to = '\0';
+}
+
+void soft_clip_cigar(const char *cigar, size_t front, size_t back, char *to)
+{
+    if (front > 0) {
+        to = put_number(to, front);
+        *to++ = 'S';
+    }
+    size_t length = strlen(cigar);
+    memcpy(to, cigar, length);
+    to += length;
+    if (back > 0) {
+        to = put_number(to, back);
+        *to++ = 'S';
     }
     *to = '\0';
 }
@@ -0,0 +1,477 @@
+#include "external_construction.h"
+#include "suffix_array.h"
+#include "suffix_array_records.h"
+#include "mapper_stats.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ Building the index with qsort_sa_construction() and compute_o_table()
+ needs the full suffix array and both o-tables in memory, which is
+ roughly 16 + 2 x 8 x sigma bytes per base. Here we build the same files
+ in batches instead. We split the suffixes into buckets based on their
+ first few symbols, so all suffixes in one bucket are smaller than all
+ suffixes in the next, and then we sort as many buckets at a time as we
+ have memory for and append them to the suffix array file. From the
+ sorted batch we get the b-table symbols, and together with the symbol
+ counts from the earlier batches that gives us the o-table entries for
+ the batch, which we write directly into their place in the o-table file.
+
+ A batch needs a position and a b-table symbol per suffix. On top of
+ that we need the bucket sizes and the k-mer table. We pick the bucket
+ prefix length so the largest bucket fits in what is left of the
+ memory. For each batch we have to scan the whole sequence to find the
+ suffixes in it, so with less memory we need more time.
+
+ Sorting compares suffixes character by character, so comparing two
+ suffixes inside a long run of one symbol, like the blocks of N's in
+ assemblies, costs time in the length of the run, and sorting the run
+ would be quadratic. We therefore record how long the run of equal
+ symbols at the start of each suffix is: if two suffixes start with runs
+ of different length, the shorter run ends in a different symbol, and
+ that decides their order without looking at the runs at all. Periodic
+ repeats with a period longer than one are not handled this way and still
+ sort slowly.
+ 
+ The reversed sequence, for the reverse o-table, is handled the same way
+ after reversing the sequence in place. The k-mer table is collected on
+ the way: the suffixes that start with a given k-mer are consecutive in
+ the suffix array, and the rev_L entry is the first row of the reversed
+ k-mer in the suffix array of the reversed sequence.
+ */
+
+struct batch_suffix {
+    size_t position;
+    size_t run; // length of the run of equal symbols it starts with
+};
+
+// each suffix in a batch needs the above and its b-table symbol
+#define BYTES_PER_SUFFIX (sizeof(struct batch_suffix) + 1)
+// we never split suffixes into buckets on more symbols than this
+#define MAX_PREFIX_LENGTH 16
+
+struct construction {
+    const char *string;
+    size_t length;                 // length of the suffix array
+    size_t no_symbols;
+    const size_t *symbols_inverse; // from the c-table, off by one
+    
+    size_t prefix_length;
+    size_t high_weight;            // no_symbols ^ (prefix_length - 1)
+    size_t no_buckets;
+    size_t *bucket_sizes;
+};
+
+static size_t symbol_at(const struct construction *c, size_t i)
+{
+    // the sentinel, and anything after it, is '$' with index 0
+    if (i >= c->length - 1) return 0;
+    return c->symbols_inverse[(unsigned char)c->string[i]] - 1;
+}
+
+// The bucket of a suffix is its first prefix_length symbol indices
+// read as a number in base no_symbols.
+static size_t first_key(const struct construction *c)
+{
+    size_t key = 0;
+    for (size_t j = 0; j < c->prefix_length; j++) {
+        key = key * c->no_symbols + symbol_at(c, j);
+    }
+    return key;
+}
+
+// the bucket of suffix i + 1 from the bucket of suffix i
+static size_t next_key(const struct construction *c, size_t key, size_t i)
+{
+    key -= symbol_at(c, i) * c->high_weight;
+    return key * c->no_symbols + symbol_at(c, i + c->prefix_length);
+}
+
+static size_t count_buckets(struct construction *c)
+{
+    memset(c->bucket_sizes, 0, c->no_buckets * sizeof(size_t));
+    size_t key = first_key(c);
+    for (size_t i = 0; i < c->length; i++) {
+        c->bucket_sizes[key]++;
+        key = next_key(c, key, i);
+    }
+    
+    size_t largest = 0;
+    for (size_t i = 0; i < c->no_buckets; i++) {
+        if (c->bucket_sizes[i] > largest)
+            largest = c->bucket_sizes[i];
+    }
+    return largest;
+}
+
+// Find the shortest bucket prefix where the largest bucket fits in
+// memory and return the number of suffixes we can have in a batch.
+// Returns 0 if there is no such prefix.
+static size_t plan_buckets(struct construction *c, size_t memory)
+{
+    size_t no_buckets = c->no_symbols;
+    size_t high_weight = 1;
+    for (size_t p = 1; p <= MAX_PREFIX_LENGTH; p++) {
+        size_t bucket_memory = no_buckets * sizeof(size_t);
+        if (bucket_memory >= memory)
+            break;
+        
+        c->prefix_length = p;
+        c->high_weight = high_weight;
+        c->no_buckets = no_buckets;
+        c->bucket_sizes = tracked_realloc(c->bucket_sizes, bucket_memory);
+        if (!c->bucket_sizes)
+            return 0;
+        
+        size_t largest = count_buckets(c);
+        size_t capacity = (memory - bucket_memory) / BYTES_PER_SUFFIX;
+        if (largest <= capacity)
+            return (capacity < c->length) ? capacity : c->length;
+        
+        if (no_buckets > SIZE_MAX / c->no_symbols)
+            break;
+        high_weight = no_buckets;
+        no_buckets *= c->no_symbols;
+    }
+    return 0;
+}
+
+// the string we are sorting suffixes of; qsort doesn't take a context
+static const char *sort_string;
+static int suffix_cmpfunc(const void *a, const void *b)
+{
+    const struct batch_suffix *x = a, *y = b;
+    const unsigned char *s = (const unsigned char *)sort_string + x->position;
+    const unsigned char *t = (const unsigned char *)sort_string + y->position;
+    if (*s != *t)
+        return (*s < *t) ? -1 : 1;
+    
+    if (x->run < y->run)
+        // x's run ends first, with a symbol (or the sentinel) that is
+        // different from the one y still has
+        return (s[x->run] < s[0]) ? -1 : 1;
+    if (y->run < x->run)
+        return (t[y->run] < t[0]) ? 1 : -1;
+    return strcmp((const char *)s + x->run, (const char *)t + x->run);
+}
+
+static bool kmer_code(const struct construction *c, size_t pos,
+                      size_t kmer_length, size_t *code)
+{
+    if (pos + kmer_length > c->length - 1)
+        return false;
+    
+    // the last character in a k-mer is the least significant
+    *code = 0;
+    for (size_t j = 0; j < kmer_length; j++) {
+        int rank = kmer_rank(c->string[pos + j]);
+        if (rank < 0)
+            return false;
+        *code = (*code << 2) | (size_t)rank;
+    }
+    return true;
+}
+
+static size_t reverse_kmer_code(size_t code, size_t kmer_length)
+{
+    size_t rev_code = 0;
+    for (size_t j = 0; j < kmer_length; j++) {
+        rev_code = (rev_code << 2) | (code & 3);
+        code >>= 2;
+    }
+    return rev_code;
+}
+
+// Sort and write all the batches. For the forward string we write the
+// suffix array and record the k-mer intervals in kmer_table; for the
+// reversed string we only record where each k-mer starts in kmer_starts.
+static int write_batches(struct construction *c, size_t capacity,
+                         FILE *sa_file, FILE *o_table_file,
+                         size_t kmer_length,
+                         size_t *kmer_table, size_t *kmer_starts)
+{
+    struct batch_suffix *suffixes =
+        tracked_malloc(capacity * sizeof(struct batch_suffix));
+    unsigned char *b = tracked_malloc(capacity);
+    if (!suffixes || !b) {
+        tracked_free(suffixes);
+        tracked_free(b);
+        return 1;
+    }
+    
+    // o-table entries just before the current batch
+    size_t counts[C_TABLE_SIZE];
+    memset(counts, 0, sizeof(counts));
+    
+    sort_string = c->string;
+    size_t row = 0; // suffix array row of the first suffix in the batch
+    size_t no_batches = 0;
+    size_t bucket = 0;
+    while (bucket < c->no_buckets) {
+        size_t first_bucket = bucket;
+        size_t batch_size = 0;
+        while (bucket < c->no_buckets &&
+               batch_size + c->bucket_sizes[bucket] <= capacity) {
+            batch_size += c->bucket_sizes[bucket++];
+        }
+        if (batch_size == 0)
+            continue; // only empty buckets left
+        no_batches++;
+        
+        size_t n = 0;
+        size_t key = first_key(c);
+        size_t run_end = 0; // end of the run of equal symbols at i
+        for (size_t i = 0; i < c->length; i++) {
+            if (run_end <= i) {
+                run_end = i + 1;
+                while (run_end < c->length - 1 &&
+                       c->string[run_end] == c->string[i])
+                    run_end++;
+            }
+            if (first_bucket <= key && key < bucket) {
+                suffixes[n].position = i;
+                suffixes[n].run = run_end - i;
+                n++;
+            }
+            key = next_key(c, key, i);
+        }
+        assert(n == batch_size);
+        qsort(suffixes, n, sizeof(struct batch_suffix), suffix_cmpfunc);
+        
+        // We only need the positions from here on, and they fit in the
+        // first half of the array; position i is written after
+        // suffixes[i] is read and only overwrites suffixes[i / 2].
+        size_t *positions = (size_t *)suffixes;
+        for (size_t i = 0; i < n; i++) {
+            positions[i] = suffixes[i].position;
+        }
+        
+        for (size_t i = 0; i < n; i++) {
+            size_t pos = positions[i];
+            b[i] = (unsigned char)((pos == 0) ? 0 : symbol_at(c, pos - 1));
+            
+            size_t code;
+            if (kmer_length == 0 || !kmer_code(c, pos, kmer_length, &code))
+                continue;
+            if (kmer_table) {
+                size_t *entry = kmer_table + 3 * code;
+                if (entry[0] > entry[1]) entry[0] = row + i;
+                entry[1] = row + i;
+            }
+            if (kmer_starts && kmer_starts[code] == SIZE_MAX) {
+                kmer_starts[code] = row + i;
+            }
+        }
+        if (sa_file)
+            fwrite(positions, sizeof(size_t), n, sa_file);
+        
+        // we are done with the positions, so we reuse the
+        // memory for building one o-table row at a time.
+        for (size_t j = 0; j < c->no_symbols; j++) {
+            size_t count = counts[j];
+            for (size_t i = 0; i < n; i++) {
+                count += (b[i] == j);
+                positions[i] = count;
+            }
+            counts[j] = count;
+            fseek(o_table_file,
+                  (long)((j * c->length + row) * sizeof(size_t)), SEEK_SET);
+            fwrite(positions, sizeof(size_t), n, o_table_file);
+        }
+        
+        row += n;
+    }
+    assert(row == c->length);
+    fprintf(stderr, "...wrote %lu suffixes in %lu batches.\n",
+            row, no_batches);
+    
+    tracked_free(suffixes);
+    tracked_free(b);
+    
+    if ((sa_file && ferror(sa_file)) || ferror(o_table_file)) {
+        fprintf(stderr, "...error writing the files.\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void reverse_in_place(char *string, size_t n)
+{
+    for (size_t i = 0, j = n; i + 1 < j; i++, j--) {
+        char tmp = string[i];
+        string[i] = string[j - 1];
+        string[j - 1] = tmp;
+    }
+}
+
+static FILE *open_index_file(const char *filename_prefix,
+                             const char *table_name,
+                             const char *seq_name)
+{
+    char *filename = make_file_name(filename_prefix, table_name, seq_name);
+    fprintf(stderr, "writing %s.\n", filename);
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+        fprintf(stderr, "Could not open %s.\n", filename);
+    tracked_free(filename);
+    return file;
+}
+
+static int build_sequence_files(struct suffix_array *sa,
+                                char *string,
+                                const char *seq_name,
+                                size_t kmer_length,
+                                size_t max_memory,
+                                const char *filename_prefix)
+{
+    size_t n = strlen(string);
+    sa->length = n + 1;
+    enum stats_memory subsystem = set_memory_subsystem(MEM_RANK_TABLES);
+    compute_c_table(sa, string);
+    set_memory_subsystem(subsystem);
+    
+    kmer_length = kmer_table_length(kmer_length, sa->length);
+    size_t no_kmers = (size_t)1 << (2 * kmer_length);
+    size_t kmer_memory = 0;
+    if (kmer_length > 0) {
+        // the table plus the start of each k-mer in the reversed string
+        kmer_memory = (kmer_table_size(kmer_length) + no_kmers) * sizeof(size_t);
+    }
+    if (kmer_memory >= max_memory) {
+        fprintf(stderr, "The k-mer table for %s does not fit in memory, "
+                "use a shorter k-mer length.\n", seq_name);
+        return 1;
+    }
+    
+    size_t *kmer_starts = 0;
+    sa->kmer_length = kmer_length;
+    if (kmer_length > 0) {
+        set_memory_subsystem(MEM_RANK_TABLES);
+        sa->kmer_table = tracked_malloc(kmer_table_size(kmer_length) * sizeof(size_t));
+        kmer_starts = tracked_malloc(no_kmers * sizeof(size_t));
+        set_memory_subsystem(subsystem);
+        if (!sa->kmer_table || !kmer_starts) {
+            fprintf(stderr, "Could not allocate the k-mer table for %s.\n",
+                    seq_name);
+            tracked_free(kmer_starts);
+            return 1;
+        }
+        clear_kmer_table(sa->kmer_table, kmer_length);
+        for (size_t i = 0; i < no_kmers; i++) {
+            kmer_starts[i] = SIZE_MAX;
+        }
+    }
+    
+    struct construction c;
+    c.string = string;
+    c.length = sa->length;
+    c.no_symbols = sa->c_table_no_symbols;
+    c.symbols_inverse = sa->c_table_symbols_inverse;
+    c.bucket_sizes = 0;
+    
+    int status = 1;
+    FILE *sa_file = 0, *o_table_file = 0;
+    
+    fprintf(stderr, "building suffix array and o-table for %s.\n", seq_name);
+    size_t capacity = plan_buckets(&c, max_memory - kmer_memory);
+    if (capacity == 0) {
+        fprintf(stderr, "Not enough memory to split %s into batches.\n",
+                seq_name);
+        goto done;
+    }
+    fprintf(stderr, "...%lu buckets, up to %lu suffixes per batch.\n",
+            c.no_buckets, capacity);
+    sa_file = open_index_file(filename_prefix, "suffix_arrays", seq_name);
+    o_table_file = open_index_file(filename_prefix, "o_tables", seq_name);
+    if (!sa_file || !o_table_file)
+        goto done;
+    if (write_batches(&c, capacity, sa_file, o_table_file,
+                      kmer_length, sa->kmer_table, 0))
+        goto done;
+    fclose(sa_file); sa_file = 0;
+    fclose(o_table_file); o_table_file = 0;
+    
+    // The reversed string has the same c-table, so we can reuse that.
+    fprintf(stderr, "building reverse o-table for %s.\n", seq_name);
+    reverse_in_place(string, n);
+    capacity = plan_buckets(&c, max_memory - kmer_memory);
+    if (capacity == 0) {
+        fprintf(stderr, "Not enough memory to split %s into batches.\n",
+                seq_name);
+        reverse_in_place(string, n);
+        goto done;
+    }
+    fprintf(stderr, "...%lu buckets, up to %lu suffixes per batch.\n",
+            c.no_buckets, capacity);
+    o_table_file = open_index_file(filename_prefix, "rev_o_tables", seq_name);
+    int rev_status = !o_table_file ||
+        write_batches(&c, capacity, 0, o_table_file,
+                      kmer_length, 0, kmer_starts);
+    reverse_in_place(string, n);
+    if (rev_status)
+        goto done;
+    
+    for (size_t code = 0; code < no_kmers; code++) {
+        size_t *entry = sa->kmer_table + 3 * code;
+        if (entry[0] > entry[1])
+            continue; // k-mer doesn't occur
+        entry[2] = kmer_starts[reverse_kmer_code(code, kmer_length)];
+    }
+    write_kmer_table_file(sa, filename_prefix, seq_name);
+    status = 0;
+
+done:
+    if (sa_file)      fclose(sa_file);
+    if (o_table_file) fclose(o_table_file);
+    tracked_free(c.bucket_sizes);
+    tracked_free(kmer_starts);
+    return status;
+}
+
+int build_suffix_array_files(struct fasta_records *fasta_records,
+                             size_t kmer_length,
+                             size_t max_memory,
+                             const char *filename_prefix)
+{
+    // We only keep the c-tables and k-mer tables in these records,
+    // the rest goes directly to the files.
+    size_t no_records = fasta_records->names->used;
+    struct suffix_array_records *records = empty_suffix_array_records();
+    records->suffix_arrays = (struct suffix_array **)tracked_malloc(sizeof(struct suffix_array*)*no_records);
+    
+    fprintf(stderr, "Building suffix arrays in batches (memory limit %lu bytes).\n",
+            max_memory);
+    int status = 0;
+    for (size_t i = 0; i < no_records; i++) {
+        const char *seq_name = pool_string(fasta_records->names, i);
+        add_string_copy(records->names, seq_name);
+        records->suffix_arrays[i] = empty_suffix_array();
+        
+        enum stats_memory subsystem = set_memory_subsystem(MEM_SUFFIX_ARRAY);
+        status = build_sequence_files(records->suffix_arrays[i],
+                                      fasta_records->sequences->strings[i],
+                                      seq_name, kmer_length, max_memory,
+                                      filename_prefix);
+        set_memory_subsystem(subsystem);
+        if (status != 0)
+            break;
+        
+        // we don't need the k-mer table any more, and we don't
+        // want to count it more than once against the memory limit.
+        tracked_free(records->suffix_arrays[i]->kmer_table);
+        records->suffix_arrays[i]->kmer_table = 0;
+    }
+    
+    if (status == 0) {
+        write_c_table_file(records, filename_prefix);
+        fprintf(stderr, "Done.\n");
+    }
+    delete_suffix_array_records(records);
+    
+    return status;
+}
@@ -0,0 +1,19 @@
+
+#ifndef EXTERNAL_CONSTRUCTION_H
+#define EXTERNAL_CONSTRUCTION_H
+
+#include <stddef.h>
+#include "fasta.h"
+
+// Build the preprocessed files for all sequences in fasta_records,
+// the same files as write_suffix_array_records() would write, but
+// without ever holding a full suffix array or o-table in memory.
+// The memory used, apart from the FASTA records themselves, is kept
+// below max_memory bytes. Returns 0 on success and 1 if it cannot
+// be done within that limit.
+int build_suffix_array_files(struct fasta_records *fasta_records,
+                             size_t kmer_length,
+                             size_t max_memory,
+                             const char *filename_prefix);
+
+#endif
@@ -2,14 +2,23 @@
 #ifndef FASTA_H
 #define FASTA_H
 
+#include "string_pool.h"
 #include "string_vector.h"
 #include "size_vector.h"
 #include <stdio.h>
 
+// The names are in a pool, so pool_string(records->names, i) is the
+// name of sequence i. The sequences are single, large strings, that
+// may point into a mapped file, so they have their own allocations.
 struct fasta_records {
-    struct string_vector *names;
+    struct string_pool *names;
     struct string_vector *sequences;
     struct size_vector *seq_sizes;
+    
+    // When we load the records from a memory mapped file, some of the
+    // sequences can point directly into the mapping.
+    char *mapping;
+    size_t mapping_size;
 };
 
 struct fasta_records *empty_fasta_records(void);
@@ -17,4 +26,11 @@ void delete_fasta_records(struct fasta_records *records);
 
 int read_fasta_records(struct fasta_records *records, FILE *file);
 
+// Load the records from the file filename. We memory map the file and
+// use the index in filename.fai to find the sequences, building the
+// index (and writing it, if we can) if it is missing or out of date.
+// Compressed files and files we cannot map are read with
+// read_fasta_records() instead. Returns 0 on success.
+int load_fasta_records(struct fasta_records *records, const char *filename);
+
 #endif
@@ -1,44 +1,223 @@
 
+// for fileno() and read()
+#define _POSIX_C_SOURCE 200809L
+
 #include "fastq.h"
-#include "strings.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#define MAX_LINE_SIZE 1024
+/*
+ The parser reads the file in large blocks and finds the records in
+ the buffer with memchr(). The records we hand out point into the
+ buffer, so we never copy a read. When a record runs past the end of
+ the buffer, we move it to the front and read more, and if a single
+ record does not fit in the buffer we double the buffer.
 
-void scan_fastq(FILE *file, fastq_read_callback_func callback, void * callback_data)
+ Multi-line records are handled the way other tools do: the sequence
+ lines run until the '+' line and the quality lines run until we have
+ a quality for each base. The lines are joined in place in the buffer.
+ */
+
+#define FASTQ_BLOCK_SIZE (1 << 20)
+
+struct fastq_parser *empty_fastq_parser(FILE *file)
+{
+    struct fastq_parser *parser =
+        (struct fastq_parser*)malloc(sizeof(struct fastq_parser));
+    parser->fd = fileno(file);
+    parser->buffer_size = FASTQ_BLOCK_SIZE;
+    parser->buffer = (char*)malloc(parser->buffer_size);
+    parser->begin = 0;
+    parser->end = 0;
+    parser->eof = false;
+    return parser;
+}
+
+void delete_fastq_parser(struct fastq_parser *parser)
+{
+    free(parser->buffer);
+    free(parser);
+}
+
+static void fill_buffer(struct fastq_parser *parser)
 {
-    char buffer[MAX_LINE_SIZE];
+    // move what we haven't parsed yet to the front of the buffer
+    if (parser->begin > 0) {
+        memmove(parser->buffer, parser->buffer + parser->begin,
+                parser->end - parser->begin);
+        parser->end -= parser->begin;
+        parser->begin = 0;
+    }
     
-    while (fgets(buffer, MAX_LINE_SIZE, file) != 0) {
-        char *name = string_copy(strtok(buffer+1, "\n"));
-        fgets(buffer, MAX_LINE_SIZE, file);
-        char *seq = string_copy(strtok(buffer, "\n"));
-        fgets(buffer, MAX_LINE_SIZE, file);
-        fgets(buffer, MAX_LINE_SIZE, file);
-        char *qual = string_copy(strtok(buffer, "\n"));
-        
-        callback(name, seq, qual, callback_data);
+    // we always keep a byte free so we can '\0' terminate the last line
+    if (parser->end + 1 >= parser->buffer_size) {
+        parser->buffer_size *= 2;
+        parser->buffer = (char*)realloc(parser->buffer, parser->buffer_size);
+        if (!parser->buffer) {
+            fprintf(stderr, "Could not allocate memory for FASTQ record.\n");
+            exit(1);
+        }
+    }
+    
+    ssize_t n;
+    do {
+        n = read(parser->fd, parser->buffer + parser->end,
+                 parser->buffer_size - parser->end - 1);
+    } while (n < 0 && errno == EINTR);
+    
+    if (n < 0) {
+        perror("Could not read FASTQ file");
+        exit(1);
+    }
+    if (n == 0) {
+        parser->eof = true;
+    } else {
+        parser->end += (size_t)n;
+    }
+}
+
+// Find the line starting at pos; line_end is where the line's
+// characters end (without "\n" or "\r\n") and next where the next line
+// begins. Returns false if we haven't read the whole line yet.
+static bool find_line(struct fastq_parser *parser, size_t pos,
+                      size_t *line_end, size_t *next)
+{
+    char *newline = memchr(parser->buffer + pos, '\n', parser->end - pos);
+    if (newline) {
+        *line_end = (size_t)(newline - parser->buffer);
+        *next = *line_end + 1;
+    } else if (parser->eof) {
+        *line_end = *next = parser->end; // last line, without a newline
+    } else {
+        return false;
+    }
+    if (*line_end > pos && parser->buffer[*line_end - 1] == '\r')
+        (*line_end)--;
+    return true;
+}
+
+// Join the lines in [from, to) into one string at from and
+// return its length.
+static size_t join_lines(char *buffer, size_t from, size_t to)
+{
+    size_t written = from;
+    while (from < to) {
+        char *newline = memchr(buffer + from, '\n', to - from);
+        size_t line_end = newline ? (size_t)(newline - buffer) : to;
+        size_t next = newline ? line_end + 1 : to;
+        if (line_end > from && buffer[line_end - 1] == '\r')
+            line_end--;
         
-        free(name);
-        free(seq);
-        free(qual);
+        if (written != from)
+            memmove(buffer + written, buffer + from, line_end - from);
+        written += line_end - from;
+        from = next;
     }
+    buffer[written] = '\0';
+    return written;
+}
+
+static void malformed_record(struct fastq_parser *parser)
+{
+    fprintf(stderr, "Malformed FASTQ record:\n%.*s\n",
+            (int)(parser->end - parser->begin < 80 ?
+                  parser->end - parser->begin : 80),
+            parser->buffer + parser->begin);
+    exit(1);
 }
 
-bool fastq_parse_next_record(FILE *file, char *read_name_buffer,
-                             char *read_buffer, char *quality_buffer)
+// Returns true if there is a complete record at the front of the
+// buffer, and false if we need to read more first.
+static bool parse_record(struct fastq_parser *parser,
+                         struct fastq_record *record)
 {
-    char buffer[MAX_LINE_SIZE];
+    char *buffer = parser->buffer;
+    size_t line_end, next;
+    
+    // skip empty lines between records
+    while (true) {
+        if (parser->begin >= parser->end) return false;
+        if (!find_line(parser, parser->begin, &line_end, &next)) return false;
+        if (line_end > parser->begin) break;
+        parser->begin = next;
+    }
+    if (buffer[parser->begin] != '@')
+        malformed_record(parser);
+    
+    size_t name_begin = parser->begin + 1;
+    size_t name_end = line_end;
+    size_t pos = next;
+    
+    // the sequence runs until the '+' line
+    size_t seq_begin = pos, seq_length = 0;
+    while (true) {
+        if (pos >= parser->end) {
+            if (parser->eof) malformed_record(parser);
+            return false;
+        }
+        if (!find_line(parser, pos, &line_end, &next)) return false;
+        if (line_end > pos && buffer[pos] == '+') break;
+        seq_length += line_end - pos;
+        pos = next;
+    }
+    size_t seq_end = pos;
+    pos = next;
+    
+    // and the quality until we have one for each base
+    size_t qual_begin = pos, qual_length = 0;
+    do {
+        if (pos >= parser->end) {
+            if (parser->eof) malformed_record(parser);
+            return false;
+        }
+        if (!find_line(parser, pos, &line_end, &next)) return false;
+        qual_length += line_end - pos;
+        pos = next;
+    } while (qual_length < seq_length);
+    if (qual_length != seq_length)
+        malformed_record(parser);
+    size_t qual_end = pos;
     
-    if (fgets(buffer, MAX_LINE_SIZE, file) == 0) return false; // read name line
-    strcpy(read_name_buffer, strtok(buffer+1, "\n"));
-    if (fgets(buffer, MAX_LINE_SIZE, file) == 0) return false; // read line
-    strcpy(read_buffer, strtok(buffer, "\n"));
-    if (fgets(buffer, MAX_LINE_SIZE, file) == 0) return false; // '+' line
-    if (fgets(buffer, MAX_LINE_SIZE, file) == 0) return false; // quality line
-    strcpy(quality_buffer, strtok(buffer, "\n"));
+    // we have the whole record, so now we can modify it
+    buffer[name_end] = '\0';
+    record->name = buffer + name_begin;
+    record->name_length = name_end - name_begin;
+    record->sequence = buffer + seq_begin;
+    record->sequence_length = join_lines(buffer, seq_begin, seq_end);
+    record->sequence_length -= seq_begin;
+    record->quality = buffer + qual_begin;
+    record->quality_length = join_lines(buffer, qual_begin, qual_end);
+    record->quality_length -= qual_begin;
     
+    parser->begin = qual_end;
     return true;
 }
+
+bool fastq_next_record(struct fastq_parser *parser,
+                       struct fastq_record *record)
+{
+    while (!parse_record(parser, record)) {
+        if (parser->eof) {
+            if (parser->begin < parser->end)
+                malformed_record(parser);
+            return false;
+        }
+        fill_buffer(parser);
+    }
+    return true;
+}
+
+void scan_fastq(FILE *file, fastq_read_callback_func callback, void * callback_data)
+{
+    struct fastq_parser *parser = empty_fastq_parser(file);
+    struct fastq_record record;
+    
+    while (fastq_next_record(parser, &record)) {
+        callback(record.name, record.sequence, record.quality, callback_data);
+    }
+    
+    delete_fastq_parser(parser);
+}
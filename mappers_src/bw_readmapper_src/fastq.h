@@ -4,14 +4,38 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef void (*fastq_read_callback_func)(const char *read_name,
                                          const char *read,
                                          const char *quality,
                                          void * callback_data);
 
+// A record points into the parser's buffer, so it is only valid until
+// the next call to fastq_next_record(). The strings are '\0' terminated
+// and a multi-line sequence or quality is joined into a single string.
+struct fastq_record {
+    const char *name;     size_t name_length;
+    const char *sequence; size_t sequence_length;
+    const char *quality;  size_t quality_length;
+};
+
+struct fastq_parser {
+    int fd;
+    char *buffer;
+    size_t buffer_size;
+    size_t begin; // start of the data we haven't parsed yet
+    size_t end;   // end of the data we have read
+    bool eof;
+};
+
+// The parser reads directly from the file's descriptor, so don't
+// read from the file through stdio as well.
+struct fastq_parser *empty_fastq_parser(FILE *file);
+void delete_fastq_parser(struct fastq_parser *parser);
+bool fastq_next_record(struct fastq_parser *parser,
+                       struct fastq_record *record);
+
 void scan_fastq(FILE *file, fastq_read_callback_func callback, void * callback_data);
-bool fastq_parse_next_record(FILE *file, char *read_name_buffer,
-                             char *read_buffer, char *quality_buffer);
 
 #endif
@@ -0,0 +1,54 @@
+
+#ifndef HIT_LIST_H
+#define HIT_LIST_H
+
+#include "sam.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ The hits we find for a read. We collect them here rather than writing
+ them to the SAM file right away so we can write the same hits for other
+ reads with the same sequence without searching for them again.
+ */
+
+struct hit_list {
+    size_t size;
+    size_t used;
+    const char **ref_names; // the list doesn't own these
+    size_t *positions;
+    bool *reverse; // hits for the reverse complement of the read
+    size_t *cigars; // offsets into cigar_buffer
+    
+    // all CIGARs go in one buffer, so we don't allocate per hit
+    char *cigar_buffer;
+    size_t cigar_buffer_size;
+    size_t cigar_buffer_used;
+};
+
+struct hit_list *empty_hit_list(size_t initial_size);
+void delete_hit_list(struct hit_list *hits);
+void clear_hit_list(struct hit_list *hits);
+
+// For a hit on the reverse strand, pos and cigar are for the reverse
+// complement of the read, as it aligns to the reference.
+void add_hit(struct hit_list *hits, const char *ref_name,
+             size_t pos, const char *cigar, bool reverse);
+
+static inline const char *hit_cigar(const struct hit_list *hits, size_t i) {
+    return hits->cigar_buffer + hits->cigars[i];
+}
+
+// Write the hits as SAM lines for the read qname. The CIGARs must be
+// extended, since we get the edit distance of each hit from them. For
+// hits on the reverse strand we write the reverse complement of seq
+// and the reversed qual, as SAM wants them.
+//
+// If the last clip bases of seq were trimmed off before the search, the
+// hits are for the rest of the read, and the clipped bases are written
+// as a soft-clip.
+void write_hits(struct sam_writer *writer, const struct hit_list *hits,
+                const char *qname, const char *seq, const char *qual,
+                size_t clip);
+
+#endif
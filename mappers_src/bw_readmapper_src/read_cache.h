@@ -0,0 +1,43 @@
+
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include "hit_list.h"
+#include <stddef.h>
+
+/*
+ A cache of the hits for the reads we have seen in the current batch of
+ reads. Duplicated reads (PCR duplicates, amplicons) only need to be
+ searched for once; for the duplicates we can write the cached hits.
+ 
+ The cache is emptied after every batch_size reads, so it doesn't grow
+ without bounds.
+ */
+
+struct read_cache_entry {
+    char *read;
+    size_t hash;
+    struct hit_list *hits;
+};
+
+struct read_cache {
+    size_t batch_size;
+    size_t reads_in_batch;
+    
+    // open addressing hash table; table_size is a power of two
+    size_t table_size;
+    size_t used;
+    struct read_cache_entry *table;
+};
+
+struct read_cache *empty_read_cache(size_t batch_size);
+void delete_read_cache(struct read_cache *cache);
+
+// Get the hits for read if we have already searched for it in
+// this batch, otherwise null. Call this once per read.
+struct hit_list *cached_hits(struct read_cache *cache, const char *read);
+// Add read to the cache and get the (empty) list to collect its hits in.
+// The read must not already be in the cache.
+struct hit_list *new_cached_hits(struct read_cache *cache, const char *read);
+
+#endif
@@ -1,16 +1,21 @@
 
 #include "cigar.h"
-#include "sam.h"
+#include "hit_list.h"
 #include "search.h"
+#include "mapper_stats.h"
 
+#include <stdbool.h>
+#include <string.h>
 #include <strings.h>
 
-void search(const char *read_name, const char *read, size_t read_idx,
-            const char *quality, const char *ref_name, size_t L, size_t R,
-            int d, char *cigar, char *cigar_buffer, struct suffix_array *sa,
-            FILE *samfile, struct options *options)
+void search(const char *read, size_t read_idx,
+            const char *ref_name, bool reverse, size_t L, size_t R,
+            int d, struct edit_script *edits, char *cigar,
+            struct suffix_array *sa, struct hit_list *hits,
+            struct options *options)
 {
     assert(d >= 0); // if it get's negative we've called too deeply
+    count_stat(COUNT_NODES_EXPANDED, 1);
 
     if (read_idx == 0) {
         // We have reached the beginning of the read.
@@ -18,14 +23,16 @@ void search(const char *read_name, const char *read, size_t read_idx,
 
         // we have matched to the end and can output
         // all sequences between L and R
-        simplify_cigar(cigar_buffer + 1, cigar);
+        edit_script_cigar(edits, cigar);
 
+        switch_timer(TIME_SEARCH, TIME_LOCATE);
         for (size_t i = L; i <= R; i++) {
             size_t index = sa->array[i];
-            sam_line(samfile, read_name, ref_name,
-                     index + 1, // + 1 for 1-indexing in SAM format.
-                     cigar, read, quality);
+            add_hit(hits, ref_name,
+                    index + 1, // + 1 for 1-indexing in SAM format.
+                    cigar, reverse);
         }
+        switch_timer(TIME_LOCATE, TIME_SEARCH);
 
         // For completeness of the d-edit-cloud, we still need to
         // explore deletions...
@@ -48,9 +55,10 @@ void search(const char *read_name, const char *read, size_t read_idx,
                 if (new_L > new_R)
                     continue;
 
-                *cigar_buffer = 'D';
-                search(read_name, read, read_idx, quality, ref_name, new_L,
-                       new_R, d - 1, cigar, cigar_buffer - 1, sa, samfile, options);
+                push_edit_front(edits, 'D', 1);
+                search(read, read_idx, ref_name, reverse, new_L,
+                       new_R, d - 1, edits, cigar, sa, hits, options);
+                pop_edit_front(edits, 1);
             }
         }
 
@@ -62,23 +70,24 @@ void search(const char *read_name, const char *read, size_t read_idx,
     // update L and R and recurse
 
     // ---MATCHING----------------------------------------------
-    // Get `a` as an exact match...
+    // Get `a` as an exact match... unless it isn't in the reference,
+    // like the N's we put in for low-quality bases; then it can only
+    // be an edit.
     char a = read[read_idx - 1];
     size_t new_L, new_R;
-    if (L == 0)
-        new_L = sa->c_table[(int)a] + 1;
-    else
-        new_L =
-            sa->c_table[(int)a] + 1 + sa->o_table[o_table_index(sa, a, L - 1)];
-    new_R = sa->c_table[(int)a] + sa->o_table[o_table_index(sa, a, R)];
-
-    if (options->extended_cigars)
-        *cigar_buffer = '=';
-    else
-        *cigar_buffer = 'M';
+    if (sa->c_table_symbols_inverse[(int)a] != 0) {
+        if (L == 0)
+            new_L = sa->c_table[(int)a] + 1;
+        else
+            new_L = sa->c_table[(int)a] + 1 +
+                    sa->o_table[o_table_index(sa, a, L - 1)];
+        new_R = sa->c_table[(int)a] + sa->o_table[o_table_index(sa, a, R)];
 
-    search(read_name, read, read_idx - 1, quality, ref_name, new_L, new_R, d,
-           cigar, cigar_buffer - 1, sa, samfile, options);
+        push_edit_front(edits, options->extended_cigars ? '=' : 'M', 1);
+        search(read, read_idx - 1, ref_name, reverse, new_L, new_R, d,
+               edits, cigar, sa, hits, options);
+        pop_edit_front(edits, 1);
+    }
 
     if (d > 0) {
         // ---SUBSTITUTION------------------------------------------
@@ -99,13 +108,10 @@ void search(const char *read_name, const char *read, size_t read_idx,
             if (new_L > new_R)
                 continue;
 
-            if (options->extended_cigars)
-                *cigar_buffer = 'X';
-            else
-                *cigar_buffer = 'M';
-
-            search(read_name, read, read_idx - 1, quality, ref_name, new_L,
-                   new_R, d - 1, cigar, cigar_buffer - 1, sa, samfile, options);
+            push_edit_front(edits, options->extended_cigars ? 'X' : 'M', 1);
+            search(read, read_idx - 1, ref_name, reverse, new_L,
+                   new_R, d - 1, edits, cigar, sa, hits, options);
+            pop_edit_front(edits, 1);
         } // end for
 
         // ---DELETION----------------------------------------------
@@ -124,15 +130,527 @@ void search(const char *read_name, const char *read, size_t read_idx,
             if (new_L > new_R)
                 continue;
 
-            *cigar_buffer = 'D';
-            search(read_name, read, read_idx, quality, ref_name, new_L, new_R,
-                   d - 1, cigar, cigar_buffer - 1, sa, samfile, options);
+            push_edit_front(edits, 'D', 1);
+            search(read, read_idx, ref_name, reverse, new_L, new_R,
+                   d - 1, edits, cigar, sa, hits, options);
+            pop_edit_front(edits, 1);
         } // end for
 
         // ---INSERTION---------------------------------------------
-        *cigar_buffer = 'I';
-        search(read_name, read, read_idx - 1, quality, ref_name, L, R, d - 1,
-               cigar, cigar_buffer - 1, sa, samfile, options);
+        push_edit_front(edits, 'I', 1);
+        search(read, read_idx - 1, ref_name, reverse, L, R, d - 1,
+               edits, cigar, sa, hits, options);
+        pop_edit_front(edits, 1);
         
     } // end if (d > 0)
 }
+
+void backward_search(const char *read, const char *ref_name,
+                     bool reverse, int d,
+                     struct suffix_array *sa, struct hit_list *hits,
+                     struct options *options)
+{
+    size_t read_length = strlen(read);
+    size_t n = read_length + (size_t)d;
+    char cigar[2 * n + 1];
+    
+    // the CIGAR grows to the left, from the end of the arrays
+    char ops[n];
+    size_t lengths[n];
+    struct edit_script edits;
+    init_edit_script(&edits, ops, lengths, n);
+    
+    size_t read_idx = read_length;
+    size_t L = 0, R = sa->length - 1, rev_L;
+    
+    // Without edits we can jump straight past the last k characters
+    // of the read using the k-mer table.
+    size_t k = sa->kmer_length;
+    if (d == 0 && k > 0 && read_length >= k &&
+        lookup_kmer(sa, read + read_length - k, &L, &R, &rev_L)) {
+        if (L > R)
+            return; // no exact matches of the k-mer
+        push_edit_front(&edits, options->extended_cigars ? '=' : 'M', k);
+        read_idx -= k;
+    }
+    
+    search(read, read_idx, ref_name, reverse, L, R, d,
+           &edits, cigar, sa, hits, options);
+}
+
+/*
+ Bidirectional search with search schemes.
+ 
+ The backward search above explores all edits from the end of the read
+ and therefore branches the most where it has the least information. With
+ both the o-table for the string and for the reversed string we can extend
+ a match in both directions, so instead we split the read into parts and
+ run a number of searches that each start with a part where it may not
+ make (many) errors and then extend the match, part by part, to the left
+ and to the right (Kucherov et al. 2016, Kianfar et al. 2017).
+ 
+ Each search is given by the order, pi, in which it visits the parts
+ and lower and upper bounds, L and U, on the total number of errors
+ made once it has processed each part. Together the searches in a
+ scheme must cover all distributions of at most d errors over the parts.
+ 
+ To attribute every edit to exactly one part we charge the deletions
+ immediately to the left of a read character to the part that holds that
+ character, and deletions after the last character of the read to the
+ last part. With this, an alignment has a unique distribution of errors
+ over the parts, and we only report it from the first search in the
+ scheme that admits that distribution, so all searches together report
+ each alignment exactly once -- the same alignments that the backward
+ search finds.
+ */
+
+#define MAX_PARTS 5
+#define MAX_SEARCHES 7
+
+struct search_scheme {
+    int no_parts;
+    int no_searches;
+    struct {
+        int pi[MAX_PARTS];
+        int L[MAX_PARTS];
+        int U[MAX_PARTS];
+    } searches[MAX_SEARCHES];
+};
+
+// Schemes for d = 1, ..., 4. The first two are the optimal schemes
+// from Kianfar et al.; for each of the others we have checked that
+// it covers all distributions of d errors over its parts.
+static const struct search_scheme search_schemes[] = {
+    { 2, 2, {
+        { {0, 1}, {0, 0}, {0, 1} },
+        { {1, 0}, {0, 0}, {0, 1} } } },
+    { 3, 3, {
+        { {0, 1, 2}, {0, 0, 0}, {0, 2, 2} },
+        { {2, 1, 0}, {0, 0, 0}, {0, 1, 2} },
+        { {1, 0, 2}, {0, 1, 1}, {0, 1, 2} } } },
+    { 4, 4, {
+        { {0, 1, 2, 3}, {0, 0, 0, 0}, {1, 1, 3, 3} },
+        { {1, 0, 2, 3}, {0, 0, 1, 1}, {1, 1, 3, 3} },
+        { {2, 3, 1, 0}, {0, 0, 0, 0}, {0, 2, 3, 3} },
+        { {3, 2, 1, 0}, {0, 0, 1, 1}, {0, 1, 3, 3} } } },
+    { 5, 7, {
+        { {0, 1, 2, 3, 4}, {0, 0, 0, 0, 0}, {0, 1, 2, 4, 4} },
+        { {3, 4, 2, 1, 0}, {0, 0, 0, 0, 0}, {0, 1, 2, 4, 4} },
+        { {1, 2, 3, 4, 0}, {0, 0, 0, 0, 0}, {0, 0, 2, 3, 4} },
+        { {4, 3, 2, 1, 0}, {0, 0, 0, 0, 0}, {0, 1, 3, 4, 4} },
+        { {1, 0, 2, 3, 4}, {0, 0, 0, 0, 0}, {0, 1, 3, 4, 4} },
+        { {2, 1, 0, 3, 4}, {0, 0, 0, 0, 0}, {0, 2, 2, 4, 4} },
+        { {0, 1, 2, 3, 4}, {0, 0, 0, 0, 0}, {0, 1, 4, 4, 4} } } }
+};
+#define NO_SEARCH_SCHEMES (sizeof(search_schemes) / sizeof(search_schemes[0]))
+
+struct bidirectional_search_data {
+    const char *read;
+    size_t read_length;
+    const char *ref_name;
+    bool reverse;
+    
+    struct suffix_array *sa;
+    struct hit_list *hits;
+    struct options *options;
+    
+    const struct search_scheme *scheme;
+    int search_no;
+    size_t part_start[MAX_PARTS + 1];
+    int part_errors[MAX_PARTS];
+    
+    // The CIGAR grows in both directions from the middle of the
+    // script's arrays; we format it in cigar_buffer when we report hits.
+    struct edit_script edits;
+    char *cigar_buffer;
+};
+
+static bool admits(const struct search_scheme *scheme, int search_no,
+                   const int *part_errors)
+{
+    int errors = 0;
+    for (int j = 0; j < scheme->no_parts; j++) {
+        errors += part_errors[scheme->searches[search_no].pi[j]];
+        if (errors < scheme->searches[search_no].L[j] ||
+            errors > scheme->searches[search_no].U[j])
+            return false;
+    }
+    return true;
+}
+
+// State of a search: we are at step j of the search (processing part
+// pi[j]) and at read position i within that part, with the given
+// number of errors and intervals. The CIGAR is in data->edits.
+struct scheme_state {
+    int j;
+    size_t i;
+    int errors;
+    size_t L, R, rev_L;
+};
+
+static void scheme_next_part(struct bidirectional_search_data *data,
+                             struct scheme_state state);
+
+static void report_scheme_hit(struct bidirectional_search_data *data,
+                              struct scheme_state *state)
+{
+    // only report from the first search that admits this alignment
+    for (int s = 0; s < data->search_no; s++) {
+        if (admits(data->scheme, s, data->part_errors))
+            return;
+    }
+    
+    edit_script_cigar(&data->edits, data->cigar_buffer);
+    switch_timer(TIME_SEARCH, TIME_LOCATE);
+    for (size_t i = state->L; i <= state->R; i++) {
+        size_t index = data->sa->array[i];
+        add_hit(data->hits, data->ref_name,
+                index + 1, // + 1 for 1-indexing in SAM format.
+                data->cigar_buffer, data->reverse);
+    }
+    switch_timer(TIME_LOCATE, TIME_SEARCH);
+}
+
+static void finish_part(struct bidirectional_search_data *data,
+                        struct scheme_state state)
+{
+    const struct search_scheme *scheme = data->scheme;
+    if (state.errors < scheme->searches[data->search_no].L[state.j])
+        return;
+    
+    state.j++;
+    if (state.j == scheme->no_parts)
+        report_scheme_hit(data, &state);
+    else
+        scheme_next_part(data, state);
+}
+
+static inline bool can_make_error(struct bidirectional_search_data *data,
+                                  struct scheme_state *state)
+{
+    return state->errors < data->scheme->searches[data->search_no].U[state->j];
+}
+
+static inline int current_part(struct bidirectional_search_data *data,
+                               struct scheme_state *state)
+{
+    return data->scheme->searches[data->search_no].pi[state->j];
+}
+
+static inline char match_symbol(struct bidirectional_search_data *data)
+{
+    return data->options->extended_cigars ? '=' : 'M';
+}
+
+static inline char mismatch_symbol(struct bidirectional_search_data *data)
+{
+    return data->options->extended_cigars ? 'X' : 'M';
+}
+
+// ---Extending to the right---------------------------------------
+// Deletions before read[i], then read[i] itself. After the last
+// character in the read we also allow trailing deletions.
+
+static void right_before(struct bidirectional_search_data *data,
+                         struct scheme_state state);
+
+static void right_trailing(struct bidirectional_search_data *data,
+                           struct scheme_state state)
+{
+    count_stat(COUNT_NODES_EXPANDED, 1);
+    struct suffix_array *sa = data->sa;
+    int part = current_part(data, &state);
+    
+    finish_part(data, state);
+    
+    if (!can_make_error(data, &state))
+        return;
+    
+    // ---DELETION----------------------------------------------
+    data->part_errors[part]++;
+    state.errors++;
+    for (size_t k = 0; k < sa->c_table_no_symbols; k++) {
+        char b = sa->c_table_symbols[k];
+        if (b == '\0') continue;
+        struct scheme_state next = state;
+        if (extend_right(sa, b, &next.L, &next.R, &next.rev_L)) {
+            push_edit_back(&data->edits, 'D', 1);
+            right_trailing(data, next);
+            pop_edit_back(&data->edits, 1);
+        }
+    }
+    data->part_errors[part]--;
+}
+
+static void right_after(struct bidirectional_search_data *data,
+                        struct scheme_state state)
+{
+    size_t end = data->part_start[current_part(data, &state) + 1];
+    state.i++;
+    if (state.i < end)
+        right_before(data, state);
+    else if (state.i == data->read_length)
+        right_trailing(data, state);
+    else
+        finish_part(data, state);
+}
+
+static void right_before(struct bidirectional_search_data *data,
+                         struct scheme_state state)
+{
+    count_stat(COUNT_NODES_EXPANDED, 1);
+    struct suffix_array *sa = data->sa;
+    int part = current_part(data, &state);
+    char a = data->read[state.i];
+    
+    // ---MATCHING----------------------------------------------
+    if (sa->c_table_symbols_inverse[(int)a] != 0) {
+        struct scheme_state next = state;
+        if (extend_right(sa, a, &next.L, &next.R, &next.rev_L)) {
+            push_edit_back(&data->edits, match_symbol(data), 1);
+            right_after(data, next);
+            pop_edit_back(&data->edits, 1);
+        }
+    }
+    
+    if (!can_make_error(data, &state))
+        return;
+    
+    data->part_errors[part]++;
+    state.errors++;
+    for (size_t k = 0; k < sa->c_table_no_symbols; k++) {
+        char b = sa->c_table_symbols[k];
+        if (b == '\0') continue;
+        
+        // ---SUBSTITUTION------------------------------------------
+        struct scheme_state next = state;
+        if (b != a && extend_right(sa, b, &next.L, &next.R, &next.rev_L)) {
+            push_edit_back(&data->edits, mismatch_symbol(data), 1);
+            right_after(data, next);
+            pop_edit_back(&data->edits, 1);
+        }
+        
+        // ---DELETION----------------------------------------------
+        next = state;
+        if (extend_right(sa, b, &next.L, &next.R, &next.rev_L)) {
+            push_edit_back(&data->edits, 'D', 1);
+            right_before(data, next);
+            pop_edit_back(&data->edits, 1);
+        }
+    }
+    
+    // ---INSERTION---------------------------------------------
+    push_edit_back(&data->edits, 'I', 1);
+    right_after(data, state);
+    pop_edit_back(&data->edits, 1);
+    
+    data->part_errors[part]--;
+}
+
+// ---Extending to the left----------------------------------------
+// read[i] first, then the deletions before it. Trailing deletions,
+// after the last character in the read, come before anything else.
+
+static void left_before(struct bidirectional_search_data *data,
+                        struct scheme_state state);
+
+static void left_after(struct bidirectional_search_data *data,
+                       struct scheme_state state)
+{
+    struct suffix_array *sa = data->sa;
+    int part = current_part(data, &state);
+    
+    if (can_make_error(data, &state)) {
+        // ---DELETION----------------------------------------------
+        for (size_t k = 0; k < sa->c_table_no_symbols; k++) {
+            char b = sa->c_table_symbols[k];
+            if (b == '\0') continue;
+            struct scheme_state next = state;
+            if (!extend_left(sa, b, &next.L, &next.R, &next.rev_L))
+                continue;
+            push_edit_front(&data->edits, 'D', 1);
+            next.errors++;
+            data->part_errors[part]++;
+            left_after(data, next);
+            data->part_errors[part]--;
+            pop_edit_front(&data->edits, 1);
+        }
+    }
+    
+    if (state.i == data->part_start[part]) {
+        finish_part(data, state);
+    } else {
+        state.i--;
+        left_before(data, state);
+    }
+}
+
+static void left_before(struct bidirectional_search_data *data,
+                        struct scheme_state state)
+{
+    count_stat(COUNT_NODES_EXPANDED, 1);
+    struct suffix_array *sa = data->sa;
+    int part = current_part(data, &state);
+    char a = data->read[state.i];
+    
+    // ---MATCHING----------------------------------------------
+    if (sa->c_table_symbols_inverse[(int)a] != 0) {
+        struct scheme_state next = state;
+        if (extend_left(sa, a, &next.L, &next.R, &next.rev_L)) {
+            push_edit_front(&data->edits, match_symbol(data), 1);
+            left_after(data, next);
+            pop_edit_front(&data->edits, 1);
+        }
+    }
+    
+    if (!can_make_error(data, &state))
+        return;
+    
+    data->part_errors[part]++;
+    state.errors++;
+    
+    // ---SUBSTITUTION------------------------------------------
+    for (size_t k = 0; k < sa->c_table_no_symbols; k++) {
+        char b = sa->c_table_symbols[k];
+        if (b == '\0' || b == a) continue;
+        struct scheme_state next = state;
+        if (extend_left(sa, b, &next.L, &next.R, &next.rev_L)) {
+            push_edit_front(&data->edits, mismatch_symbol(data), 1);
+            left_after(data, next);
+            pop_edit_front(&data->edits, 1);
+        }
+    }
+    
+    // ---INSERTION---------------------------------------------
+    push_edit_front(&data->edits, 'I', 1);
+    left_after(data, state);
+    pop_edit_front(&data->edits, 1);
+    
+    data->part_errors[part]--;
+}
+
+static void left_trailing(struct bidirectional_search_data *data,
+                          struct scheme_state state)
+{
+    count_stat(COUNT_NODES_EXPANDED, 1);
+    struct suffix_array *sa = data->sa;
+    int part = current_part(data, &state);
+    
+    left_before(data, state);
+    
+    if (!can_make_error(data, &state))
+        return;
+    
+    // ---DELETION----------------------------------------------
+    data->part_errors[part]++;
+    state.errors++;
+    for (size_t k = 0; k < sa->c_table_no_symbols; k++) {
+        char b = sa->c_table_symbols[k];
+        if (b == '\0') continue;
+        struct scheme_state next = state;
+        if (extend_left(sa, b, &next.L, &next.R, &next.rev_L)) {
+            push_edit_front(&data->edits, 'D', 1);
+            left_trailing(data, next);
+            pop_edit_front(&data->edits, 1);
+        }
+    }
+    data->part_errors[part]--;
+}
+
+static void scheme_next_part(struct bidirectional_search_data *data,
+                             struct scheme_state state)
+{
+    const int *pi = data->scheme->searches[data->search_no].pi;
+    int part = pi[state.j];
+    
+    // The parts we have processed so far form a contiguous block
+    // so we either extend it to the right or to the left.
+    bool go_right = true;
+    if (state.j > 0) {
+        int right_most = pi[0];
+        for (int k = 1; k < state.j; k++) {
+            if (pi[k] > right_most) right_most = pi[k];
+        }
+        go_right = (part > right_most);
+    }
+    
+    if (go_right) {
+        state.i = data->part_start[part];
+        
+        // If the first part must match exactly, we can jump straight
+        // past its first k characters using the k-mer table.
+        size_t k = data->sa->kmer_length;
+        if (state.j == 0 && data->scheme->searches[data->search_no].U[0] == 0 &&
+            k > 0 && data->part_start[part + 1] - state.i >= k &&
+            lookup_kmer(data->sa, data->read + state.i,
+                        &state.L, &state.R, &state.rev_L)) {
+            if (state.L > state.R)
+                return; // no exact matches of the k-mer
+            push_edit_back(&data->edits, match_symbol(data), k);
+            state.i += k - 1;
+            right_after(data, state);
+            pop_edit_back(&data->edits, k);
+            return;
+        }
+        
+        right_before(data, state);
+    } else {
+        state.i = data->part_start[part + 1] - 1;
+        if (state.i == data->read_length - 1)
+            left_trailing(data, state);
+        else
+            left_before(data, state);
+    }
+}
+
+bool bidirectional_search(const char *read, const char *ref_name,
+                          bool reverse, int d,
+                          struct suffix_array *sa, struct hit_list *hits,
+                          struct options *options)
+{
+    if (d < 1 || d > (int)NO_SEARCH_SCHEMES)
+        return false;
+    
+    const struct search_scheme *scheme = &search_schemes[d - 1];
+    size_t n = strlen(read);
+    if (n < (size_t)scheme->no_parts)
+        return false;
+    
+    // Room for the read plus d deletions on either side of the middle.
+    size_t cigar_size = 2 * (n + (size_t)d) + 1;
+    char ops[cigar_size], cigar_buffer[cigar_size];
+    size_t lengths[cigar_size];
+    
+    struct bidirectional_search_data data;
+    data.read = read;
+    data.read_length = n;
+    data.ref_name = ref_name;
+    data.reverse = reverse;
+    data.sa = sa;
+    data.hits = hits;
+    data.options = options;
+    data.scheme = scheme;
+    data.cigar_buffer = cigar_buffer;
+    
+    for (int k = 0; k <= scheme->no_parts; k++) {
+        data.part_start[k] = (size_t)k * n / (size_t)scheme->no_parts;
+    }
+    for (int k = 0; k < scheme->no_parts; k++) {
+        data.part_errors[k] = 0;
+    }
+    
+    for (int s = 0; s < scheme->no_searches; s++) {
+        data.search_no = s;
+        struct scheme_state state;
+        state.j = 0;
+        state.i = 0;
+        state.errors = 0;
+        state.L = 0;
+        state.R = sa->length - 1;
+        state.rev_L = 0;
+        init_edit_script(&data.edits, ops, lengths, n + (size_t)d);
+        scheme_next_part(&data, state);
+    }
+    
+    return true;
+}
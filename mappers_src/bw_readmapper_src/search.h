@@ -4,15 +4,38 @@
 
 #include "suffix_array_records.h"
 #include "options.h"
+#include "hit_list.h"
+#include "cigar.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-void search(const char *read_name, const char *read, size_t read_idx,
-            const char *quality,
-            const char *ref_name, size_t L, size_t R, int d,
-            char *cigar, char *cigar_buffer,
-            struct suffix_array *sa, FILE *samfile,
+// Backward search from read_idx with the interval [L, R]. The edits
+// hold the CIGAR for the part of the read we have matched so far, and
+// cigar is where we format it when we report hits.
+void search(const char *read, size_t read_idx,
+            const char *ref_name, bool reverse, size_t L, size_t R, int d,
+            struct edit_script *edits, char *cigar,
+            struct suffix_array *sa, struct hit_list *hits,
             struct options *options);
 
+// Backward search for the entire read, starting from the full
+// suffix array (or where the k-mer table takes us). If reverse is
+// true, read is the reverse complement of the actual read and the
+// hits are reported for the reverse strand.
+void backward_search(const char *read, const char *ref_name,
+                     bool reverse, int d,
+                     struct suffix_array *sa, struct hit_list *hits,
+                     struct options *options);
+
+// Approximative search using the bidirectional index and a search
+// scheme for d errors. Returns false, without searching, if we do
+// not have a scheme for d or the read is too short to split into
+// the parts of the scheme; then use the backward search instead.
+bool bidirectional_search(const char *read, const char *ref_name,
+                          bool reverse, int d,
+                          struct suffix_array *sa, struct hit_list *hits,
+                          struct options *options);
+
 #endif
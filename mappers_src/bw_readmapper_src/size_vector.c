@@ -1,12 +1,13 @@
 
 
 #include "size_vector.h"
+#include "mapper_stats.h"
 #include <stdlib.h>
 
 struct size_vector *empty_size_vector(size_t initial_size)
 {
-    struct size_vector *v = (struct size_vector*)malloc(sizeof(struct size_vector));
-    v->sizes = (size_t*)malloc(initial_size*sizeof(size_t));
+    struct size_vector *v = (struct size_vector*)tracked_malloc(sizeof(struct size_vector));
+    v->sizes = (size_t*)tracked_malloc(initial_size*sizeof(size_t));
     v->size = initial_size;
     v->used = 0;
     return v;
@@ -14,14 +15,19 @@ struct size_vector *empty_size_vector(size_t initial_size)
 
 void delete_size_vector(struct size_vector *v)
 {
-    free(v->sizes);
-    free(v);
+    tracked_free(v->sizes);
+    tracked_free(v);
+}
+
+void clear_size_vector(struct size_vector *v)
+{
+    v->used = 0;
 }
 
 struct size_vector *add_size(struct size_vector *v, size_t size)
 {
     if (v->used == v->size) {
-        v->sizes = (size_t*)realloc(v->sizes, 2 * v->size * sizeof(size_t));
+        v->sizes = (size_t*)tracked_realloc(v->sizes, 2 * v->size * sizeof(size_t));
         v->size = 2 * v->size;
     }
     
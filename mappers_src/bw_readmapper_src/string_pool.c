@@ -0,0 +1,57 @@
+
+#include "string_pool.h"
+#include "mapper_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct string_pool *empty_string_pool(size_t initial_size)
+{
+    struct string_pool *pool =
+        (struct string_pool*)tracked_malloc(sizeof(struct string_pool));
+    pool->size = initial_size > 0 ? initial_size : 1;
+    pool->used = 0;
+    pool->offsets = (size_t*)tracked_malloc(pool->size * sizeof(size_t));
+    
+    pool->buffer_size = 16 * pool->size; // arbitrary size...
+    pool->buffer_used = 0;
+    pool->buffer = (char*)tracked_malloc(pool->buffer_size);
+    
+    return pool;
+}
+
+void delete_string_pool(struct string_pool *pool)
+{
+    tracked_free(pool->offsets);
+    tracked_free(pool->buffer);
+    tracked_free(pool);
+}
+
+void clear_string_pool(struct string_pool *pool)
+{
+    pool->used = 0;
+    pool->buffer_used = 0;
+}
+
+size_t add_pool_string_n(struct string_pool *pool, const char *s, size_t n)
+{
+    if (pool->used == pool->size) {
+        pool->size *= 2;
+        pool->offsets = (size_t*)tracked_realloc(pool->offsets, pool->size * sizeof(size_t));
+    }
+    while (pool->buffer_used + n + 1 > pool->buffer_size) {
+        pool->buffer_size *= 2;
+        pool->buffer = (char*)tracked_realloc(pool->buffer, pool->buffer_size);
+    }
+    
+    memcpy(pool->buffer + pool->buffer_used, s, n);
+    pool->buffer[pool->buffer_used + n] = '\0';
+    pool->offsets[pool->used] = pool->buffer_used;
+    pool->buffer_used += n + 1;
+    return pool->used++;
+}
+
+size_t add_pool_string(struct string_pool *pool, const char *s)
+{
+    return add_pool_string_n(pool, s, strlen(s));
+}
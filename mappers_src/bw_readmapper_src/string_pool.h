@@ -0,0 +1,45 @@
+
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <stddef.h>
+
+/*
+ A pool of strings. All the characters go in one buffer, with the
+ '\0' after each string, and we keep the offset of each string, so
+ adding a string doesn't allocate (unless the pool has to grow) and
+ clearing the pool, to reuse it, is O(1).
+ 
+ The buffer moves when it grows, so a pointer from pool_string() is
+ only valid until the next string is added; hold on to the index.
+ */
+
+struct string_pool {
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_used;
+    
+    size_t *offsets;
+    size_t size;
+    size_t used;
+};
+
+struct string_pool *empty_string_pool(size_t initial_size);
+void delete_string_pool(struct string_pool *pool);
+void clear_string_pool(struct string_pool *pool);
+
+// add a copy of the first n characters of s and return its index
+size_t add_pool_string_n(struct string_pool *pool, const char *s, size_t n);
+// add a copy of s and return its index
+size_t add_pool_string(struct string_pool *pool, const char *s);
+
+static inline const char *pool_string(const struct string_pool *pool, size_t i) {
+    return pool->buffer + pool->offsets[i];
+}
+
+static inline size_t pool_string_length(const struct string_pool *pool, size_t i) {
+    size_t end = (i + 1 < pool->used) ? pool->offsets[i + 1] : pool->buffer_used;
+    return end - pool->offsets[i] - 1;
+}
+
+#endif
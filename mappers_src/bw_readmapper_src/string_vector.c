@@ -1,14 +1,15 @@
 
 #include "string_vector.h"
 #include "strings.h"
+#include "mapper_stats.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 struct string_vector *empty_string_vector(size_t initial_size)
 {
-    struct string_vector *v = (struct string_vector*)malloc(sizeof(struct string_vector));
-    v->strings = (char**)malloc(initial_size*sizeof(char*));
+    struct string_vector *v = (struct string_vector*)tracked_malloc(sizeof(struct string_vector));
+    v->strings = (char**)tracked_malloc(initial_size*sizeof(char*));
     v->size = initial_size;
     v->used = 0;
     return v;
@@ -17,18 +18,23 @@ struct string_vector *empty_string_vector(size_t initial_size)
 void delete_string_vector(struct string_vector *v)
 {
     for (size_t i = 0; i < v->used; ++i)
-        free(v->strings[i]);
-    free(v->strings);
-    free(v);
+        tracked_free(v->strings[i]);
+    tracked_free(v->strings);
+    tracked_free(v);
 }
 
 struct string_vector *add_string_copy(struct string_vector *v, const char *s)
+{
+    return add_string(v, string_copy(s));
+}
+
+struct string_vector *add_string(struct string_vector *v, char *s)
 {
     if (v->used == v->size) {
-        v->strings = (char**)realloc(v->strings, 2 * v->size * sizeof(char*));
+        v->strings = (char**)tracked_realloc(v->strings, 2 * v->size * sizeof(char*));
         v->size = 2 * v->size;
     }
     
-    v->strings[v->used++] = string_copy(s);
+    v->strings[v->used++] = s;
     return v;
 }
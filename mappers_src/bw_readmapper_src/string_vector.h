@@ -17,4 +17,7 @@ void delete_string_vector(struct string_vector *v);
 // always delete it later. We resize the vector if necessary.
 struct string_vector *add_string_copy(struct string_vector *v, const char *s);
 
+// add a string we have already allocated; the vector takes it over.
+struct string_vector *add_string(struct string_vector *v, char *s);
+
 #endif
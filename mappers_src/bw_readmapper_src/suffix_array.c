@@ -2,7 +2,9 @@
 #include "suffix_array.h"
 #include "strings.h"
 #include "pair_stack.h"
+#include "mapper_stats.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,7 +14,7 @@
 struct suffix_array *empty_suffix_array()
 {
     struct suffix_array *sa =
-        (struct suffix_array*)malloc(sizeof(struct suffix_array));
+        (struct suffix_array*)tracked_malloc(sizeof(struct suffix_array));
     sa->length = 0;
     sa->array = 0;
     
@@ -22,6 +24,10 @@ struct suffix_array *empty_suffix_array()
     sa->c_table_symbols_inverse = 0;
     
     sa->o_table = 0;
+    sa->rev_o_table = 0;
+    
+    sa->kmer_length = 0;
+    sa->kmer_table = 0;
     
     return sa;
 }
@@ -30,7 +36,7 @@ static struct suffix_array *allocate_sa(const char *string)
 {
     struct suffix_array *sa = empty_suffix_array();
     sa->length = strlen(string) + 1; // + 1 for empty string
-    sa->array = (size_t*)malloc(sa->length * sizeof(size_t));
+    sa->array = (size_t*)tracked_malloc(sa->length * sizeof(size_t));
     
     return sa;
 }
@@ -45,7 +51,7 @@ struct suffix_array *qsort_sa_construction(const char *string)
 {
     struct suffix_array *sa = allocate_sa(string);
     
-    char **suffixes = malloc(sa->length * sizeof(char *));
+    char **suffixes = tracked_malloc(sa->length * sizeof(char *));
     for (size_t i = 0; i < sa->length; ++i)
         suffixes[i] = (char *)string + i;
     
@@ -53,6 +59,7 @@ struct suffix_array *qsort_sa_construction(const char *string)
     
     for (size_t i = 0; i < sa->length; i++)
         sa->array[i] = (size_t)(suffixes[i] - string);
+    tracked_free(suffixes);
     
 #if 0
     fprintf(stderr, "suffix array:\n");
@@ -71,9 +78,9 @@ void compute_c_table(struct suffix_array *sa, const char *string)
     // than preprocessing the string and matching it to a smaller set
     // and for the sizes of data I can handle, in any case, this won't
     // be the main problem.
-    sa->c_table = (size_t*)calloc(C_TABLE_SIZE, sizeof(size_t));
-    sa->c_table_symbols = (char*)calloc(C_TABLE_SIZE, 1);
-    sa->c_table_symbols_inverse = (size_t*)calloc(C_TABLE_SIZE, sizeof(size_t));
+    sa->c_table = (size_t*)tracked_calloc(C_TABLE_SIZE, sizeof(size_t));
+    sa->c_table_symbols = (char*)tracked_calloc(C_TABLE_SIZE, 1);
+    sa->c_table_symbols_inverse = (size_t*)tracked_calloc(C_TABLE_SIZE, sizeof(size_t));
     sa->c_table_no_symbols = 0;
     
     // first, count the occurrances of each symbol
@@ -107,7 +114,78 @@ void compute_c_table(struct suffix_array *sa, const char *string)
     }
 }
 
-void compute_o_table(struct suffix_array *sa, const char *string)
+/*
+ We build the o-table in blocks of positions so the blocks can be
+ handled by separate threads. In the first pass, each block computes
+ its part of the b table (as symbol indices) and counts how many of
+ each symbol it contains. A prefix sum over the block counts then gives
+ us the o-table values just before each block, and in the second pass
+ each block can fill in its own columns independently of the others.
+ */
+struct o_table_block {
+    struct suffix_array *sa;
+    const char *string;
+    unsigned char *b;
+    size_t from, to;
+    size_t counts[C_TABLE_SIZE];
+};
+
+static void *count_o_table_block(void *data)
+{
+    struct o_table_block *block = (struct o_table_block*)data;
+    struct suffix_array *sa = block->sa;
+    
+    for (size_t i = block->from; i < block->to; i++) {
+        size_t sa_index = sa->array[i];
+        char symbol = (sa_index == 0) ? '\0' : block->string[sa_index - 1];
+        size_t symbol_idx = sa->c_table_symbols_inverse[(unsigned char)symbol];
+        assert(symbol_idx > 0);
+        block->b[i] = (unsigned char)(symbol_idx - 1);
+        block->counts[symbol_idx - 1]++;
+    }
+    
+    return 0;
+}
+
+static void *fill_o_table_block(void *data)
+{
+    struct o_table_block *block = (struct o_table_block*)data;
+    struct suffix_array *sa = block->sa;
+    
+    // one row at a time, so we run through memory sequentially
+    for (size_t j = 0; j < sa->c_table_no_symbols; j++) {
+        size_t *row = sa->o_table + j * sa->length;
+        size_t count = block->counts[j];
+        for (size_t i = block->from; i < block->to; i++) {
+            count += (block->b[i] == j);
+            row[i] = count;
+        }
+    }
+    
+    return 0;
+}
+
+static void run_o_table_blocks(void *(*func)(void *),
+                               struct o_table_block *blocks,
+                               size_t no_blocks)
+{
+    // the first block is handled by the calling thread
+    pthread_t *threads = tracked_malloc(no_blocks * sizeof(pthread_t));
+    for (size_t i = 1; i < no_blocks; i++) {
+        if (0 != pthread_create(&threads[i], 0, func, &blocks[i])) {
+            fprintf(stderr, "Could not create thread.\n");
+            exit(1);
+        }
+    }
+    func(&blocks[0]);
+    for (size_t i = 1; i < no_blocks; i++) {
+        pthread_join(threads[i], 0);
+    }
+    tracked_free(threads);
+}
+
+void compute_o_table(struct suffix_array *sa, const char *string,
+                     size_t no_threads)
 {
     // These must be computed first
     assert(sa->array);
@@ -116,51 +194,52 @@ void compute_o_table(struct suffix_array *sa, const char *string)
     assert(sa->c_table_symbols);
     assert(sa->c_table_symbols_inverse);
     
-    fprintf(stderr, "...building b table.\n");
-    char *b = malloc(sa->length);
-    for (size_t i = 0; i < sa->length; i++) {
-        size_t sa_index = sa->array[i];
-        if (sa_index == 0) {
-            b[i] = '\0';
-        } else {
-            b[i] = string[sa_index - 1];
-        }
-    }
-#if 0
-    for (size_t i = 0; i < sa->length; i++) {
-        fprintf(stderr, "b[%lu] == %c\n", i, b[i]);
-    }
-#endif
-    
     size_t o_table_size = sa->c_table_no_symbols * sa->length;
     fprintf(stderr, "...allocating o-table size: [%lu x %lu] (%lu)\n",
             sa->c_table_no_symbols, sa->length,
             o_table_size);
     assert(o_table_size > 0);
-    sa->o_table = malloc(o_table_size * sizeof(size_t));
+    sa->o_table = tracked_malloc(o_table_size * sizeof(size_t));
     
-    fprintf(stderr, "...building o-table.\n");
-    // first column of the o-table is a special case because
-    // we cannot look at b[i-1].
-    size_t idx = 0;
-    char b_symbol = b[0];
+    // no point in having blocks with (almost) nothing in them.
+    size_t no_blocks = no_threads;
+    if (no_blocks > sa->length / O_TABLE_MIN_BLOCK_SIZE)
+        no_blocks = sa->length / O_TABLE_MIN_BLOCK_SIZE;
+    if (no_blocks < 1)
+        no_blocks = 1;
+    
+    struct o_table_block *blocks =
+        (struct o_table_block*)tracked_calloc(no_blocks, sizeof(struct o_table_block));
+    unsigned char *b = tracked_malloc(sa->length);
+    size_t block_size = (sa->length + no_blocks - 1) / no_blocks;
+    for (size_t i = 0; i < no_blocks; i++) {
+        blocks[i].sa = sa;
+        blocks[i].string = string;
+        blocks[i].b = b;
+        blocks[i].from = i * block_size;
+        blocks[i].to = (i + 1) * block_size;
+        if (blocks[i].to > sa->length)
+            blocks[i].to = sa->length;
+    }
+    
+    fprintf(stderr, "...building b table (%lu blocks).\n", no_blocks);
+    run_o_table_blocks(count_o_table_block, blocks, no_blocks);
+    
+    // turn the counts into the number of occurrences before each block
     for (size_t j = 0; j < sa->c_table_no_symbols; j++) {
-        char row_symbol = sa->c_table_symbols[j];
-        sa->o_table[idx] = (b_symbol == row_symbol) ? 1 : 0;
-        idx += sa->length;
-    }
-    
-    for (size_t i = 1; i < sa->length; i++) {
-        b_symbol = b[i];
-        for (size_t j = 0; j < sa->c_table_no_symbols; j++) {
-            char row_symbol = sa->c_table_symbols[j];
-            idx = o_table_index(sa, row_symbol, i);
-            sa->o_table[idx] = (b_symbol == row_symbol) ?
-                sa->o_table[idx-1] + 1 :
-                sa->o_table[idx-1];
+        size_t count = 0;
+        for (size_t i = 0; i < no_blocks; i++) {
+            size_t tmp = blocks[i].counts[j];
+            blocks[i].counts[j] = count;
+            count += tmp;
         }
     }
-    free(b);
+    
+    fprintf(stderr, "...building o-table.\n");
+    run_o_table_blocks(fill_o_table_block, blocks, no_blocks);
+    
+    tracked_free(b);
+    tracked_free(blocks);
     fprintf(stderr, "...Done\n");
 
 #if 0
@@ -176,10 +255,40 @@ void compute_o_table(struct suffix_array *sa, const char *string)
 #endif
 }
 
+void compute_reverse_o_table(struct suffix_array *sa, const char *string,
+                             size_t no_threads)
+{
+    // We need the c-table to be able to check that the reversed
+    // string gets the same symbol indices.
+    assert(sa->c_table);
+    
+    size_t n = sa->length - 1;
+    char *rev_string = tracked_malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        rev_string[i] = string[n - i - 1];
+    }
+    rev_string[n] = '\0';
+    
+    // The reversed string has the same symbols with the same counts,
+    // so its c-table is identical and we only need to keep the o-table.
+    fprintf(stderr, "...building suffix array for reversed string.\n");
+    struct suffix_array *rev_sa = qsort_sa_construction(rev_string);
+    compute_c_table(rev_sa, rev_string);
+    assert(rev_sa->c_table_no_symbols == sa->c_table_no_symbols);
+    compute_o_table(rev_sa, rev_string, no_threads);
+    
+    sa->rev_o_table = rev_sa->o_table;
+    rev_sa->o_table = 0;
+    
+    delete_suffix_array(rev_sa);
+    tracked_free(rev_string);
+}
+
 size_t o_table_index(struct suffix_array *sa, char symbol, size_t idx)
 {
     // we are off by one so we can use 0
     // to indicate no index (easier with calloc)
+    count_stat(COUNT_RANK_QUERIES, 1);
     size_t symbol_idx = sa->c_table_symbols_inverse[(int)symbol];
     assert(symbol_idx > 0);
     size_t real_symbol_idx = symbol_idx - 1;
@@ -187,16 +296,186 @@ size_t o_table_index(struct suffix_array *sa, char symbol, size_t idx)
 }
 
 
+// A bidirectional interval is [L, R] in the suffix array of the string
+// and [rev_L, rev_L + R - L] in the suffix array of the reversed string.
+// To keep the two synchronised when we extend one of them we need to
+// know how many of the matches are preceded (or followed) by a smaller
+// symbol.
+
+static size_t count_smaller(struct suffix_array *sa, size_t *o_table,
+                            char a, size_t L, size_t R)
+{
+    size_t count = 0;
+    size_t a_idx = sa->c_table_symbols_inverse[(int)a] - 1;
+    count_stat(COUNT_RANK_QUERIES, L > 0 ? 2 * a_idx : a_idx);
+    for (size_t i = 0; i < a_idx; i++) {
+        size_t row = i * sa->length;
+        count += o_table[row + R];
+        if (L > 0) count -= o_table[row + L - 1];
+    }
+    return count;
+}
+
+static bool extend_interval(struct suffix_array *sa, size_t *o_table,
+                            char a, size_t *L, size_t *R)
+{
+    size_t new_L, new_R;
+    if (*L == 0)
+        new_L = sa->c_table[(int)a] + 1;
+    else
+        new_L = sa->c_table[(int)a] + 1 + o_table[o_table_index(sa, a, *L - 1)];
+    new_R = sa->c_table[(int)a] + o_table[o_table_index(sa, a, *R)];
+    
+    if (new_L > new_R)
+        return false;
+    *L = new_L; *R = new_R;
+    return true;
+}
+
+bool extend_left(struct suffix_array *sa, char a,
+                 size_t *L, size_t *R, size_t *rev_L)
+{
+    size_t new_L = *L, new_R = *R;
+    if (!extend_interval(sa, sa->o_table, a, &new_L, &new_R))
+        return false;
+    *rev_L += count_smaller(sa, sa->o_table, a, *L, *R);
+    *L = new_L; *R = new_R;
+    return true;
+}
+
+bool extend_right(struct suffix_array *sa, char a,
+                  size_t *L, size_t *R, size_t *rev_L)
+{
+    size_t new_rev_L = *rev_L, new_rev_R = *rev_L + *R - *L;
+    if (!extend_interval(sa, sa->rev_o_table, a, &new_rev_L, &new_rev_R))
+        return false;
+    *L += count_smaller(sa, sa->rev_o_table, a, *rev_L, *rev_L + *R - *L);
+    *R = *L + new_rev_R - new_rev_L;
+    *rev_L = new_rev_L;
+    return true;
+}
+
+
+#define MAX_KMER_LENGTH 16
+static const char *kmer_alphabet = "ACGT";
+
+int kmer_rank(char a)
+{
+    switch (a) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default:  return -1;
+    }
+}
+
+size_t kmer_table_size(size_t kmer_length)
+{
+    return 3 * ((size_t)1 << (2 * kmer_length));
+}
+
+size_t kmer_table_length(size_t kmer_length, size_t sa_length)
+{
+    // There is no point in having more k-mers than there are positions
+    // in the string; most of the table would be empty.
+    if (kmer_length > MAX_KMER_LENGTH)
+        kmer_length = MAX_KMER_LENGTH;
+    while (kmer_length > 0 &&
+           ((size_t)1 << (2 * kmer_length)) > sa_length) {
+        kmer_length--;
+    }
+    return kmer_length;
+}
+
+void clear_kmer_table(size_t *kmer_table, size_t kmer_length)
+{
+    // L > R marks a k-mer as missing
+    size_t table_size = kmer_table_size(kmer_length);
+    for (size_t i = 0; i < table_size; i += 3) {
+        kmer_table[i] = 1;
+        kmer_table[i + 1] = 0;
+        kmer_table[i + 2] = 0;
+    }
+}
+
+// Fill in the table for all k-mers ending in the depth characters we
+// have already matched, by extending the interval to the left. The last
+// character in a k-mer is the least significant in its code.
+static void fill_kmer_table(struct suffix_array *sa, size_t depth,
+                            size_t code, size_t L, size_t R, size_t rev_L)
+{
+    if (depth == sa->kmer_length) {
+        size_t *entry = sa->kmer_table + 3 * code;
+        entry[0] = L; entry[1] = R; entry[2] = rev_L;
+        return;
+    }
+    
+    size_t weight = (size_t)1 << (2 * depth);
+    for (const char *a = kmer_alphabet; *a; a++) {
+        if (sa->c_table_symbols_inverse[(int)*a] == 0)
+            continue; // not in the string
+        size_t new_L = L, new_R = R, new_rev_L = rev_L;
+        if (!extend_left(sa, *a, &new_L, &new_R, &new_rev_L))
+            continue;
+        fill_kmer_table(sa, depth + 1, code + (size_t)kmer_rank(*a) * weight,
+                        new_L, new_R, new_rev_L);
+    }
+}
+
+void compute_kmer_table(struct suffix_array *sa, size_t kmer_length)
+{
+    // These must be computed first
+    assert(sa->o_table);
+    assert(sa->rev_o_table);
+    
+    kmer_length = kmer_table_length(kmer_length, sa->length);
+    sa->kmer_length = kmer_length;
+    if (kmer_length == 0)
+        return;
+    
+    size_t table_size = kmer_table_size(kmer_length);
+    fprintf(stderr, "...allocating k-mer table for k = %lu (%lu)\n",
+            kmer_length, table_size);
+    sa->kmer_table = tracked_malloc(table_size * sizeof(size_t));
+    
+    // mark all k-mers as missing, then fill in those that occur
+    clear_kmer_table(sa->kmer_table, kmer_length);
+    fill_kmer_table(sa, 0, 0, 0, sa->length - 1, 0);
+}
+
+bool lookup_kmer(struct suffix_array *sa, const char *kmer,
+                 size_t *L, size_t *R, size_t *rev_L)
+{
+    if (sa->kmer_length == 0)
+        return false;
+    
+    size_t code = 0;
+    for (size_t i = 0; i < sa->kmer_length; i++) {
+        int rank = kmer_rank(kmer[i]);
+        if (rank < 0)
+            return false;
+        code |= (size_t)rank << (2 * (sa->kmer_length - i - 1));
+    }
+    
+    size_t *entry = sa->kmer_table + 3 * code;
+    *L = entry[0]; *R = entry[1]; *rev_L = entry[2];
+    return true;
+}
+
 void delete_suffix_array(struct suffix_array *sa)
 {
-    if (sa->array)                   free(sa->array);
+    if (sa->array)                   tracked_free(sa->array);
+    
+    if (sa->c_table)                 tracked_free(sa->c_table);
+    if (sa->c_table_symbols)         tracked_free(sa->c_table_symbols);
+    if (sa->c_table_symbols_inverse) tracked_free(sa->c_table_symbols_inverse);
     
-    if (sa->c_table)                 free(sa->c_table);
-    if (sa->c_table_symbols)         free(sa->c_table_symbols);
-    if (sa->c_table_symbols_inverse) free(sa->c_table_symbols_inverse);
+    if (sa->o_table)                 tracked_free(sa->o_table);
+    if (sa->rev_o_table)             tracked_free(sa->rev_o_table);
     
-    if (sa->o_table)                 free(sa->o_table);
+    if (sa->kmer_table)              tracked_free(sa->kmer_table);
     
-    free(sa);
+    tracked_free(sa);
 }
 
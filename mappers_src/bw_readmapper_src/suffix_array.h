@@ -2,11 +2,15 @@
 #ifndef SUFFIX_ARRAY_H
 #define SUFFIX_ARRAY_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <assert.h>
 
 #define C_TABLE_SIZE 256
 
+// smallest number of positions we give to a thread when building o-tables
+#define O_TABLE_MIN_BLOCK_SIZE 4096
+
 struct suffix_array {
     // length of the array
     size_t length;
@@ -19,16 +23,56 @@ struct suffix_array {
     char    *c_table_symbols;
     size_t  *c_table_symbols_inverse; // reverse map +1 (to recognize misses)
     size_t *o_table;
+    
+    // o-table for the reversed string. Together with the o-table this
+    // gives us a bidirectional index, where we can extend a match both
+    // to the left and to the right.
+    size_t *rev_o_table;
+    
+    // Bidirectional intervals for all k-mers over ACGT, so we can start
+    // a search k characters into the read. Each k-mer has three entries,
+    // L, R and rev_L; L > R if the k-mer does not occur in the string.
+    size_t  kmer_length;
+    size_t *kmer_table;
 };
 
 struct suffix_array *empty_suffix_array(void);
 struct suffix_array *qsort_sa_construction(const char *string);
 
 void compute_c_table(struct suffix_array *sa, const char *string);
-void compute_o_table(struct suffix_array *sa, const char *string);
+// The o-tables are built using up to no_threads threads.
+void compute_o_table(struct suffix_array *sa, const char *string,
+                     size_t no_threads);
+void compute_reverse_o_table(struct suffix_array *sa, const char *string,
+                             size_t no_threads);
+void compute_kmer_table(struct suffix_array *sa, size_t kmer_length);
+
+// number of entries (not k-mers) in the k-mer table
+size_t kmer_table_size(size_t kmer_length);
+// the k-mer length we actually use for a suffix array of length sa_length
+size_t kmer_table_length(size_t kmer_length, size_t sa_length);
+// mark all k-mers in the table as missing
+void clear_kmer_table(size_t *kmer_table, size_t kmer_length);
+// rank of a in ACGT or -1 if it is not one of those
+int kmer_rank(char a);
 
 size_t o_table_index(struct suffix_array *sa, char symbol, size_t idx);
 
+// Extend the bidirectional interval [L, R] / [rev_L, rev_L + R - L]
+// with symbol a to the left or to the right. If there are no matches
+// the functions return false and leave the interval unchanged.
+bool extend_left(struct suffix_array *sa, char a,
+                 size_t *L, size_t *R, size_t *rev_L);
+bool extend_right(struct suffix_array *sa, char a,
+                  size_t *L, size_t *R, size_t *rev_L);
+
+// Look up the interval for the k-mer starting at kmer. Returns false
+// if there is no k-mer table or the k-mer contains symbols other than
+// ACGT, in which case you have to search for it yourself. If the k-mer
+// does not occur in the string, the lookup succeeds with L > R.
+bool lookup_kmer(struct suffix_array *sa, const char *kmer,
+                 size_t *L, size_t *R, size_t *rev_L);
+
 void delete_suffix_array(struct suffix_array *sa);
 
 #endif
@@ -1,40 +1,147 @@
 
 #include "suffix_array_records.h"
+#include "mapper_stats.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 struct suffix_array_records *empty_suffix_array_records()
 {
     struct suffix_array_records *records =
-        (struct suffix_array_records*)malloc(sizeof(struct suffix_array_records));
+        (struct suffix_array_records*)tracked_malloc(sizeof(struct suffix_array_records));
     records->names = empty_string_vector(10); // arbitrary size...
     records->suffix_arrays = 0;
     return records;
 }
 
-struct suffix_array_records *build_suffix_array_records(struct fasta_records *fasta_records)
+/*
+ When we have more than one thread, we build the indices for several
+ sequences at the same time. Each worker picks the next sequence that
+ nobody has started on yet, longest sequences first so we do not end
+ up waiting for a single long chromosome at the end. If there are more
+ threads than sequences, the remaining threads are used for the o-tables
+ inside each sequence.
+ */
+struct build_info {
+    struct fasta_records *fasta_records;
+    struct suffix_array_records *records;
+    size_t kmer_length;
+    size_t threads_per_sequence;
+    
+    size_t *order;
+    size_t next_sequence;
+    pthread_mutex_t lock;
+};
+
+static void build_sequence_index(struct build_info *info, size_t i)
+{
+    const char *seq_name = pool_string(info->fasta_records->names, i);
+    const char *string = info->fasta_records->sequences->strings[i];
+    
+    fprintf(stderr, "building suffix array for %s.\n", seq_name);
+    enum stats_memory subsystem = set_memory_subsystem(MEM_SUFFIX_ARRAY);
+    struct suffix_array *sa = qsort_sa_construction(string);
+    
+    fprintf(stderr, "building c-table for %s.\n", seq_name);
+    set_memory_subsystem(MEM_RANK_TABLES);
+    compute_c_table(sa, string);
+    
+    fprintf(stderr, "building o-table for %s.\n", seq_name);
+    compute_o_table(sa, string, info->threads_per_sequence);
+    
+    fprintf(stderr, "building reverse o-table for %s.\n", seq_name);
+    compute_reverse_o_table(sa, string, info->threads_per_sequence);
+    
+    fprintf(stderr, "building k-mer table for %s.\n", seq_name);
+    compute_kmer_table(sa, info->kmer_length);
+    set_memory_subsystem(subsystem);
+    
+    info->records->suffix_arrays[i] = sa;
+}
+
+static void *build_worker(void *data)
+{
+    struct build_info *info = (struct build_info*)data;
+    size_t no_records = info->fasta_records->names->used;
+    begin_thread_counts();
+    while (true) {
+        pthread_mutex_lock(&info->lock);
+        size_t next = info->next_sequence++;
+        pthread_mutex_unlock(&info->lock);
+        
+        if (next >= no_records) break;
+        build_sequence_index(info, info->order[next]);
+    }
+    end_thread_counts();
+    return 0;
+}
+
+struct sequence_size {
+    size_t index;
+    size_t size;
+};
+
+static int longest_first_cmpfunc(const void *a, const void *b)
+{
+    size_t size_a = ((const struct sequence_size*)a)->size;
+    size_t size_b = ((const struct sequence_size*)b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+struct suffix_array_records *build_suffix_array_records(struct fasta_records *fasta_records,
+                                                        size_t kmer_length,
+                                                        size_t no_threads)
 {
     size_t no_records = fasta_records->names->used;
     struct suffix_array_records *records = empty_suffix_array_records();
-    records->suffix_arrays = (struct suffix_array **)malloc(sizeof(struct suffix_array*)*no_records);
+    records->suffix_arrays = (struct suffix_array **)tracked_malloc(sizeof(struct suffix_array*)*no_records);
+    for (size_t i = 0; i < no_records; i++) {
+        add_string_copy(records->names, pool_string(fasta_records->names, i));
+    }
+    
+    if (no_threads < 1) no_threads = 1;
+    size_t no_workers = (no_threads < no_records) ? no_threads : no_records;
+    
+    struct build_info info;
+    info.fasta_records = fasta_records;
+    info.records = records;
+    info.kmer_length = kmer_length;
+    info.threads_per_sequence = (no_workers > 0) ? no_threads / no_workers : 1;
+    info.next_sequence = 0;
     
-    fprintf(stderr, "Building suffix arrays.\n");
+    struct sequence_size *sizes =
+        (struct sequence_size*)tracked_malloc(sizeof(struct sequence_size)*no_records);
     for (size_t i = 0; i < no_records; i++) {
-        const char *seq_name = fasta_records->names->strings[i];
-        const char *string = fasta_records->sequences->strings[i];
-        add_string_copy(records->names, seq_name);
-        fprintf(stderr, "building suffix array for %s.\n", seq_name);
-        records->suffix_arrays[i] = qsort_sa_construction(
-            fasta_records->sequences->strings[i]
-        );
-        fprintf(stderr, "building c-table for %s.\n", seq_name);
-        compute_c_table(records->suffix_arrays[i], string);
-        
-        fprintf(stderr, "building o-table for %s.\n", seq_name);
-        compute_o_table(records->suffix_arrays[i], string);
+        sizes[i].index = i;
+        sizes[i].size = fasta_records->seq_sizes->sizes[i];
+    }
+    qsort(sizes, no_records, sizeof(struct sequence_size), longest_first_cmpfunc);
+    info.order = (size_t*)tracked_malloc(sizeof(size_t)*no_records);
+    for (size_t i = 0; i < no_records; i++) {
+        info.order[i] = sizes[i].index;
+    }
+    tracked_free(sizes);
+    pthread_mutex_init(&info.lock, 0);
+    
+    fprintf(stderr, "Building suffix arrays (%lu threads).\n", no_threads);
+    pthread_t *workers = (pthread_t*)tracked_malloc(sizeof(pthread_t)*no_workers);
+    for (size_t i = 1; i < no_workers; i++) {
+        if (0 != pthread_create(&workers[i], 0, build_worker, &info)) {
+            fprintf(stderr, "Could not create thread.\n");
+            exit(1);
+        }
+    }
+    build_worker(&info);
+    for (size_t i = 1; i < no_workers; i++) {
+        pthread_join(workers[i], 0);
     }
     fprintf(stderr, "Done.\n");
     
+    pthread_mutex_destroy(&info.lock);
+    tracked_free(workers);
+    tracked_free(info.order);
+    
     return records;
 }
 
@@ -47,15 +154,15 @@ void delete_suffix_array_records(struct suffix_array_records *records)
                     records->names->strings[i]);
             delete_suffix_array(records->suffix_arrays[i]);
         }
-        free(records->suffix_arrays);
+        tracked_free(records->suffix_arrays);
     }
     delete_string_vector(records->names);
-    free(records);
+    tracked_free(records);
 }
 
-static char *make_file_name(const char *prefix,
-                            const char *suffix,
-                            const char *seq_suffix) {
+char *make_file_name(const char *prefix,
+                     const char *suffix,
+                     const char *seq_suffix) {
     size_t prefix_length = strlen(prefix);
     size_t suffix_length = strlen(suffix);
     size_t string_length = prefix_length + 1 + suffix_length + 1;
@@ -66,7 +173,7 @@ static char *make_file_name(const char *prefix,
         string_length += seq_suffix_length + 1;
     }
     
-    char *buffer = (char*)malloc(string_length);
+    char *buffer = (char*)tracked_malloc(string_length);
     char *c = buffer;
     for (size_t i = 0; i < prefix_length; i++, c++) {
         *c = prefix[i];
@@ -102,12 +209,48 @@ int write_suffix_array_records(struct suffix_array_records *records,
         
         fprintf(stderr, "writing suffix array to %s.\n", filename);
         FILE *file = fopen(filename, "wb");
-        free(filename);
+        tracked_free(filename);
         
         fwrite(sa->array, sizeof(size_t), sa->length, file);
         fclose(file);
     }
     
+    write_c_table_file(records, filename_prefix);
+
+    for (size_t i = 0; i < records->names->used; i++) {
+        const char *seq_name = records->names->strings[i];
+        
+        size_t *o_table = records->suffix_arrays[i]->o_table;
+        size_t *rev_o_table = records->suffix_arrays[i]->rev_o_table;
+        size_t  o_table_size = records->suffix_arrays[i]->c_table_no_symbols * records->suffix_arrays[i]->length;
+        
+        char *filename = make_file_name(filename_prefix, "o_tables", seq_name);
+        fprintf(stderr, "writing o-table to %s.\n", filename);
+        
+        FILE *file = fopen(filename, "wb");
+        tracked_free(filename);
+        fwrite(o_table, sizeof(size_t), o_table_size, file);
+        fclose(file);
+        
+        filename = make_file_name(filename_prefix, "rev_o_tables", seq_name);
+        fprintf(stderr, "writing reverse o-table to %s.\n", filename);
+        
+        file = fopen(filename, "wb");
+        tracked_free(filename);
+        fwrite(rev_o_table, sizeof(size_t), o_table_size, file);
+        fclose(file);
+        
+        write_kmer_table_file(records->suffix_arrays[i], filename_prefix, seq_name);
+    }
+    
+    fprintf(stderr, "Done.\n");
+    
+    return 0;
+}
+
+void write_c_table_file(struct suffix_array_records *records,
+                        const char *filename_prefix)
+{
     char *filename = make_file_name(filename_prefix, "c_tables", 0);
     fprintf(stderr, "writing c-table to %s.\n", filename);
     FILE *sa_file = fopen(filename, "w");
@@ -129,27 +272,85 @@ int write_suffix_array_records(struct suffix_array_records *records,
         fprintf(sa_file, "\n");
     }
     fclose(sa_file);
-    free(filename);
+    tracked_free(filename);
+}
 
-    for (size_t i = 0; i < records->names->used; i++) {
-        const char *seq_name = records->names->strings[i];
-        
-        size_t *o_table = records->suffix_arrays[i]->o_table;
-        size_t  o_table_size = records->suffix_arrays[i]->c_table_no_symbols * records->suffix_arrays[i]->length;
-        
-        char *filename = make_file_name(filename_prefix, "o_tables", seq_name);
-        fprintf(stderr, "writing o-table to %s.\n", filename);
-        
-        FILE *file = fopen(filename, "wb");
-        free(filename);
-        fwrite(o_table, sizeof(size_t), o_table_size, file);
-        fclose(file);
-        
+void write_kmer_table_file(struct suffix_array *sa,
+                           const char *filename_prefix,
+                           const char *seq_name)
+{
+    char *filename = make_file_name(filename_prefix, "kmer_tables", seq_name);
+    fprintf(stderr, "writing k-mer table to %s.\n", filename);
+    
+    FILE *file = fopen(filename, "wb");
+    tracked_free(filename);
+    fwrite(&sa->kmer_length, sizeof(size_t), 1, file);
+    if (sa->kmer_length > 0)
+        fwrite(sa->kmer_table, sizeof(size_t),
+               kmer_table_size(sa->kmer_length), file);
+    fclose(file);
+}
+
+static size_t *read_o_table_file(struct suffix_array *sa,
+                                 const char *filename_prefix,
+                                 const char *table_name,
+                                 const char *seq_name)
+{
+    char *filename = make_file_name(filename_prefix, table_name, seq_name);
+    
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s.\n", filename);
+        exit(1);
     }
+    fprintf(stderr, "reading o-table from %s.\n", filename);
     
-    fprintf(stderr, "Done.\n");
+    size_t  o_table_size = sa->c_table_no_symbols * sa->length;
+    fprintf(stderr, "...allocating o-table size: [%lu x %lu] (%lu)\n",
+            sa->c_table_no_symbols, sa->length,
+            o_table_size);
+    assert(o_table_size > 0);
+    size_t *o_table = tracked_malloc(o_table_size * sizeof(size_t));
+    if (!o_table) {
+        fprintf(stderr, "...could not allocate memory for o-table.\n");
+        exit(1);
+    }
+    fread(o_table, sizeof(size_t), o_table_size, file);
     
-    return 0;
+    fclose(file);
+    tracked_free(filename);
+    
+    return o_table;
+}
+
+static void read_kmer_table_file(struct suffix_array *sa,
+                                 const char *filename_prefix,
+                                 const char *seq_name)
+{
+    char *filename = make_file_name(filename_prefix, "kmer_tables", seq_name);
+    
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open file %s.\n", filename);
+        exit(1);
+    }
+    fprintf(stderr, "reading k-mer table from %s.\n", filename);
+    
+    fread(&sa->kmer_length, sizeof(size_t), 1, file);
+    if (sa->kmer_length > 0) {
+        size_t table_size = kmer_table_size(sa->kmer_length);
+        fprintf(stderr, "...allocating k-mer table for k = %lu (%lu)\n",
+                sa->kmer_length, table_size);
+        sa->kmer_table = tracked_malloc(table_size * sizeof(size_t));
+        if (!sa->kmer_table) {
+            fprintf(stderr, "...could not allocate memory for k-mer table.\n");
+            exit(1);
+        }
+        fread(sa->kmer_table, sizeof(size_t), table_size, file);
+    }
+    
+    fclose(file);
+    tracked_free(filename);
 }
 
 static int read_o_table_records(struct suffix_array_records *records,
@@ -159,31 +360,14 @@ static int read_o_table_records(struct suffix_array_records *records,
     assert(records->suffix_arrays != 0);
     
     for (size_t i = 0; i < fasta_records->names->used; i++) {
-        const char *seq_name = fasta_records->names->strings[i];
+        const char *seq_name = pool_string(fasta_records->names, i);
         struct suffix_array *sa = records->suffix_arrays[i];
-        char *filename = make_file_name(filename_prefix, "o_tables", seq_name);
-        
-        FILE *file = fopen(filename, "rb");
-        if (!file) {
-            fprintf(stderr, "Could not open file %s.\n", filename);
-            exit(1);
-        }
-        fprintf(stderr, "reading o-table from %s.\n", filename);
         
-        size_t  o_table_size = records->suffix_arrays[i]->c_table_no_symbols * records->suffix_arrays[i]->length;
-        fprintf(stderr, "...allocating o-table size: [%lu x %lu] (%lu)\n",
-                sa->c_table_no_symbols, sa->length,
-                o_table_size);
-        assert(o_table_size > 0);
-        sa->o_table = malloc(o_table_size * sizeof(size_t));
-        if (!sa->o_table) {
-            fprintf(stderr, "...could not allocate memory for o-table.\n");
-            exit(1);
-        }
-        fread(sa->o_table, sizeof(size_t), o_table_size, file);
-        
-        fclose(file);
-        free(filename);
+        sa->o_table = read_o_table_file(sa, filename_prefix,
+                                        "o_tables", seq_name);
+        sa->rev_o_table = read_o_table_file(sa, filename_prefix,
+                                            "rev_o_tables", seq_name);
+        read_kmer_table_file(sa, filename_prefix, seq_name);
 
 #if 0
         for (size_t i = 0; i < sa->c_table_no_symbols; i++) {
@@ -223,9 +407,9 @@ static int read_c_table_records(struct suffix_array_records *records,
     for (size_t i = 0; i < no_records; i++) {
         char seq_name[NAME_BUFFER_SIZE];
         fscanf(file, "%1024s", (char*)&seq_name);
-        if (strcmp(seq_name, fasta_records->names->strings[i]) != 0) {
+        if (strcmp(seq_name, pool_string(fasta_records->names, i)) != 0) {
             fprintf(stderr, "The preprocessed c-table sequence read is %s while the FASTA record is %s. This is an error!\n",
-                    seq_name, fasta_records->names->strings[i]);
+                    seq_name, pool_string(fasta_records->names, i));
             return 1;
         }
         fprintf(stderr, "reading c-table for sequence %s.\n", seq_name);
@@ -234,10 +418,10 @@ static int read_c_table_records(struct suffix_array_records *records,
         fprintf(stderr, "... contains %lu non-zero records.\n",
                 c_table_size);
         
-        size_t *c_table = calloc(256, sizeof(size_t));
+        size_t *c_table = tracked_calloc(256, sizeof(size_t));
         size_t  c_table_no_symbols = c_table_size;
         size_t  current_symbol_index = 0;
-        char   *c_table_symbols = malloc(c_table_size);
+        char   *c_table_symbols = tracked_malloc(c_table_size);
         
         for (size_t j = 0; j < c_table_size; j++) {
             char symbol[NAME_BUFFER_SIZE]; size_t count;
@@ -251,7 +435,7 @@ static int read_c_table_records(struct suffix_array_records *records,
                     (symbol_c == 0) ? '$' : symbol_c, count);
         }
         
-        size_t *c_table_symbols_inverse = calloc(C_TABLE_SIZE, sizeof(size_t));
+        size_t *c_table_symbols_inverse = tracked_calloc(C_TABLE_SIZE, sizeof(size_t));
         for (size_t j = 0; j < c_table_no_symbols; j++) {
             char symbol = c_table_symbols[j];
             c_table_symbols_inverse[(int)symbol] = j + 1;
@@ -264,14 +448,14 @@ static int read_c_table_records(struct suffix_array_records *records,
         }
         
         if (records->suffix_arrays[i]->c_table)
-            free(records->suffix_arrays[i]->c_table);
+            tracked_free(records->suffix_arrays[i]->c_table);
         records->suffix_arrays[i]->c_table = c_table;
         if (records->suffix_arrays[i]->c_table_symbols)
-            free(records->suffix_arrays[i]->c_table_symbols);
+            tracked_free(records->suffix_arrays[i]->c_table_symbols);
         records->suffix_arrays[i]->c_table_no_symbols = c_table_no_symbols;
         records->suffix_arrays[i]->c_table_symbols = c_table_symbols;
         if (records->suffix_arrays[i]->c_table_symbols_inverse)
-            free(records->suffix_arrays[i]->c_table_symbols_inverse);
+            tracked_free(records->suffix_arrays[i]->c_table_symbols_inverse);
         records->suffix_arrays[i]->c_table_symbols_inverse = c_table_symbols_inverse;
         
     }
@@ -287,12 +471,13 @@ int read_suffix_array_records(struct suffix_array_records *records,
 {
     size_t no_records = fasta_records->names->used;
     assert(records->suffix_arrays == 0);
+    enum stats_memory subsystem = set_memory_subsystem(MEM_SUFFIX_ARRAY);
     
     records->suffix_arrays =
-        (struct suffix_array**)malloc(sizeof(struct suffix_array*) * no_records);
+        (struct suffix_array**)tracked_malloc(sizeof(struct suffix_array*) * no_records);
     
     for (size_t i = 0; i < fasta_records->names->used; i++) {
-        const char *seq_name = fasta_records->names->strings[i];
+        const char *seq_name = pool_string(fasta_records->names, i);
         size_t seq_length = fasta_records->seq_sizes->sizes[i];
         struct suffix_array *sa =
             records->suffix_arrays[i] =
@@ -306,22 +491,24 @@ int read_suffix_array_records(struct suffix_array_records *records,
         }
         
         sa->length = seq_length + 1;
-        sa->array = malloc(sizeof(size_t) * sa->length);
+        sa->array = tracked_malloc(sizeof(size_t) * sa->length);
     
         fprintf(stderr, "Reading suffix arrays from %s [length %lu].\n",
                 filename, sa->length);
         fread(sa->array, sizeof(size_t), sa->length, file);
         
         fclose(file);
-        free(filename);
+        tracked_free(filename);
 
     }
     
 
     fprintf(stderr, "Done.\n");
     
+    set_memory_subsystem(MEM_RANK_TABLES);
     read_c_table_records(records, fasta_records, filename_prefix);
     read_o_table_records(records, fasta_records, filename_prefix);
+    set_memory_subsystem(subsystem);
 
     return 0;
 }
@@ -12,7 +12,9 @@ struct suffix_array_records {
 };
 
 struct suffix_array_records *empty_suffix_array_records(void);
-struct suffix_array_records *build_suffix_array_records(struct fasta_records *fasta_records);
+struct suffix_array_records *build_suffix_array_records(struct fasta_records *fasta_records,
+                                                        size_t kmer_length,
+                                                        size_t no_threads);
 
 void delete_suffix_array_records(struct suffix_array_records *records);
 
@@ -20,6 +22,17 @@ int write_suffix_array_records(struct suffix_array_records *records,
                                struct fasta_records *fasta_records,
                                const char *filename_prefix);
 
+// Used when the files are written piecemeal, see external_construction.h.
+// The file name is prefix.suffix or prefix.suffix.seq_suffix.
+char *make_file_name(const char *prefix,
+                     const char *suffix,
+                     const char *seq_suffix);
+void write_c_table_file(struct suffix_array_records *records,
+                        const char *filename_prefix);
+void write_kmer_table_file(struct suffix_array *sa,
+                           const char *filename_prefix,
+                           const char *seq_name);
+
 int read_suffix_array_records(struct suffix_array_records *records,
                               struct fasta_records *fasta_records,
                               const char *filename_prefix);
@@ -0,0 +1,171 @@
+
+#include "bgzf.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+// blocks per thread in a batch
+#define BGZF_BATCH_BLOCKS 16
+
+// gzip header with the BC extra field; the last two bytes are the
+// block size minus one, which we fill in when we know it.
+static const unsigned char bgzf_header[BGZF_HEADER_SIZE] = {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+// an empty block marks the end of the file
+static const unsigned char bgzf_eof[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+    0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void put_uint32(unsigned char *out, unsigned long value)
+{
+    out[0] = (unsigned char)(value & 0xff);
+    out[1] = (unsigned char)((value >> 8) & 0xff);
+    out[2] = (unsigned char)((value >> 16) & 0xff);
+    out[3] = (unsigned char)((value >> 24) & 0xff);
+}
+
+static void compress_block(struct bgzf_block *block)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // negative window bits gives us raw deflate without a zlib header
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Could not initialise BGZF compression.\n");
+        exit(1);
+    }
+    stream.next_in = block->data;
+    stream.avail_in = (uInt)block->length;
+    stream.next_out = block->compressed + BGZF_HEADER_SIZE;
+    stream.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "Could not compress BGZF block.\n");
+        exit(1);
+    }
+    size_t size = BGZF_HEADER_SIZE + stream.total_out + BGZF_FOOTER_SIZE;
+    deflateEnd(&stream);
+    
+    unsigned char *out = block->compressed;
+    memcpy(out, bgzf_header, BGZF_HEADER_SIZE);
+    out[16] = (unsigned char)((size - 1) & 0xff);
+    out[17] = (unsigned char)((size - 1) >> 8);
+    
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, block->data, (uInt)block->length);
+    put_uint32(out + size - BGZF_FOOTER_SIZE, crc);
+    put_uint32(out + size - 4, (unsigned long)block->length);
+    
+    block->compressed_length = size;
+}
+
+struct compression_task {
+    struct bgzf_writer *writer;
+    size_t first;
+    size_t no_blocks;
+};
+
+static void *compress_blocks(void *data)
+{
+    struct compression_task *task = (struct compression_task*)data;
+    for (size_t i = task->first; i < task->no_blocks;
+         i += task->writer->no_threads) {
+        compress_block(&task->writer->blocks[i]);
+    }
+    return 0;
+}
+
+// compress the blocks we have filled and write them to the file
+static void write_batch(struct bgzf_writer *writer)
+{
+    size_t no_blocks = writer->current;
+    if (no_blocks < writer->no_blocks && writer->blocks[no_blocks].length > 0)
+        no_blocks++; // the last block isn't full
+    if (no_blocks == 0)
+        return;
+    
+    size_t no_threads = writer->no_threads;
+    if (no_threads > no_blocks)
+        no_threads = no_blocks;
+    
+    struct compression_task tasks[no_threads];
+    pthread_t threads[no_threads];
+    for (size_t t = 0; t < no_threads; t++) {
+        tasks[t].writer = writer;
+        tasks[t].first = t;
+        tasks[t].no_blocks = no_blocks;
+    }
+    for (size_t t = 1; t < no_threads; t++) {
+        if (0 != pthread_create(&threads[t], 0, compress_blocks, &tasks[t])) {
+            fprintf(stderr, "Could not create thread.\n");
+            exit(1);
+        }
+    }
+    compress_blocks(&tasks[0]);
+    for (size_t t = 1; t < no_threads; t++) {
+        pthread_join(threads[t], 0);
+    }
+    
+    for (size_t i = 0; i < no_blocks; i++) {
+        struct bgzf_block *block = &writer->blocks[i];
+        if (fwrite(block->compressed, 1, block->compressed_length,
+                   writer->file) != block->compressed_length) {
+            perror("Could not write BGZF block");
+            exit(1);
+        }
+        block->length = 0;
+    }
+    writer->current = 0;
+}
+
+struct bgzf_writer *empty_bgzf_writer(FILE *file, size_t no_threads)
+{
+    if (no_threads < 1) no_threads = 1;
+    
+    struct bgzf_writer *writer =
+        (struct bgzf_writer*)malloc(sizeof(struct bgzf_writer));
+    writer->file = file;
+    writer->no_threads = no_threads;
+    writer->no_blocks = BGZF_BATCH_BLOCKS * no_threads;
+    writer->current = 0;
+    writer->blocks =
+        (struct bgzf_block*)malloc(writer->no_blocks * sizeof(struct bgzf_block));
+    for (size_t i = 0; i < writer->no_blocks; i++) {
+        writer->blocks[i].length = 0;
+    }
+    return writer;
+}
+
+void delete_bgzf_writer(struct bgzf_writer *writer)
+{
+    write_batch(writer);
+    fwrite(bgzf_eof, 1, sizeof(bgzf_eof), writer->file);
+    free(writer->blocks);
+    free(writer);
+}
+
+void bgzf_write(struct bgzf_writer *writer, const void *data, size_t n)
+{
+    const unsigned char *from = (const unsigned char*)data;
+    while (n > 0) {
+        struct bgzf_block *block = &writer->blocks[writer->current];
+        size_t room = BGZF_BLOCK_DATA_SIZE - block->length;
+        size_t chunk = (n < room) ? n : room;
+        memcpy(block->data + block->length, from, chunk);
+        block->length += chunk;
+        from += chunk;
+        n -= chunk;
+        
+        if (block->length == BGZF_BLOCK_DATA_SIZE) {
+            writer->current++;
+            if (writer->current == writer->no_blocks)
+                write_batch(writer);
+        }
+    }
+}
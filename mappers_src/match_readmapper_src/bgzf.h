@@ -0,0 +1,42 @@
+
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ BGZF is the compression format used for BAM files: a series of gzip
+ blocks with at most 64KB of data in each. Since the blocks are
+ independent, we collect a batch of them and compress the batch using
+ several threads before writing the blocks to the file in order.
+ */
+
+// the most data we put in one block
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+// the largest a compressed block can be
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+struct bgzf_block {
+    size_t length;
+    unsigned char data[BGZF_BLOCK_DATA_SIZE];
+    size_t compressed_length;
+    unsigned char compressed[BGZF_MAX_BLOCK_SIZE];
+};
+
+struct bgzf_writer {
+    FILE *file;
+    size_t no_threads;
+    size_t no_blocks;   // blocks in a batch
+    size_t current;     // the block we are filling
+    struct bgzf_block *blocks;
+};
+
+struct bgzf_writer *empty_bgzf_writer(FILE *file, size_t no_threads);
+// compresses and writes what is left, followed by the end-of-file
+// marker, but does not close the file
+void delete_bgzf_writer(struct bgzf_writer *writer);
+
+void bgzf_write(struct bgzf_writer *writer, const void *data, size_t n);
+
+#endif
@@ -2,8 +2,85 @@
 #ifndef CIGAR_H
 #define CIGAR_H
 
-// takes a string with cigar encoding and replaces
-// segments of the same symbol to a number plus the symbol.
-void simplify_cigar(const char *cigar, char *buffer);
+#include <stddef.h>
+
+/*
+ An edit script is a CIGAR kept as runs, an operation and its length,
+ while we build it. The searches add and remove one operation at a
+ time as they recurse and backtrack, and that only changes the run at
+ the end of the script, so we never have to scan the operations to
+ build the CIGAR string. We only format it when we report a hit.
+ 
+ The script can grow at both ends. The runs are in [begin, end) of
+ arrays the caller provides; the caller decides where in the arrays
+ the script starts, so there is room for the runs on each side. A
+ script of n operations has at most n runs.
+ 
+ Operations must be removed in the opposite order of how they were
+ added, which is what we get from backtracking.
+ */
+struct edit_script {
+    char *ops;
+    size_t *lengths;
+    size_t begin;
+    size_t end;
+};
+
+void init_edit_script(struct edit_script *script,
+                      char *ops, size_t *lengths, size_t start);
+
+static inline void push_edit_back(struct edit_script *script, char op, size_t n)
+{
+    if (script->end > script->begin && script->ops[script->end - 1] == op) {
+        script->lengths[script->end - 1] += n;
+    } else {
+        script->ops[script->end] = op;
+        script->lengths[script->end] = n;
+        script->end++;
+    }
+}
+
+static inline void pop_edit_back(struct edit_script *script, size_t n)
+{
+    script->lengths[script->end - 1] -= n;
+    if (script->lengths[script->end - 1] == 0)
+        script->end--;
+}
+
+static inline void push_edit_front(struct edit_script *script, char op, size_t n)
+{
+    if (script->end > script->begin && script->ops[script->begin] == op) {
+        script->lengths[script->begin] += n;
+    } else {
+        script->begin--;
+        script->ops[script->begin] = op;
+        script->lengths[script->begin] = n;
+    }
+}
+
+static inline void pop_edit_front(struct edit_script *script, size_t n)
+{
+    script->lengths[script->begin] -= n;
+    if (script->lengths[script->begin] == 0)
+        script->begin++;
+}
+
+// Write the script as a CIGAR string. For a script of n operations,
+// to must have room for 2n + 1 characters.
+void edit_script_cigar(const struct edit_script *script, char *to);
+
+// The number of edits in a simplified, extended CIGAR, i.e. the
+// mismatches ('X'), insertions and deletions. This is the NM tag.
+size_t cigar_edit_distance(const char *cigar);
+
+// Replace the '=' and 'X' operations in a simplified, extended CIGAR
+// with 'M', merging the runs they are in, so "3=1X2=1I" becomes "6M1I".
+// The result is never longer than the input.
+void collapse_cigar(const char *from, char *to);
+
+// Add soft-clips of front and back bases to the ends of cigar. A
+// clip of zero bases is left out. to must have room for the CIGAR
+// plus 43 characters.
+void soft_clip_cigar(const char *cigar, size_t front, size_t back, char *to);
 
 #endif
@@ -1,94 +1,95 @@
 
 #include "edit_distance_generator.h"
 #include "cigar.h"
+#include "mapper_stats.h"
 
 #include <string.h>
 #include <stdio.h>
 
 struct recursive_constant_data {
     const char *buffer_front;
-    const char *cigar_front;
     const char *alphabet;
-    char *simplify_cigar_buffer;
+    struct edit_script cigar;
+    char *cigar_buffer;
 };
 
-static void recursive_generator(const char *pattern, char *buffer, char *cigar,
+static void report_neighbour(struct recursive_constant_data *data,
+                             edits_callback_func callback,
+                             void *callback_data)
+{
+    edit_script_cigar(&data->cigar, data->cigar_buffer);
+    callback(data->buffer_front, data->cigar_buffer, callback_data);
+}
+
+static void recursive_generator(const char *pattern, char *buffer,
                                 int max_edit_distance,
                                 struct recursive_constant_data *data,
                                 edits_callback_func callback,
                                 void *callback_data,
                                 struct options *options)
 {
+    count_stat(COUNT_NODES_EXPANDED, 1);
     if (*pattern == '\0') {
         // no more pattern to match ... 
         
         // with no more edits: terminate the buffer and call back
         *buffer = '\0';
-        *cigar = '\0';
-        simplify_cigar(data->cigar_front, data->simplify_cigar_buffer);
-        callback(data->buffer_front, data->simplify_cigar_buffer, callback_data);
+        report_neighbour(data, callback, callback_data);
 
         // if we have more edits left, we add some deletions
         if (max_edit_distance > 0) {
+            push_edit_back(&data->cigar, 'D', 1);
             for (const char *a = data->alphabet; *a; a++) {
                 *buffer = *a;
-                *cigar = 'D';
-                recursive_generator(pattern, buffer + 1, cigar + 1,
+                recursive_generator(pattern, buffer + 1,
                                     max_edit_distance - 1, data,
                                     callback, callback_data, options);
             }
+            pop_edit_back(&data->cigar, 1);
         }
         
         
     } else if (max_edit_distance == 0) {
         // we can't edit any more, so just move pattern to buffer and call back
         size_t rest = strlen(pattern);
-        for (size_t i = 0; i < rest; ++i) {
-            buffer[i] = pattern[i];
-            if (options->extended_cigars)
-                cigar[i] = '=';
-            else
-                cigar[i] = 'M';
-        }
-        buffer[rest] = cigar[rest] = '\0';
-        simplify_cigar(data->cigar_front, data->simplify_cigar_buffer);
-        callback(data->buffer_front, data->simplify_cigar_buffer, callback_data);
+        memcpy(buffer, pattern, rest + 1);
+        push_edit_back(&data->cigar, options->extended_cigars ? '=' : 'M', rest);
+        report_neighbour(data, callback, callback_data);
+        pop_edit_back(&data->cigar, rest);
         
     } else {
         // --- time to recurse --------------------------------------
         // deletion
-        *cigar = 'I';
-        recursive_generator(pattern + 1, buffer, cigar + 1,
+        push_edit_back(&data->cigar, 'I', 1);
+        recursive_generator(pattern + 1, buffer,
                             max_edit_distance - 1, data,
                             callback, callback_data, options);
+        pop_edit_back(&data->cigar, 1);
         // insertion
+        push_edit_back(&data->cigar, 'D', 1);
         for (const char *a = data->alphabet; *a; a++) {
             *buffer = *a;
-            *cigar = 'D';
-            recursive_generator(pattern, buffer + 1, cigar + 1,
+            recursive_generator(pattern, buffer + 1,
                                 max_edit_distance - 1, data,
                                 callback, callback_data, options);
         }
+        pop_edit_back(&data->cigar, 1);
         // match / substitution
         for (const char *a = data->alphabet; *a; a++) {
             if (*a == *pattern) {
                 *buffer = *a;
-                if (options->extended_cigars)
-                    *cigar = '=';
-                else
-                    *cigar = 'M';
-                recursive_generator(pattern + 1, buffer + 1, cigar + 1,
+                push_edit_back(&data->cigar, options->extended_cigars ? '=' : 'M', 1);
+                recursive_generator(pattern + 1, buffer + 1,
                                     max_edit_distance, data,
                                     callback, callback_data, options);
+                pop_edit_back(&data->cigar, 1);
             } else {
                 *buffer = *a;
-                if (options->extended_cigars)
-                    *cigar = 'X';
-                else
-                    *cigar = 'M';
-                recursive_generator(pattern + 1, buffer + 1, cigar + 1,
+                push_edit_back(&data->cigar, options->extended_cigars ? 'X' : 'M', 1);
+                recursive_generator(pattern + 1, buffer + 1,
                                     max_edit_distance - 1, data,
                                     callback, callback_data, options);
+                pop_edit_back(&data->cigar, 1);
             }
         }
     }
@@ -103,8 +104,14 @@ void generate_all_neighbours(const char *pattern,
 {
     size_t n = strlen(pattern) + max_edit_distance + 1;
     char buffer[n];
-    char cigar[n], cigar_buffer[n];
-    struct recursive_constant_data data = { buffer, cigar, alphabet, cigar_buffer };
-    recursive_generator(pattern, buffer, cigar, max_edit_distance, &data,
+    char cigar_ops[n];
+    size_t cigar_lengths[n];
+    char cigar_buffer[2 * n + 1];
+    struct recursive_constant_data data;
+    data.buffer_front = buffer;
+    data.alphabet = alphabet;
+    init_edit_script(&data.cigar, cigar_ops, cigar_lengths, 0);
+    data.cigar_buffer = cigar_buffer;
+    recursive_generator(pattern, buffer, max_edit_distance, &data,
                         callback, callback_data, options);
 }
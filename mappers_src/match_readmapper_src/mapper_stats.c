@@ -0,0 +1,361 @@
+
+// for clock_gettime()
+#define _POSIX_C_SOURCE 200809L
+
+#include "mapper_stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+struct mapper_stats mapper_stats = { false };
+__thread enum stats_memory stats_memory_subsystem = MEM_OTHER;
+__thread size_t *stats_counts = mapper_stats.counts;
+static __thread size_t thread_counts[NO_STATS_COUNTERS];
+static pthread_mutex_t counts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *timer_names[NO_STATS_TIMERS] = {
+    "index_load",
+    "fastq_parse",
+    "cloud_generation",
+    "automaton_build",
+    "search",
+    "locate",
+    "sam_output"
+};
+
+static const char *counter_names[NO_STATS_COUNTERS] = {
+    "reads",
+    "reads_searched",
+    "patterns",
+    "rank_queries",
+    "nodes_expanded",
+    "hits"
+};
+
+static const char *memory_names[NO_STATS_MEMORY] = {
+    "reference",
+    "suffix_array",
+    "rank_tables",
+    "trie",
+    "cloud",
+    "reads",
+    "other"
+};
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + 1e-9 * (double)time.tv_nsec;
+}
+
+void enable_stats(void)
+{
+    mapper_stats.enabled = true;
+    mapper_stats.started = now();
+    for (int i = 0; i < NO_STATS_TIMERS; i++) {
+        mapper_stats.timer_started[i] = 0.0;
+        mapper_stats.seconds[i] = 0.0;
+    }
+    for (int i = 0; i < NO_STATS_COUNTERS; i++) {
+        mapper_stats.counts[i] = 0;
+    }
+    for (int i = 0; i < NO_STATS_MEMORY; i++) {
+        mapper_stats.memory[i] = 0;
+        mapper_stats.peak_memory[i] = 0;
+    }
+    mapper_stats.total_memory = 0;
+    mapper_stats.peak_total_memory = 0;
+    mapper_stats.perf_enabled = false;
+}
+
+void begin_thread_counts(void)
+{
+    memset(thread_counts, 0, sizeof(thread_counts));
+    stats_counts = thread_counts;
+}
+
+// Adds the thread's counts to the totals and counts there again.
+void end_thread_counts(void)
+{
+    pthread_mutex_lock(&counts_lock);
+    for (int i = 0; i < NO_STATS_COUNTERS; i++) {
+        mapper_stats.counts[i] += thread_counts[i];
+    }
+    pthread_mutex_unlock(&counts_lock);
+    stats_counts = mapper_stats.counts;
+}
+
+bool enable_perf_counters(void)
+{
+    if (!open_perf_counters()) return false;
+    memset(mapper_stats.perf_counts, 0, sizeof(mapper_stats.perf_counts));
+    mapper_stats.perf_enabled = true;
+    return true;
+}
+
+static void add_perf_counts(enum stats_timer timer, const uint64_t counts[NO_PERF_COUNTERS])
+{
+    for (int i = 0; i < NO_PERF_COUNTERS; i++) {
+        if (counts[i] == PERF_COUNTER_UNAVAILABLE ||
+            mapper_stats.perf_started[timer][i] == PERF_COUNTER_UNAVAILABLE)
+            continue;
+        mapper_stats.perf_counts[timer][i] += counts[i] - mapper_stats.perf_started[timer][i];
+    }
+}
+
+void stats_start_timer(enum stats_timer timer)
+{
+    mapper_stats.timer_started[timer] = now();
+    if (mapper_stats.perf_enabled)
+        read_perf_counters(mapper_stats.perf_started[timer]);
+}
+
+void stats_stop_timer(enum stats_timer timer)
+{
+    mapper_stats.seconds[timer] += now() - mapper_stats.timer_started[timer];
+    if (mapper_stats.perf_enabled) {
+        uint64_t counts[NO_PERF_COUNTERS];
+        read_perf_counters(counts);
+        add_perf_counts(timer, counts);
+    }
+}
+
+void stats_switch_timer(enum stats_timer from, enum stats_timer to)
+{
+    double time = now();
+    mapper_stats.seconds[from] += time - mapper_stats.timer_started[from];
+    mapper_stats.timer_started[to] = time;
+    if (mapper_stats.perf_enabled) {
+        uint64_t counts[NO_PERF_COUNTERS];
+        read_perf_counters(counts);
+        add_perf_counts(from, counts);
+        memcpy(mapper_stats.perf_started[to], counts, sizeof(counts));
+    }
+}
+
+/*
+ The tracked blocks go in a hash table, keyed by their address, with
+ linear probing. The suffix arrays are built in parallel, so the table
+ is behind a lock. The table's own memory is not counted.
+ */
+struct memory_block {
+    void *p; // zero for an empty slot
+    size_t size;
+    enum stats_memory subsystem;
+};
+
+static struct memory_block *memory_blocks = 0;
+static size_t memory_blocks_size = 0; // always a power of two
+static size_t memory_blocks_used = 0;
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t block_slot(const void *p)
+{
+    uint64_t h = (uint64_t)(uintptr_t)p * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (memory_blocks_size - 1);
+}
+
+static void charge_memory(enum stats_memory subsystem, size_t bytes)
+{
+    mapper_stats.memory[subsystem] += bytes;
+    mapper_stats.total_memory += bytes;
+    if (mapper_stats.memory[subsystem] > mapper_stats.peak_memory[subsystem])
+        mapper_stats.peak_memory[subsystem] = mapper_stats.memory[subsystem];
+    if (mapper_stats.total_memory > mapper_stats.peak_total_memory)
+        mapper_stats.peak_total_memory = mapper_stats.total_memory;
+}
+
+static void release_memory(enum stats_memory subsystem, size_t bytes)
+{
+    // blocks allocated before we enabled the statistics are not in
+    // the table, so we never release more than we have charged
+    mapper_stats.memory[subsystem] -= bytes;
+    mapper_stats.total_memory -= bytes;
+}
+
+static void insert_block(void *p, size_t size, enum stats_memory subsystem)
+{
+    if (2 * (memory_blocks_used + 1) > memory_blocks_size) {
+        struct memory_block *old_blocks = memory_blocks;
+        size_t old_size = memory_blocks_size;
+        memory_blocks_size = old_size ? 2 * old_size : 1024;
+        memory_blocks = (struct memory_block*)calloc(memory_blocks_size,
+                                                     sizeof(struct memory_block));
+        for (size_t i = 0; i < old_size; i++) {
+            if (!old_blocks[i].p) continue;
+            size_t j = block_slot(old_blocks[i].p);
+            while (memory_blocks[j].p) j = (j + 1) & (memory_blocks_size - 1);
+            memory_blocks[j] = old_blocks[i];
+        }
+        free(old_blocks);
+    }
+    
+    size_t i = block_slot(p);
+    while (memory_blocks[i].p && memory_blocks[i].p != p)
+        i = (i + 1) & (memory_blocks_size - 1);
+    if (memory_blocks[i].p) {
+        // freed with free() rather than tracked_free() and reused
+        release_memory(memory_blocks[i].subsystem, memory_blocks[i].size);
+    } else {
+        memory_blocks_used++;
+    }
+    memory_blocks[i].p = p;
+    memory_blocks[i].size = size;
+    memory_blocks[i].subsystem = subsystem;
+    charge_memory(subsystem, size);
+}
+
+// Remove the block for p, if we have it, and return it in block.
+static bool remove_block(void *p, struct memory_block *block)
+{
+    if (memory_blocks_size == 0) return false;
+    size_t i = block_slot(p);
+    while (memory_blocks[i].p && memory_blocks[i].p != p)
+        i = (i + 1) & (memory_blocks_size - 1);
+    if (!memory_blocks[i].p) return false;
+    
+    *block = memory_blocks[i];
+    release_memory(block->subsystem, block->size);
+    memory_blocks_used--;
+    
+    // move blocks after the hole back, if their probe sequence passes it
+    size_t hole = i;
+    for (size_t j = (i + 1) & (memory_blocks_size - 1); memory_blocks[j].p;
+         j = (j + 1) & (memory_blocks_size - 1)) {
+        size_t home = block_slot(memory_blocks[j].p);
+        if (((j - home) & (memory_blocks_size - 1)) >= ((j - hole) & (memory_blocks_size - 1))) {
+            memory_blocks[hole] = memory_blocks[j];
+            hole = j;
+        }
+    }
+    memory_blocks[hole].p = 0;
+    return true;
+}
+
+void *stats_malloc(size_t size)
+{
+    void *p = malloc(size);
+    if (!p) return p;
+    pthread_mutex_lock(&memory_lock);
+    insert_block(p, size, stats_memory_subsystem);
+    pthread_mutex_unlock(&memory_lock);
+    return p;
+}
+
+void *stats_calloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (!p) return p;
+    pthread_mutex_lock(&memory_lock);
+    insert_block(p, n * size, stats_memory_subsystem);
+    pthread_mutex_unlock(&memory_lock);
+    return p;
+}
+
+void *stats_realloc(void *p, size_t size)
+{
+    pthread_mutex_lock(&memory_lock);
+    // a block keeps the subsystem it was first allocated for
+    struct memory_block block = { p, 0, stats_memory_subsystem };
+    bool tracked = p && remove_block(p, &block);
+    void *q = realloc(p, size);
+    if (q)
+        insert_block(q, size, block.subsystem);
+    else if (tracked)
+        insert_block(p, block.size, block.subsystem);
+    pthread_mutex_unlock(&memory_lock);
+    return q;
+}
+
+void stats_free(void *p)
+{
+    if (!p) return;
+    struct memory_block block;
+    pthread_mutex_lock(&memory_lock);
+    remove_block(p, &block);
+    pthread_mutex_unlock(&memory_lock);
+    free(p);
+}
+
+void stats_count_memory(enum stats_memory subsystem, size_t bytes, bool released)
+{
+    pthread_mutex_lock(&memory_lock);
+    if (released)
+        release_memory(subsystem, bytes);
+    else
+        charge_memory(subsystem, bytes);
+    pthread_mutex_unlock(&memory_lock);
+}
+
+// Peak resident set size in kilobytes.
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // macOS reports it in bytes
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// The counters per phase; those we don't have are null.
+static void write_perf_counts(FILE *file)
+{
+    fprintf(file, "  \"perf_counters\": {\n");
+    for (int t = 0; t < NO_STATS_TIMERS; t++) {
+        fprintf(file, "    \"%s\": {", timer_names[t]);
+        for (int i = 0; i < NO_PERF_COUNTERS; i++) {
+            fprintf(file, "%s\"%s\": ", i > 0 ? ", " : " ", perf_counter_names[i]);
+            if (perf_counter_available((enum perf_counter)i))
+                fprintf(file, "%lu", (unsigned long)mapper_stats.perf_counts[t][i]);
+            else
+                fprintf(file, "null");
+        }
+        fprintf(file, " }%s\n", t + 1 < NO_STATS_TIMERS ? "," : "");
+    }
+    fprintf(file, "  }\n");
+}
+
+int write_stats(const char *filename, const char *mapper)
+{
+    double total = now() - mapper_stats.started;
+    FILE *file = fopen(filename, "w");
+    if (!file) return 1;
+    
+    fprintf(file, "{\n");
+    fprintf(file, "  \"mapper\": \"%s\",\n", mapper);
+    fprintf(file, "  \"total_seconds\": %.6f,\n", total);
+    fprintf(file, "  \"seconds\": {\n");
+    for (int i = 0; i < NO_STATS_TIMERS; i++) {
+        fprintf(file, "    \"%s\": %.6f%s\n", timer_names[i],
+                mapper_stats.seconds[i],
+                i + 1 < NO_STATS_TIMERS ? "," : "");
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"counts\": {\n");
+    for (int i = 0; i < NO_STATS_COUNTERS; i++) {
+        fprintf(file, "    \"%s\": %lu%s\n", counter_names[i],
+                mapper_stats.counts[i],
+                i + 1 < NO_STATS_COUNTERS ? "," : "");
+    }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"peak_bytes\": {\n");
+    for (int i = 0; i < NO_STATS_MEMORY; i++) {
+        fprintf(file, "    \"%s\": %lu,\n", memory_names[i],
+                mapper_stats.peak_memory[i]);
+    }
+    fprintf(file, "    \"total\": %lu\n", mapper_stats.peak_total_memory);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"peak_rss_kb\": %ld%s\n", peak_rss_kb(),
+            mapper_stats.perf_enabled ? "," : "");
+    if (mapper_stats.perf_enabled) write_perf_counts(file);
+    fprintf(file, "}\n");
+    
+    return fclose(file) == 0 ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+
+#ifndef MAPPER_STATS_H
+#define MAPPER_STATS_H
+
+#include "perf_counters.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ Where the time goes when we map reads. We time the phases of the
+ mappers with the monotonic clock and count the work they do. The
+ timers are exclusive: when one phase hands over to another, e.g. when
+ the search reports the hits it has found, we switch timers rather
+ than nest them, so the phase times add up to the running time.
+
+ Not all phases apply to all mappers -- only the Burrows-Wheeler
+ mapper has rank queries and only the Aho-Corasick mapper builds an
+ automaton -- and those we don't use are reported as zero.
+
+ The statistics are off unless we call enable_stats(), and then each
+ timer and counter call is just a test of a global flag, so we can
+ leave the calls in the inner loops.
+
+ With enable_perf_counters() we also read the hardware counters (see
+ perf_counters.h) whenever we read the clock, so we get cycles, cache
+ misses and so on per phase. Each reading is a system call, which
+ adds a little to the phases that switch timers for every pattern.
+ */
+
+enum stats_timer {
+    TIME_INDEX_LOAD,
+    TIME_FASTQ_PARSE,       // includes trimming and the read cache
+    TIME_CLOUD_GENERATION,  // generating the edit neighbours of a read
+    TIME_AUTOMATON_BUILD,
+    TIME_SEARCH,
+    TIME_LOCATE,            // suffix array look-ups for the hits
+    TIME_SAM_OUTPUT,
+    NO_STATS_TIMERS
+};
+
+enum stats_counter {
+    COUNT_READS,
+    COUNT_READS_SEARCHED,   // reads that were not in the read cache
+    COUNT_PATTERNS,         // edit neighbours generated
+    COUNT_RANK_QUERIES,     // o-table look-ups
+    COUNT_NODES_EXPANDED,   // nodes in the search or generator recursion
+    COUNT_HITS,
+    NO_STATS_COUNTERS
+};
+
+/*
+ Where the memory goes. With statistics enabled, the modules that hold
+ the large data structures allocate with tracked_malloc() and friends,
+ and we keep the size of every block they allocate, and the subsystem
+ it is for, so we can report the peak number of bytes each subsystem
+ held at any one time. A block belongs to the subsystem that was set
+ with set_memory_subsystem() when it was allocated, in the thread that
+ allocated it; the modules set it around the code that builds their
+ data structures.
+
+ Without statistics, the tracked functions are just malloc() and
+ friends, but a block from one of them must still be freed with
+ tracked_free() and a block from malloc() with free().
+ */
+
+enum stats_memory {
+    MEM_REFERENCE,          // the reference sequences and their names
+    MEM_SUFFIX_ARRAY,
+    MEM_RANK_TABLES,        // C, O and k-mer tables
+    MEM_TRIE,               // tries and Aho-Corasick automata
+    MEM_CLOUD,              // edit neighbours of a read and their CIGARs
+    MEM_READS,              // the read cache and the hits we found
+    MEM_OTHER,
+    NO_STATS_MEMORY
+};
+
+struct mapper_stats {
+    bool enabled;
+    double started;
+    double timer_started[NO_STATS_TIMERS];
+    double seconds[NO_STATS_TIMERS];
+    size_t counts[NO_STATS_COUNTERS];
+    
+    bool perf_enabled;
+    uint64_t perf_started[NO_STATS_TIMERS][NO_PERF_COUNTERS];
+    uint64_t perf_counts[NO_STATS_TIMERS][NO_PERF_COUNTERS];
+    
+    size_t memory[NO_STATS_MEMORY];
+    size_t peak_memory[NO_STATS_MEMORY];
+    size_t total_memory;
+    size_t peak_total_memory;
+};
+
+extern struct mapper_stats mapper_stats;
+
+// The subsystem we allocate for. It is per thread, since the threads
+// that build the suffix arrays are in different phases at any one time.
+extern __thread enum stats_memory stats_memory_subsystem;
+
+// The counters count_stat() adds to: the totals in mapper_stats, or,
+// between begin_thread_counts() and end_thread_counts(), counters of
+// the thread's own, so threads that build in parallel don't race.
+extern __thread size_t *stats_counts;
+
+void enable_stats(void);
+void begin_thread_counts(void);
+void end_thread_counts(void);
+
+// Count hardware events per phase as well. Call it after
+// enable_stats(), in the thread that maps the reads. Returns false if
+// we could not open any of the counters.
+bool enable_perf_counters(void);
+
+// Write the statistics, and the peak resident set size, as a JSON
+// object to filename. Returns zero on success.
+int write_stats(const char *filename, const char *mapper);
+
+// Don't call these directly; use the functions below that check
+// whether statistics are enabled first.
+void stats_start_timer(enum stats_timer timer);
+void stats_stop_timer(enum stats_timer timer);
+void stats_switch_timer(enum stats_timer from, enum stats_timer to);
+void *stats_malloc(size_t size);
+void *stats_calloc(size_t n, size_t size);
+void *stats_realloc(void *p, size_t size);
+void stats_free(void *p);
+void stats_count_memory(enum stats_memory subsystem, size_t bytes, bool released);
+
+static inline void start_timer(enum stats_timer timer)
+{
+    if (mapper_stats.enabled) stats_start_timer(timer);
+}
+
+static inline void stop_timer(enum stats_timer timer)
+{
+    if (mapper_stats.enabled) stats_stop_timer(timer);
+}
+
+// Stop timer from and start timer to, with a single clock reading.
+static inline void switch_timer(enum stats_timer from, enum stats_timer to)
+{
+    if (mapper_stats.enabled) stats_switch_timer(from, to);
+}
+
+static inline void count_stat(enum stats_counter counter, size_t n)
+{
+    if (mapper_stats.enabled) stats_counts[counter] += n;
+}
+
+// Returns the subsystem we allocated for before, so the caller can
+// set it back when it is done.
+static inline enum stats_memory set_memory_subsystem(enum stats_memory subsystem)
+{
+    enum stats_memory previous = stats_memory_subsystem;
+    stats_memory_subsystem = subsystem;
+    return previous;
+}
+
+static inline void *tracked_malloc(size_t size)
+{
+    return mapper_stats.enabled ? stats_malloc(size) : malloc(size);
+}
+
+static inline void *tracked_calloc(size_t n, size_t size)
+{
+    return mapper_stats.enabled ? stats_calloc(n, size) : calloc(n, size);
+}
+
+static inline void *tracked_realloc(void *p, size_t size)
+{
+    return mapper_stats.enabled ? stats_realloc(p, size) : realloc(p, size);
+}
+
+static inline void tracked_free(void *p)
+{
+    if (mapper_stats.enabled) stats_free(p);
+    else free(p);
+}
+
+// For memory we don't get from malloc(), such as memory mapped files.
+static inline void count_memory(enum stats_memory subsystem, size_t bytes, bool released)
+{
+    if (mapper_stats.enabled) stats_count_memory(subsystem, bytes, released);
+}
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ Micro-benchmark for the exact matching kernels.
+
+ We run each kernel over random texts with alphabets of different
+ sizes, and over a real genome if we are given one, for a range of
+ pattern lengths, and report the time per text byte. The patterns are
+ taken from the text, so every one of them has at least one match.
+
+ For each combination we first run the kernel a few times to warm up
+ the caches and the branch predictors, then we time a number of
+ repetitions, each searching for all the patterns, and report the
+ median and the fastest repetition. Cycles are read from the time
+ stamp counter, where we have one; it ticks at a constant rate, so it
+ is the cycles of the nominal clock frequency and not of the core.
+
+ The suffix array search builds the suffix array for each search, as
+ the mapper does, so it can only handle short texts; we run it on a
+ prefix of the text.
+ */
+
+// for clock_gettime()
+#define _POSIX_C_SOURCE 200809L
+
+#include "match.h"
+#include "suffix_array.h"
+#include "fasta.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+static inline uint64_t cycles(void) { return __rdtsc(); }
+#else
+#define HAVE_CYCLE_COUNTER 0
+static inline uint64_t cycles(void) { return 0; }
+#endif
+
+#define DEFAULT_TEXT_LENGTH (1 << 20)
+#define MAX_BSEARCH_TEXT_LENGTH (1 << 14)
+#define DEFAULT_NO_PATTERNS 8
+#define DEFAULT_WARMUP 2
+#define DEFAULT_REPETITIONS 11
+
+struct kernel {
+    const char *name;
+    void (*match)(const char *text, size_t n,
+                  const char *pattern, size_t m,
+                  match_callback_func callback, void *callback_data);
+    size_t max_text_length; // zero for no limit
+};
+
+static const struct kernel kernels[] = {
+    { "naive",   naive_exact_match,          0 },
+    { "bmh",     boyer_moore_horspool,       0 },
+    { "kmp",     knuth_morris_pratt,         0 },
+    { "kmp_r",   knuth_morris_pratt_r,       0 },
+    { "bsearch", suffix_array_bsearch_match, MAX_BSEARCH_TEXT_LENGTH }
+};
+#define NO_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static const size_t pattern_lengths[] = { 4, 8, 16, 32, 64, 128, 256 };
+#define NO_PATTERN_LENGTHS (sizeof(pattern_lengths) / sizeof(pattern_lengths[0]))
+
+// The synthetic texts: binary, DNA, protein and (most of) printable ASCII.
+static const char *alphabets[] = {
+    "AC",
+    "ACGT",
+    "ACDEFGHIKLMNPQRSTVWY",
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz+/"
+};
+#define NO_ALPHABETS (sizeof(alphabets) / sizeof(alphabets[0]))
+
+struct measure {
+    double ns;
+    double cycles;
+};
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return 1e9 * (double)time.tv_sec + (double)time.tv_nsec;
+}
+
+static void count_callback(size_t index, void *data)
+{
+    (*(size_t*)data)++;
+}
+
+static int compare_measures(const void *a, const void *b)
+{
+    double x = ((const struct measure*)a)->ns;
+    double y = ((const struct measure*)b)->ns;
+    return (x > y) - (x < y);
+}
+
+static char *random_text(const char *alphabet, size_t n)
+{
+    size_t sigma = strlen(alphabet);
+    char *text = (char*)malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        text[i] = alphabet[(size_t)rand() % sigma];
+    }
+    text[n] = '\0';
+    return text;
+}
+
+static size_t alphabet_size(const char *text, size_t n)
+{
+    bool seen[256] = { false };
+    size_t sigma = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char a = (unsigned char)text[i];
+        if (!seen[a]) sigma++;
+        seen[a] = true;
+    }
+    return sigma;
+}
+
+// Search for all the patterns once, and return the number of matches.
+static size_t search_patterns(const struct kernel *kernel,
+                              const char *text, size_t n,
+                              char **patterns, size_t no_patterns, size_t m)
+{
+    size_t matches = 0;
+    for (size_t i = 0; i < no_patterns; i++) {
+        kernel->match(text, n, patterns[i], m, count_callback, &matches);
+    }
+    return matches;
+}
+
+static void benchmark_kernel(const struct kernel *kernel,
+                             const char *text_name, const char *text, size_t n,
+                             char **patterns, size_t no_patterns, size_t m,
+                             int warmup, int repetitions)
+{
+    // the kernels that need a '\0' terminated text get their own prefix
+    char *prefix = 0;
+    if (kernel->max_text_length > 0 && n > kernel->max_text_length) {
+        n = kernel->max_text_length;
+        prefix = (char*)malloc(n + 1);
+        memcpy(prefix, text, n);
+        prefix[n] = '\0';
+        text = prefix;
+    }
+    
+    size_t matches = 0;
+    for (int i = 0; i < warmup; i++) {
+        matches = search_patterns(kernel, text, n, patterns, no_patterns, m);
+    }
+    struct measure measures[repetitions];
+    for (int i = 0; i < repetitions; i++) {
+        double start = now();
+        uint64_t start_cycles = cycles();
+        matches = search_patterns(kernel, text, n, patterns, no_patterns, m);
+        measures[i].cycles = (double)(cycles() - start_cycles);
+        measures[i].ns = now() - start;
+    }
+    qsort(measures, (size_t)repetitions, sizeof(struct measure), compare_measures);
+    
+    double bytes = (double)n * (double)no_patterns;
+    struct measure median = measures[repetitions / 2];
+    printf("%s\t%lu\t%lu\t%lu\t%s\t%.4f\t%.4f\t", text_name,
+           alphabet_size(text, n), n, m, kernel->name,
+           median.ns / bytes, measures[0].ns / bytes);
+    if (HAVE_CYCLE_COUNTER)
+        printf("%.4f", median.cycles / bytes);
+    else
+        printf("NA");
+    printf("\t%lu\n", matches);
+    fflush(stdout);
+    
+    free(prefix);
+}
+
+static void benchmark_text(const char *text_name, const char *text, size_t n,
+                           size_t no_patterns, int warmup, int repetitions)
+{
+    for (size_t l = 0; l < NO_PATTERN_LENGTHS; l++) {
+        size_t m = pattern_lengths[l];
+        // take the patterns from the part of the text that all kernels see
+        size_t sample_length = n < MAX_BSEARCH_TEXT_LENGTH ? n : MAX_BSEARCH_TEXT_LENGTH;
+        if (m > sample_length) break;
+        
+        char *patterns[no_patterns];
+        for (size_t i = 0; i < no_patterns; i++) {
+            size_t pos = (size_t)rand() % (sample_length - m + 1);
+            patterns[i] = (char*)malloc(m + 1);
+            memcpy(patterns[i], text + pos, m);
+            patterns[i][m] = '\0';
+        }
+        
+        for (size_t k = 0; k < NO_KERNELS; k++) {
+            benchmark_kernel(&kernels[k], text_name, text, n,
+                             patterns, no_patterns, m, warmup, repetitions);
+        }
+        
+        for (size_t i = 0; i < no_patterns; i++) {
+            free(patterns[i]);
+        }
+    }
+}
+
+static void print_usage(const char *prog_name, FILE *file)
+{
+    fprintf(file, "Usage: %s [options] [ref.fa]\n", prog_name);
+    fprintf(file, "Options:\n");
+    fprintf(file, "\t-h | --help:\t\t Show this message.\n");
+    fprintf(file, "\t-n | --text-length:\t Length of the texts (default %d).\n",
+            DEFAULT_TEXT_LENGTH);
+    fprintf(file, "\t-p | --patterns:\t Number of patterns per repetition (default %d).\n",
+            DEFAULT_NO_PATTERNS);
+    fprintf(file, "\t-w | --warmup:\t\t Number of warm-up runs (default %d).\n",
+            DEFAULT_WARMUP);
+    fprintf(file, "\t-r | --repetitions:\t Number of measured runs (default %d).\n",
+            DEFAULT_REPETITIONS);
+    fprintf(file, "\t-s | --seed:\t\t Seed for the random texts and patterns (default 1).\n");
+    fprintf(file, "\nWith a FASTA file, we also use a prefix of its first sequence as a text.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *prog_name = argv[0];
+    size_t n = DEFAULT_TEXT_LENGTH;
+    size_t no_patterns = DEFAULT_NO_PATTERNS;
+    int warmup = DEFAULT_WARMUP;
+    int repetitions = DEFAULT_REPETITIONS;
+    unsigned int seed = 1;
+    
+    int opt;
+    static struct option longopts[] = {
+        { "help",        no_argument,       NULL, 'h' },
+        { "text-length", required_argument, NULL, 'n' },
+        { "patterns",    required_argument, NULL, 'p' },
+        { "warmup",      required_argument, NULL, 'w' },
+        { "repetitions", required_argument, NULL, 'r' },
+        { "seed",        required_argument, NULL, 's' },
+        { NULL,          0,                 NULL,  0  }
+    };
+    while ((opt = getopt_long(argc, argv, "hn:p:w:r:s:", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage(prog_name, stdout);
+                return EXIT_SUCCESS;
+            case 'n':
+                n = (size_t)atol(optarg);
+                break;
+            case 'p':
+                no_patterns = (size_t)atol(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 'r':
+                repetitions = atoi(optarg);
+                break;
+            case 's':
+                seed = (unsigned int)atol(optarg);
+                break;
+            default:
+                print_usage(prog_name, stderr);
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    
+    if (argc > 1 || n == 0 || no_patterns == 0 || warmup < 0 || repetitions < 1) {
+        print_usage(prog_name, stderr);
+        return EXIT_FAILURE;
+    }
+    srand(seed);
+    
+    printf("text\tsigma\tn\tm\tkernel\tns_per_byte\tmin_ns_per_byte\tcycles_per_byte\tmatches\n");
+    
+    for (size_t a = 0; a < NO_ALPHABETS; a++) {
+        char *text = random_text(alphabets[a], n);
+        benchmark_text("random", text, n, no_patterns, warmup, repetitions);
+        free(text);
+    }
+    
+    if (argc == 1) {
+        struct fasta_records *records = empty_fasta_records();
+        if (0 != load_fasta_records(records, argv[0])) {
+            fprintf(stderr, "Could not read FASTA file.\n");
+            delete_fasta_records(records);
+            return EXIT_FAILURE;
+        }
+        size_t length = records->seq_sizes->sizes[0];
+        if (length > n) length = n;
+        char *text = (char*)malloc(length + 1);
+        memcpy(text, records->sequences->strings[0], length);
+        text[length] = '\0';
+        benchmark_text(pool_string(records->names, 0), text, length,
+                       no_patterns, warmup, repetitions);
+        free(text);
+        delete_fasta_records(records);
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -8,9 +8,15 @@
 #include "suffix_array.h"
 #include "fasta.h"
 #include "fastq.h"
+#include "input_file.h"
 #include "sam.h"
 #include "edit_distance_generator.h"
 #include "options.h"
+#include "hit_list.h"
+#include "read_cache.h"
+#include "strings.h"
+#include "read_trimming.h"
+#include "mapper_stats.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -22,12 +28,15 @@ const char *pattern, size_t m,
 match_callback_func callback,
 void *callback_data);
 
+#define READ_CACHE_BATCH_SIZE 100000
+
 struct search_info {
     int edit_dist;
     struct fasta_records *records;
-    FILE *sam_file;
+    struct sam_writer *sam_writer;
     exact_match_func match_func;
     struct options *options;
+    struct read_cache *read_cache;
 };
 
 static struct search_info *empty_search_info(struct options *options)
@@ -38,22 +47,24 @@ static struct search_info *empty_search_info(struct options *options)
     info->records = empty_fasta_records();
     info->match_func = 0;
     info->options = options;
+    info->read_cache = empty_read_cache(READ_CACHE_BATCH_SIZE);
     return info;
 }
 
 static void delete_search_info(struct search_info *info)
 {
     delete_fasta_records(info->records);
+    delete_read_cache(info->read_cache);
     free(info);
 }
 
 struct read_search_info {
     const char *ref_name;
-    const char *read_name;
     const char *read;
-    const char *quality;
     const char *cigar;
     const char *pattern;
+    bool reverse; // searching for the reverse complement of the read
+    struct hit_list *hits;
     struct search_info *search_info;
 };
 
@@ -63,10 +74,10 @@ static struct read_search_info *empty_read_search_info()
     (struct read_search_info*)malloc(sizeof(struct read_search_info));
     
     info->ref_name = 0;
-    info->read_name = 0;
     info->read = 0;
-    info->quality = 0;
     info->cigar = 0;
+    info->reverse = false;
+    info->hits = 0;
     info->search_info = 0;
     
     return info;
@@ -80,63 +91,110 @@ static void delete_read_search_info(struct read_search_info *info)
 static void match_callback(size_t index, void * data)
 {
     struct read_search_info *info = (struct read_search_info*)data;
-    sam_line(info->search_info->sam_file,
-             info->read_name,
-             info->ref_name,
-             index + 1, // + 1 for 1-indexing in SAM format.
-             info->cigar,
-             info->read,
-             //info->pattern,
-             info->quality);
+    add_hit(info->hits,
+            info->ref_name,
+            index + 1, // + 1 for 1-indexing in SAM format.
+            info->cigar,
+            info->reverse);
 }
 
 static void pattern_callback(const char *pattern, const char *cigar, void * data)
 {
     struct read_search_info *info = (struct read_search_info*)data;
+    count_stat(COUNT_PATTERNS, 1);
+    switch_timer(TIME_CLOUD_GENERATION, TIME_SEARCH);
     
     info->cigar = cigar;
     info->pattern = pattern;
     int no_refs = info->search_info->records->sequences->used;
     for (int i = 0; i < no_refs; ++i) {
         struct fasta_records *records = info->search_info->records;
-        info->ref_name = records->names->strings[i];
+        info->ref_name = pool_string(records->names, i);
         info->search_info->match_func(records->sequences->strings[i],
                                       records->seq_sizes->sizes[i],
                                       pattern, strlen(pattern),
                                       match_callback, info);
     }
+    switch_timer(TIME_SEARCH, TIME_CLOUD_GENERATION);
 }
 
 
 static void read_callback(const char *read_name,
-                          const char *read,
+                          const char *sequence,
                           const char *quality,
                           void * callback_data) {
     struct search_info *search_info = (struct search_info*)callback_data;
+    struct options *options = search_info->options;
+    count_stat(COUNT_READS, 1);
+    
+    // we search for the trimmed and masked read
+    size_t length = strlen(sequence);
+    size_t clip = quality_trim_length(quality, length, options->trim_quality);
+    char read[length - clip + 1];
+    size_t no_ns = mask_read(sequence, read, length - clip);
     
-    // I allocate and deallocate the info all the time... I might
-    // be able to save some time by not doing this, but compared to
-    // building and removeing the trie, I don't think it will be much.
-    struct read_search_info *info = empty_read_search_info();
-    info->search_info = search_info;
-    info->read = read;
-    info->quality = quality;
-    info->read_name = read_name;
-    
-    generate_all_neighbours(read, "ACGT",
-                            search_info->edit_dist,
-                            pattern_callback, info,
-                            search_info->options);
-    delete_read_search_info(info);
+    // we only search for a read the first time we see it in a batch
+    struct hit_list *hits = cached_hits(search_info->read_cache, read);
+    if (!hits && options->max_n >= 0 && no_ns > (size_t)options->max_n) {
+        // we don't search for it, so it has no hits
+        hits = new_cached_hits(search_info->read_cache, read);
+    
+    } else if (!hits) {
+        hits = new_cached_hits(search_info->read_cache, read);
+        count_stat(COUNT_READS_SEARCHED, 1);
+        switch_timer(TIME_FASTQ_PARSE, TIME_CLOUD_GENERATION);
+        
+        // I allocate and deallocate the info all the time... I might
+        // be able to save some time by not doing this, but compared to
+        // building and removeing the trie, I don't think it will be much.
+        struct read_search_info *info = empty_read_search_info();
+        info->search_info = search_info;
+        info->read = read;
+        info->hits = hits;
+        
+        generate_all_neighbours(read, "ACGT",
+                                search_info->edit_dist,
+                                pattern_callback, info,
+                                search_info->options);
+        
+        // and the same for the reverse strand
+        if (!search_info->options->forward_only) {
+            size_t n = strlen(read);
+            char rev_read[n + 1];
+            reverse_complement(read, rev_read, n);
+            info->reverse = true;
+            generate_all_neighbours(rev_read, "ACGT",
+                                    search_info->edit_dist,
+                                    pattern_callback, info,
+                                    search_info->options);
+        }
+        delete_read_search_info(info);
+        count_stat(COUNT_HITS, hits->used);
+        switch_timer(TIME_CLOUD_GENERATION, TIME_FASTQ_PARSE);
+    }
+    
+    switch_timer(TIME_FASTQ_PARSE, TIME_SAM_OUTPUT);
+    write_hits(search_info->sam_writer, hits, read_name, sequence, quality, clip);
+    switch_timer(TIME_SAM_OUTPUT, TIME_FASTQ_PARSE);
 }
 
 int main(int argc, char * argv[])
 {
     const char *prog_name = argv[0];
+    // before getopt_long() reorders the arguments
+    char *command_line = sam_command_line(argc, argv);
+    const char *output = 0;
+    const char *stats_file = 0;
+    bool perf_counters = false;
+    enum sam_format output_format = SAM_FORMAT;
+    int no_threads = 1;
     const char *algorithm = "naive";
     struct options options;
     options.edit_distance = 0;
     options.extended_cigars = false;
+    options.forward_only = false;
+    options.trim_quality = 0;
+    options.max_n = -1;
     options.verbose = false;
     
     int opt;
@@ -144,17 +202,38 @@ int main(int argc, char * argv[])
         { "help",       no_argument,            NULL,           'h' },
         { "distance",   required_argument,      NULL,           'd' },
         { "extended-cigar",   no_argument,      NULL,           'x' },
+        { "forward-only",     no_argument,      NULL,           'f' },
+        { "trim-quality", required_argument,    NULL,           'q' },
+        { "max-n",      required_argument,      NULL,           'N' },
+        { "output",     required_argument,      NULL,           'o' },
+        { "output-format", required_argument,   NULL,           'O' },
+        { "threads",    required_argument,      NULL,           't' },
+        { "stats",      required_argument,      NULL,           'S' },
+        { "perf-counters", no_argument,         NULL,           'P' },
         { "algorithm",  required_argument,      NULL,           'a' },
         { NULL,         0,                      NULL,            0  }
     };
-    while ((opt = getopt_long(argc, argv, "hd:a:x", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hd:a:xfq:N:o:O:t:S:P", longopts, NULL)) != -1) {
         switch (opt) {
             case 'h':
                 printf("Usage: %s [options] ref.fa reads.fq\n\n", prog_name);
                 printf("Options:\n");
                 printf("\t-h | --help:\t\t Show this message.\n");
                 printf("\t-d | --distance:\t Maximum edit distance for the search.\n");
+                printf("\t-o | --output:\t\t Write the SAM output to this file (default stdout).\n");
+                printf("\t-O | --output-format:\t Output format, sam (default) or bam.\n");
+                printf("\t-t | --threads:\t\t Number of threads for BAM compression (default 1).\n");
+                printf("\t-S | --stats:\t\t Write the time spent in each phase, counts of the\n"
+                       "\t\t\t work done and the peak memory use, as JSON, to this\n"
+                       "\t\t\t file.\n");
+                printf("\t-P | --perf-counters:\t Also count cycles, instructions, cache misses, branch\n"
+                       "\t\t\t mispredictions and TLB misses per phase, with the\n"
+                       "\t\t\t hardware counters. Needs --stats and Linux.\n");
                 printf("\t-x | --extended-cigar:\t Use extended CIGAR format in SAM output.\n");
+                printf("\t-f | --forward-only:\t Don't search for the reverse complement of the reads.\n");
+                printf("\t-q | --trim-quality:\t Trim the 3' end of reads where the quality is below this\n"
+                       "\t\t\t and soft-clip it in the output (default 0, no trimming).\n");
+                printf("\t-N | --max-n:\t\t Skip reads with more Ns than this (default no limit).\n");
                 printf("\t-a | --algorithm:\t Algorithm to use for the search.\n");
                 printf("\t\t\t\t Choices are:\n");
                 printf("\t\t\t\t\t\"naive\"\n");
@@ -175,7 +254,46 @@ int main(int argc, char * argv[])
             case 'x':
                 options.extended_cigars = true;
                 break;
+            
+            case 'f':
+                options.forward_only = true;
+                break;
+            
+            case 'q':
+                options.trim_quality = atoi(optarg);
+                break;
+            
+            case 'N':
+                options.max_n = atoi(optarg);
+                break;
+                
+            case 'o':
+                output = optarg;
+                break;
+                
+            case 'O':
+                if (!parse_sam_format(optarg, &output_format)) {
+                    fprintf(stderr, "Unknown output format %s.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
                 
+            case 't':
+                no_threads = atoi(optarg);
+                if (no_threads < 1) {
+                    fprintf(stderr, "The number of threads must be positive.\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+                
+            case 'S':
+                stats_file = optarg;
+                break;
+            
+            case 'P':
+                perf_counters = true;
+                break;
+            
                 
             default:
                 fprintf(stderr, "Usage: %s [options] ref.fa reads.fq\n", prog_name);
@@ -189,14 +307,15 @@ int main(int argc, char * argv[])
         fprintf(stderr, "Usage: %s [options] ref.fa reads.fq\n", prog_name);
         return EXIT_FAILURE;
     }
-    
-    FILE *fasta_file = fopen(argv[0], "r");
-    if (!fasta_file) {
-        fprintf(stderr, "Could not open %s.\n", argv[0]);
+    if (perf_counters && !stats_file) {
+        fprintf(stderr, "--perf-counters needs --stats to write the counts to.\n");
         return EXIT_FAILURE;
     }
+    if (stats_file) enable_stats();
+    if (perf_counters && !enable_perf_counters())
+        fprintf(stderr, "Could not open any hardware performance counters.\n");
     
-    FILE *fastq_file = fopen(argv[1], "r");
+    struct input_file *fastq_file = open_input_file(argv[1]);
     if (!fastq_file) {
         fprintf(stderr, "Could not open %s.\n", argv[1]);
         return EXIT_FAILURE;
@@ -215,20 +334,59 @@ int main(int argc, char * argv[])
         search_info->match_func = suffix_array_bsearch_match;
     } else {
         fprintf(stderr, "Unknown search algorithm %s.\n", algorithm);
-        fclose(fasta_file);
-        fclose(fastq_file);
+        close_input_file(fastq_file);
         delete_search_info(search_info);
         return EXIT_FAILURE;
     }
     
-    read_fasta_records(search_info->records, fasta_file);
-    fclose(fasta_file);
+    start_timer(TIME_INDEX_LOAD);
+    if (0 != load_fasta_records(search_info->records, argv[0])) {
+        fprintf(stderr, "Could not read FASTA file.\n");
+        close_input_file(fastq_file);
+        delete_search_info(search_info);
+        return EXIT_FAILURE;
+    }
+    stop_timer(TIME_INDEX_LOAD);
     
-    search_info->sam_file = stdout;
+    FILE *sam_file = stdout;
+    if (output) {
+        sam_file = fopen(output, "w");
+        if (!sam_file) {
+            fprintf(stderr, "Could not open %s.\n", output);
+            return EXIT_FAILURE;
+        }
+    }
+    // The search always builds extended CIGARs, since we need the
+    // mismatches for the NM tag; the writer collapses them to 'M'
+    // operations unless we were asked for extended CIGARs.
+    search_info->sam_writer = empty_sam_writer(sam_file, output_format,
+                                               options.extended_cigars,
+                                               (size_t)no_threads);
+    options.extended_cigars = true;
+    write_sam_header(search_info->sam_writer,
+                     search_info->records->names,
+                     search_info->records->seq_sizes,
+                     "match_readmapper", command_line);
+    free(command_line);
     
-    scan_fastq(fastq_file, read_callback, search_info);
+    // the read callback switches from parsing to the other phases
+    // and back again
+    start_timer(TIME_FASTQ_PARSE);
+    scan_fastq(fastq_file->file, read_callback, search_info);
+    stop_timer(TIME_FASTQ_PARSE);
+    // the writer flushes the last of the output when we delete it
+    start_timer(TIME_SAM_OUTPUT);
+    delete_sam_writer(search_info->sam_writer);
+    stop_timer(TIME_SAM_OUTPUT);
     delete_search_info(search_info);
-    fclose(fastq_file);
+    close_input_file(fastq_file);
+    if (sam_file != stdout)
+        fclose(sam_file);
+    
+    if (stats_file && 0 != write_stats(stats_file, "match_readmapper")) {
+        fprintf(stderr, "Could not write statistics to %s.\n", stats_file);
+        return EXIT_FAILURE;
+    }
     
     return EXIT_SUCCESS;
 }
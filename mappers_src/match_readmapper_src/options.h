@@ -8,7 +8,10 @@
 struct options {
     bool verbose;
     bool extended_cigars;
+    bool forward_only; // don't search the reverse strand
     int edit_distance;
+    int trim_quality; // quality for trimming the 3' end of reads; 0 for none
+    int max_n; // skip reads with more Ns than this; negative for no limit
 };
 
 #endif
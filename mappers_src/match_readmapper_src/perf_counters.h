@@ -0,0 +1,48 @@
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ Hardware performance counters, read through Linux' perf_event_open(),
+ so we can tell whether a phase is bound by computation or by memory.
+ The counters only count the calling thread, in user space, so open
+ them in the thread that does the mapping.
+
+ Not all machines have all counters -- virtual machines often have
+ none -- and the kernel may not let us use them (see
+ /proc/sys/kernel/perf_event_paranoid). Counters we could not open
+ read as PERF_COUNTER_UNAVAILABLE. On other systems than Linux we
+ have no counters at all.
+
+ If there are more counters than the hardware can count at once, the
+ kernel takes turns with them, and we scale the counts by how long
+ they actually ran. The numbers are then estimates.
+ */
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,  // last-level cache
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,       // data TLB load misses
+    NO_PERF_COUNTERS
+};
+
+#define PERF_COUNTER_UNAVAILABLE UINT64_MAX
+
+extern const char *perf_counter_names[NO_PERF_COUNTERS];
+
+// Open and start the counters. They stay open until the program
+// exits. Returns false if we could not open any of them.
+bool open_perf_counters(void);
+
+bool perf_counter_available(enum perf_counter counter);
+
+// Read the counts since the counters were opened.
+void read_perf_counters(uint64_t counts[NO_PERF_COUNTERS]);
+
+#endif
@@ -1,4 +1,5 @@
 #include "queue.h"
+#include "mapper_stats.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -6,7 +7,7 @@
 
 static struct linked_list *linked_list_link(void *data)
 {
-    struct linked_list *link = (struct linked_list *)malloc(sizeof(struct linked_list));
+    struct linked_list *link = (struct linked_list *)tracked_malloc(sizeof(struct linked_list));
     link->next = 0;
     link->data = data;
     return link;
@@ -14,7 +15,7 @@ static struct linked_list *linked_list_link(void *data)
 
 struct queue *empty_queue()
 {
-    struct queue *queue = (struct queue *)malloc(sizeof(struct queue));
+    struct queue *queue = (struct queue *)tracked_malloc(sizeof(struct queue));
     queue->front = 0;
     queue->back = 0;
     return queue;
@@ -24,7 +25,7 @@ void delete_queue(struct queue *queue)
 {
     while (!queue_is_empty(queue))
         dequeue(queue);
-    free(queue);
+    tracked_free(queue);
 }
 
 void *queue_front(const struct queue *queue)
@@ -54,6 +55,6 @@ void dequeue(struct queue *queue)
     } else {
         queue->front = queue->front->next;
     }
-    free(link);
+    tracked_free(link);
 }
 
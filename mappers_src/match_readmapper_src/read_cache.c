@@ -0,0 +1,102 @@
+
+#include "read_cache.h"
+#include "strings.h"
+#include "mapper_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+struct read_cache *empty_read_cache(size_t batch_size)
+{
+    enum stats_memory subsystem = set_memory_subsystem(MEM_READS);
+    struct read_cache *cache = (struct read_cache*)tracked_malloc(sizeof(struct read_cache));
+    cache->batch_size = batch_size;
+    cache->reads_in_batch = 0;
+    
+    // at least twice as many slots as reads in a batch, so the
+    // table is never more than half full.
+    cache->table_size = 1;
+    while (cache->table_size < 2 * batch_size)
+        cache->table_size *= 2;
+    cache->used = 0;
+    cache->table = (struct read_cache_entry*)tracked_calloc(cache->table_size,
+                                                            sizeof(struct read_cache_entry));
+    set_memory_subsystem(subsystem);
+    return cache;
+}
+
+static void clear_read_cache(struct read_cache *cache)
+{
+    for (size_t i = 0; i < cache->table_size; i++) {
+        struct read_cache_entry *entry = &cache->table[i];
+        if (entry->read) {
+            tracked_free(entry->read);
+            delete_hit_list(entry->hits);
+            entry->read = 0;
+            entry->hits = 0;
+        }
+    }
+    cache->used = 0;
+    cache->reads_in_batch = 0;
+}
+
+void delete_read_cache(struct read_cache *cache)
+{
+    clear_read_cache(cache);
+    tracked_free(cache->table);
+    tracked_free(cache);
+}
+
+// FNV-1a
+static size_t hash_read(const char *read)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (const char *c = read; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct read_cache_entry *find_slot(struct read_cache *cache,
+                                          const char *read, size_t hash)
+{
+    size_t mask = cache->table_size - 1;
+    size_t i = hash & mask;
+    while (cache->table[i].read) {
+        struct read_cache_entry *entry = &cache->table[i];
+        if (entry->hash == hash && strcmp(entry->read, read) == 0)
+            return entry;
+        i = (i + 1) & mask;
+    }
+    return &cache->table[i];
+}
+
+struct hit_list *cached_hits(struct read_cache *cache, const char *read)
+{
+    if (cache->reads_in_batch == cache->batch_size)
+        clear_read_cache(cache);
+    cache->reads_in_batch++;
+    
+    struct read_cache_entry *entry = find_slot(cache, read, hash_read(read));
+    return entry->hits; // null if the slot is empty
+}
+
+struct hit_list *new_cached_hits(struct read_cache *cache, const char *read)
+{
+    assert(cache->used < cache->table_size / 2);
+    
+    size_t hash = hash_read(read);
+    struct read_cache_entry *entry = find_slot(cache, read, hash);
+    assert(entry->read == 0);
+    
+    enum stats_memory subsystem = set_memory_subsystem(MEM_READS);
+    entry->read = string_copy(read);
+    entry->hash = hash;
+    entry->hits = empty_hit_list(16); // arbitrary size...
+    set_memory_subsystem(subsystem);
+    cache->used++;
+    
+    return entry->hits;
+}
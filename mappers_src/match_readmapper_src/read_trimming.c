@@ -0,0 +1,42 @@
+
+#include "read_trimming.h"
+
+#include <string.h>
+
+size_t quality_trim_length(const char *quality, size_t length,
+                           int trim_quality)
+{
+    if (trim_quality < 1 || length <= MIN_TRIMMED_LENGTH) return 0;
+    if (strlen(quality) != length) return 0; // no qualities ('*')
+    
+    long sum = 0, max = 0;
+    size_t trimmed_length = length;
+    for (size_t l = length - 1; l >= MIN_TRIMMED_LENGTH; --l) {
+        sum += trim_quality - (quality[l] - 33);
+        if (sum < 0) break;
+        if (sum > max) {
+            max = sum;
+            trimmed_length = l;
+        }
+    }
+    return length - trimmed_length;
+}
+
+size_t mask_read(const char *read, char *masked, size_t n)
+{
+    size_t no_ns = 0;
+    for (size_t i = 0; i < n; i++) {
+        switch (read[i]) {
+            case 'A': case 'C': case 'G': case 'T':
+            case 'a': case 'c': case 'g': case 't':
+                masked[i] = read[i];
+                break;
+            default:
+                masked[i] = 'N';
+                no_ns++;
+                break;
+        }
+    }
+    masked[n] = '\0';
+    return no_ns;
+}
@@ -0,0 +1,31 @@
+
+#ifndef READ_TRIMMING_H
+#define READ_TRIMMING_H
+
+#include <stddef.h>
+
+/*
+ Cleaning up reads before we search for them. Low-quality bases at the
+ 3' end of a read are mostly sequencing errors, and every error costs
+ us an edit, so searching for them only makes the search branch more.
+ We cut them off, search for the rest of the read, and report the cut
+ bases as soft-clipped in the SAM output.
+ */
+
+// Reads are never trimmed to fewer bases than this (BWA_MIN_RDLEN).
+#define MIN_TRIMMED_LENGTH 35
+
+// The number of bases to trim off the 3' end of a read with these
+// (phred+33) qualities. This is BWA's trimming (bwa_trim_read()): we
+// cut where the sum of trim_quality - q over the trimmed bases is
+// largest. A trim_quality of zero, or a read without qualities,
+// means no trimming.
+size_t quality_trim_length(const char *quality, size_t length,
+                           int trim_quality);
+
+// Copy the first n bases of read to masked, with anything that is not
+// a nucleotide replaced by 'N', and '\0' terminate it. Returns the
+// number of Ns in the copy.
+size_t mask_read(const char *read, char *masked, size_t n);
+
+#endif
@@ -2,14 +2,85 @@
 #ifndef SAM_H
 #define SAM_H
 
+#include "string_pool.h"
+#include "size_vector.h"
+#include "bgzf.h"
+
+#include <stdbool.h>
 #include <stdio.h>
+#include <stddef.h>
 
 /*
- These functions provide some rudimentary SAM output. Most SAM flags
- are not provided as this is just an algorithmic exercise.
+ These functions provide some rudimentary SAM output. We only have
+ single-end reads, so the only flags we set are for the strand and for
+ secondary hits, and the only tags are NM, AS and X0.
+ 
+ Lines are formatted by hand into a large buffer that is written to
+ the file in big chunks, so we avoid the cost of fprintf() when a read
+ has many hits. The same lines can be written as BAM instead, in which
+ case the buffer holds one binary record at a time and the records go
+ through a BGZF writer.
  */
 
-void sam_line(FILE *file, const char *qname, const char *rname,
-              size_t pos, const char *cigar, const char *seq, const char *qual);
+#define SAM_BUFFER_SIZE (1 << 20)
+
+enum sam_format {
+    SAM_FORMAT,
+    BAM_FORMAT
+};
+
+struct sam_writer {
+    FILE *file;
+    enum sam_format format;
+    bool extended_cigars; // write '=' and 'X' rather than 'M'
+    char *buffer;
+    size_t size;
+    size_t used;
+    
+    // only used for BAM
+    struct bgzf_writer *bgzf;
+    struct string_pool *ref_names;
+    size_t last_ref;
+};
+
+// Parse "sam" or "bam"; returns false for anything else.
+bool parse_sam_format(const char *name, enum sam_format *format);
+
+// no_threads is the number of threads used for BAM compression
+struct sam_writer *empty_sam_writer(FILE *file, enum sam_format format,
+                                    bool extended_cigars, size_t no_threads);
+// flushes the buffer but does not close the file
+void delete_sam_writer(struct sam_writer *writer);
+void flush_sam_writer(struct sam_writer *writer);
+
+// The arguments joined with spaces, for the @PG header line.
+// The caller must free() the string.
+char *sam_command_line(int argc, char *argv[]);
+
+// Must be called before the first line. Writes the @HD, @SQ and @PG
+// lines and, for BAM, the binary list of references.
+void write_sam_header(struct sam_writer *writer,
+                      struct string_pool *ref_names,
+                      struct size_vector *ref_lengths,
+                      const char *program_name,
+                      const char *command_line);
+
+#define SAM_REVERSE   0x10
+#define SAM_SECONDARY 0x100
+
+// The fields we compute for each hit.
+struct sam_hit_info {
+    unsigned flag;
+    unsigned mapq;
+    size_t edit_distance; // NM
+    long score;           // AS
+    size_t no_best_hits;  // X0
+};
+
+// The CIGAR must be simplified and extended; we collapse it to
+// 'M' operations here unless the writer uses extended CIGARs.
+void sam_line(struct sam_writer *writer, const char *qname, const char *rname,
+              size_t pos, const char *cigar, const char *seq, const char *qual,
+              const struct sam_hit_info *info);
 
 #endif
@@ -2,6 +2,7 @@
 #include "suffix_array.h"
 #include "strings.h"
 #include "pair_stack.h"
+#include "mapper_stats.h"
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -13,10 +14,10 @@
 static struct suffix_array *allocate_sa(char *string)
 {
     struct suffix_array *sa =
-        (struct suffix_array*)malloc(sizeof(struct suffix_array));
+        (struct suffix_array*)tracked_malloc(sizeof(struct suffix_array));
     sa->string = string;
     sa->length = strlen(string);
-    sa->array = (size_t*)malloc(sa->length * sizeof(size_t));
+    sa->array = (size_t*)tracked_malloc(sa->length * sizeof(size_t));
     
     return sa;
 }
@@ -31,7 +32,7 @@ struct suffix_array *qsort_sa_construction(char *string)
 {
     struct suffix_array *sa = allocate_sa(string);
     
-    char **suffixes = malloc(sa->length * sizeof(char *));
+    char **suffixes = tracked_malloc(sa->length * sizeof(char *));
     for (int i = 0; i < sa->length; ++i)
         suffixes[i] = (char *)string + i;
     
@@ -39,6 +40,7 @@ struct suffix_array *qsort_sa_construction(char *string)
     
     for (int i = 0; i < sa->length; i++)
         sa->array[i] = suffixes[i] - string;
+    tracked_free(suffixes);
     
     return sa;
 }
@@ -46,9 +48,9 @@ struct suffix_array *qsort_sa_construction(char *string)
 
 void delete_suffix_array(struct suffix_array *sa)
 {
-    if(sa->string) free(sa->string);
-    free(sa->array);
-    free(sa);
+    if(sa->string) tracked_free(sa->string);
+    tracked_free(sa->array);
+    tracked_free(sa);
 }
 
 // when searching, we cannot simply use bsearch because we want
@@ -108,7 +110,9 @@ void suffix_array_bsearch_match(const char *text, size_t n,
                                 match_callback_func callback,
                                 void *callback_data)
 {
+    enum stats_memory subsystem = set_memory_subsystem(MEM_SUFFIX_ARRAY);
     struct suffix_array *sa = qsort_sa_construction(string_copy(text));
+    set_memory_subsystem(subsystem);
     size_t lb = lower_bound_search(sa, pattern);
     for (size_t i = lb; i < sa->length; ++i) {
         if (strncmp(pattern, sa->string + sa->array[i], m) != 0)
@@ -1,12 +1,13 @@
 #include "trie.h"
 #include "queue.h"
+#include "mapper_stats.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 
 struct trie *empty_trie()
 {
-    struct trie *trie = (struct trie*)malloc(sizeof(struct trie));
+    struct trie *trie = (struct trie*)tracked_malloc(sizeof(struct trie));
     trie->in_edge_label = '\0';
     trie->string_label = -1;
     trie->parent = 0;
@@ -104,10 +105,10 @@ void delete_trie(struct trie *trie)
        when their corresponding trie nodes are deleted. 
      */
     if (trie->output && trie->string_label >= 0) {
-        free(trie->output);
+        tracked_free(trie->output);
     }
     
-    free(trie);
+    tracked_free(trie);
 }
 
 static void enqueue_siblings(struct queue *queue, struct trie *siblings)
@@ -121,7 +122,7 @@ static struct output_list *new_output_link(int label, struct output_list *next)
 {
     assert(label >= 0);
     
-    struct output_list *link = (struct output_list *)malloc(sizeof(struct output_list));
+    struct output_list *link = (struct output_list *)tracked_malloc(sizeof(struct output_list));
     link->string_label = label;
     link->next = next;
     return link;
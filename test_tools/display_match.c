@@ -203,6 +203,8 @@ int main(int argc, const char *argv[]) {
     char line_buffer[MAX_LINE_SIZE];
 
     while (fgets(line_buffer, MAX_LINE_SIZE, sam_file) != 0) {
+        if (line_buffer[0] == '@')
+            continue; // header line
         parse_sam_line(line_buffer, (char *)&read_name_buffer,
                        (char *)ref_name_buffer, &match_index,
                        (char *)cigar_buffer, (char *)pattern_buffer);
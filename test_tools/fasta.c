@@ -45,6 +45,7 @@ int read_fasta_records(struct fasta_records* records, FILE* file)
         if (buffer[0] == '>')
         {
             // new sequence...
+            seq[n] = '\0';
             add_string_copy(records->names, name);
             free(name);
             add_string_copy(records->sequences, seq); // don't free...reuse by setting n = 0
@@ -73,6 +74,7 @@ int read_fasta_records(struct fasta_records* records, FILE* file)
     }
 
     // handle last record...
+    seq[n] = '\0';
     add_string_copy(records->names, name);
     add_string_copy(records->sequences, seq);
     add_size(records->seq_sizes, strlen(seq));
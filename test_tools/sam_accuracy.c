@@ -0,0 +1,361 @@
+/*
+ Accuracy of a read-mapper on simulated reads.
+
+ data/simulate-fastq.py can log where it sampled each read from: a line
+ per read with the reference sequence, the (1-based) position, the
+ sampled sequence and the read we made from it. Here we stream a
+ mapper's SAM output and check its hits against that truth.
+
+ A hit is correct if it is on the strand of the sequence the read came
+ from, within a tolerance of the position it came from. The
+ tolerance is there because an alignment can start a few bases off when
+ there are indels near the start of the read. We report, per read length
+ and per true edit distance between the read and where it came from,
+
+ - the sensitivity: the fraction of reads with a correct hit, and
+ - the precision: the fraction of the hits that are correct.
+
+ The mappers report all hits within the edit distance, so hits in repeats
+ count against the precision, but alternative alignments at the right
+ place do not.
+
+ The simulator names the reads read0, read1, ..., in the order it logs
+ them, and that is how we find the truth for a read. test_tools/simulate_reads
+ adds a fifth column with the strand, + or -; without it we assume the
+ read is from the forward strand.
+ */
+
+// for getline()
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_TOLERANCE 10
+
+// We only compute edit distances up to this; reads that are further from
+// where they came from are put in the same group.
+#define MAX_EDIT_DISTANCE 16
+
+struct read_truth {
+    char *ref_name;
+    size_t pos;
+    size_t length; // of the sampled sequence
+    int d;         // edit distance from the sample to the read
+    bool reverse;  // the read is from the reverse strand
+    size_t hits;
+    size_t correct_hits;
+};
+
+struct truth {
+    struct read_truth *reads;
+    size_t size;
+    size_t used;
+};
+
+struct group {
+    size_t length;
+    int d;
+    size_t reads, mapped, found;
+    size_t hits, correct_hits;
+};
+
+static size_t min_size(size_t a, size_t b) { return a < b ? a : b; }
+
+// Edit distance between x and y, computed in a band around the
+// diagonal, so it is only exact up to MAX_EDIT_DISTANCE; beyond that
+// we just return MAX_EDIT_DISTANCE.
+static int banded_edit_distance(const char *x, size_t n, const char *y, size_t m)
+{
+    const int k = MAX_EDIT_DISTANCE;
+    if ((n > m ? n - m : m - n) >= (size_t)k) return k;
+    
+    int *previous = (int*)malloc((m + 1) * sizeof(int));
+    int *current = (int*)malloc((m + 1) * sizeof(int));
+    for (size_t j = 0; j <= m; j++) {
+        previous[j] = j <= (size_t)k ? (int)j : k;
+    }
+    for (size_t i = 1; i <= n; i++) {
+        size_t from = i > (size_t)k ? i - k : 1;
+        size_t to = min_size(m, i + k);
+        current[from - 1] = from == 1 ? min_size(i, k) : k;
+        for (size_t j = from; j <= to; j++) {
+            int best = previous[j - 1] + (x[i - 1] != y[j - 1]);
+            if (j < i + k && previous[j] + 1 < best) best = previous[j] + 1;
+            if (current[j - 1] + 1 < best) best = current[j - 1] + 1;
+            current[j] = best < k ? best : k;
+        }
+        if (to < m) current[to + 1] = k;
+        int *tmp = previous; previous = current; current = tmp;
+    }
+    int d = previous[m];
+    free(previous);
+    free(current);
+    return d;
+}
+
+// The simulator writes the full FASTA header, but the mappers only
+// use the first word of it as the reference name.
+static char *first_word(const char *s)
+{
+    s += strspn(s, " \t");
+    size_t n = strcspn(s, " \t");
+    char *word = (char*)malloc(n + 1);
+    memcpy(word, s, n);
+    word[n] = '\0';
+    return word;
+}
+
+static int read_truth(struct truth *truth, FILE *file)
+{
+    char *line = 0;
+    size_t line_size = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_size, file)) != -1) {
+        if (length > 0 && line[length - 1] == '\n') line[--length] = '\0';
+        if (length == 0) continue;
+        
+        char *fields[5];
+        char *s = line;
+        int no_fields = 0;
+        for (; no_fields < 5 && s; no_fields++) {
+            fields[no_fields] = s;
+            s = strchr(s, '\t');
+            if (s) *s++ = '\0';
+        }
+        if (no_fields < 4) {
+            fprintf(stderr, "Malformed truth line %lu.\n", truth->used + 1);
+            free(line);
+            return 1;
+        }
+        
+        if (truth->used == truth->size) {
+            truth->size = truth->size ? 2 * truth->size : 1024;
+            truth->reads = (struct read_truth*)realloc(truth->reads,
+                                                       truth->size * sizeof(struct read_truth));
+        }
+        struct read_truth *read = &truth->reads[truth->used++];
+        read->ref_name = first_word(fields[0]);
+        read->pos = (size_t)atol(fields[1]);
+        read->length = strlen(fields[2]);
+        read->d = banded_edit_distance(fields[2], read->length,
+                                       fields[3], strlen(fields[3]));
+        read->reverse = no_fields == 5 && fields[4][0] == '-';
+        read->hits = read->correct_hits = 0;
+    }
+    free(line);
+    return 0;
+}
+
+// The read number in the simulator's names, or -1 if the name isn't one.
+static long read_number(const char *qname)
+{
+    if (strncmp(qname, "read", 4) != 0) return -1;
+    char *end;
+    long number = strtol(qname + 4, &end, 10);
+    if (end == qname + 4 || *end != '\0') return -1;
+    return number;
+}
+
+static int scan_sam(struct truth *truth, FILE *file, size_t tolerance)
+{
+    char *line = 0;
+    size_t line_size = 0;
+    ssize_t length;
+    size_t unknown = 0;
+    while ((length = getline(&line, &line_size, file)) != -1) {
+        if (line[0] == '@') continue;
+        
+        // QNAME FLAG RNAME POS
+        char *fields[4];
+        char *s = line;
+        int no_fields = 0;
+        for (; no_fields < 4 && s; no_fields++) {
+            fields[no_fields] = s;
+            s = strchr(s, '\t');
+            if (s) *s++ = '\0';
+        }
+        if (no_fields != 4 || !s) {
+            fprintf(stderr, "Malformed SAM line:\n%s\n", line);
+            free(line);
+            return 1;
+        }
+        
+        int flag = atoi(fields[1]);
+        if (flag & 4) continue; // unmapped
+        
+        long number = read_number(fields[0]);
+        if (number < 0 || (size_t)number >= truth->used) {
+            unknown++;
+            continue;
+        }
+        struct read_truth *read = &truth->reads[number];
+        read->hits++;
+        
+        size_t pos = (size_t)atol(fields[3]);
+        size_t distance = pos > read->pos ? pos - read->pos : read->pos - pos;
+        if ((flag & 16) == (read->reverse ? 16 : 0) && distance <= tolerance &&
+            strcmp(fields[2], read->ref_name) == 0)
+            read->correct_hits++;
+    }
+    free(line);
+    
+    if (unknown > 0)
+        fprintf(stderr, "Skipped %lu hits for reads that are not in the truth file.\n",
+                unknown);
+    return 0;
+}
+
+static int compare_groups(const void *a, const void *b)
+{
+    const struct group *x = (const struct group*)a;
+    const struct group *y = (const struct group*)b;
+    if (x->length != y->length) return x->length < y->length ? -1 : 1;
+    return x->d - y->d;
+}
+
+static void add_to_group(struct group *group, const struct read_truth *read)
+{
+    group->reads++;
+    group->mapped += read->hits > 0;
+    group->found += read->correct_hits > 0;
+    group->hits += read->hits;
+    group->correct_hits += read->correct_hits;
+}
+
+static void print_group(const char *label, const struct group *group,
+                        const char *length, const char *d)
+{
+    if (label) printf("%s\t", label);
+    printf("%s\t%s\t%lu\t%lu\t%lu\t%.4f\t%lu\t%lu\t",
+           length, d, group->reads, group->mapped, group->found,
+           group->reads ? (double)group->found / group->reads : 0.0,
+           group->hits, group->correct_hits);
+    if (group->hits)
+        printf("%.4f\n", (double)group->correct_hits / group->hits);
+    else
+        printf("NA\n");
+}
+
+static void report(const char *label, const struct truth *truth, int header)
+{
+    struct group *groups = 0;
+    size_t no_groups = 0;
+    struct group total = { 0 };
+    for (size_t i = 0; i < truth->used; i++) {
+        const struct read_truth *read = &truth->reads[i];
+        size_t g = 0;
+        while (g < no_groups &&
+               (groups[g].length != read->length || groups[g].d != read->d))
+            g++;
+        if (g == no_groups) {
+            groups = (struct group*)realloc(groups, ++no_groups * sizeof(struct group));
+            memset(&groups[g], 0, sizeof(struct group));
+            groups[g].length = read->length;
+            groups[g].d = read->d;
+        }
+        add_to_group(&groups[g], read);
+        add_to_group(&total, read);
+    }
+    qsort(groups, no_groups, sizeof(struct group), compare_groups);
+    
+    if (header) {
+        if (label) printf("mapper\t");
+        printf("read_length\td\treads\tmapped\tcorrect\tsensitivity\thits\tcorrect_hits\tprecision\n");
+    }
+    char length[32], d[32];
+    for (size_t g = 0; g < no_groups; g++) {
+        snprintf(length, sizeof(length), "%lu", groups[g].length);
+        snprintf(d, sizeof(d), "%s%d",
+                 groups[g].d == MAX_EDIT_DISTANCE ? ">=" : "", groups[g].d);
+        print_group(label, &groups[g], length, d);
+    }
+    print_group(label, &total, "all", "all");
+    free(groups);
+}
+
+static void print_usage(const char *progname, FILE *file)
+{
+    fprintf(file, "Usage: %s [options] truth.txt mapper-output.sam\n\n", progname);
+    fprintf(file, "The truth file is the log from simulate-fastq.py -l; use - to\n");
+    fprintf(file, "read the SAM output from stdin.\n\n");
+    fprintf(file, "Options:\n");
+    fprintf(file, "\t-h | --help:\t\t Show this message.\n");
+    fprintf(file, "\t-t | --tolerance:\t How far from the true position a hit can be\n"
+                  "\t\t\t\t and still be correct (default %d).\n", DEFAULT_TOLERANCE);
+    fprintf(file, "\t-l | --label:\t\t Add a first column with this label, e.g. the mapper.\n");
+    fprintf(file, "\t-n | --no-header:\t Don't write the header line.\n");
+    fprintf(file, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    size_t tolerance = DEFAULT_TOLERANCE;
+    const char *label = 0;
+    int header = 1;
+    
+    int opt;
+    static struct option longopts[] = {
+        { "help",      no_argument,       NULL, 'h' },
+        { "tolerance", required_argument, NULL, 't' },
+        { "label",     required_argument, NULL, 'l' },
+        { "no-header", no_argument,       NULL, 'n' },
+        { NULL,        0,                 NULL,  0  }
+    };
+    while ((opt = getopt_long(argc, argv, "ht:l:n", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage(progname, stdout);
+                return EXIT_SUCCESS;
+            case 't':
+                tolerance = (size_t)atol(optarg);
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'n':
+                header = 0;
+                break;
+            default:
+                print_usage(progname, stderr);
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 2) {
+        print_usage(progname, stderr);
+        return EXIT_FAILURE;
+    }
+    
+    FILE *truth_file = fopen(argv[0], "r");
+    if (!truth_file) {
+        fprintf(stderr, "Could not open %s.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    struct truth truth = { 0, 0, 0 };
+    int status = read_truth(&truth, truth_file);
+    fclose(truth_file);
+    if (status != 0) return EXIT_FAILURE;
+    
+    FILE *sam_file = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+    if (!sam_file) {
+        fprintf(stderr, "Could not open %s.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    status = scan_sam(&truth, sam_file, tolerance);
+    if (sam_file != stdin) fclose(sam_file);
+    if (status != 0) return EXIT_FAILURE;
+    
+    report(label, &truth, header);
+    
+    for (size_t i = 0; i < truth.used; i++) {
+        free(truth.reads[i].ref_name);
+    }
+    free(truth.reads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,328 @@
+/*
+ Compare the hits in two SAM files.
+
+ Mappers don't have to report the hits for a read in any particular
+ order, so we can't compare SAM files line by line. Instead of sorting
+ them, we identify each record by its read, strand, reference, position
+ and CIGAR, put the records of the first file in a hash table, and
+ look up the records of the second file as we stream through it. The
+ table only holds hashes, not the records, so it stays small even for
+ large files.
+
+ Header lines are ignored. A record in one file is
+
+ - missing, if the first file has it and the second doesn't,
+ - extra, if the second file has it and the first doesn't, and
+ - different, if both files have a record with the same read, strand,
+   reference, position and CIGAR, but the rest of the record differs.
+
+ We report how many records fall in each category and the first of
+ each, and exit with status 0 if the files have the same records, 1 if
+ they differ, and 2 if we couldn't compare them.
+ */
+
+// for getline()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct record_entry {
+    uint64_t key;      // zero for an empty slot
+    uint64_t record;   // hash of the full record
+    size_t line;       // line of the first record with this key in the first file
+    size_t count;      // records with this key in the first file
+    size_t matched;    // ... and how many of them we have seen in the second
+};
+
+struct record_table {
+    struct record_entry *entries;
+    size_t size; // always a power of two
+    size_t used;
+};
+
+enum difference { MISSING, EXTRA, DIFFERENT, NO_DIFFERENCES };
+static const char *difference_names[NO_DIFFERENCES] = {
+    "missing", "extra", "different"
+};
+
+// 64-bit FNV-1a, continued from hash.
+static uint64_t hash_bytes(uint64_t hash, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+static void init_record_table(struct record_table *table)
+{
+    table->size = 1024;
+    table->used = 0;
+    table->entries = (struct record_entry*)calloc(table->size, sizeof(struct record_entry));
+}
+
+static struct record_entry *find_slot(struct record_entry *entries, size_t size,
+                                      uint64_t key)
+{
+    size_t i = (size_t)(key ^ (key >> 32)) & (size - 1);
+    while (entries[i].key != 0 && entries[i].key != key) {
+        i = (i + 1) & (size - 1);
+    }
+    return &entries[i];
+}
+
+static void grow_record_table(struct record_table *table)
+{
+    size_t new_size = 2 * table->size;
+    struct record_entry *entries =
+        (struct record_entry*)calloc(new_size, sizeof(struct record_entry));
+    for (size_t i = 0; i < table->size; i++) {
+        if (table->entries[i].key != 0)
+            *find_slot(entries, new_size, table->entries[i].key) = table->entries[i];
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->size = new_size;
+}
+
+static struct record_entry *lookup_record(struct record_table *table, uint64_t key)
+{
+    struct record_entry *entry = find_slot(table->entries, table->size, key);
+    return entry->key == key ? entry : 0;
+}
+
+static struct record_entry *insert_record(struct record_table *table, uint64_t key)
+{
+    if (10 * (table->used + 1) > 7 * table->size)
+        grow_record_table(table);
+    struct record_entry *entry = find_slot(table->entries, table->size, key);
+    if (entry->key == 0) {
+        entry->key = key;
+        table->used++;
+    }
+    return entry;
+}
+
+// Hash a SAM line into its key and the full record. Returns false if
+// the line isn't a record.
+static bool hash_record(char *line, uint64_t *key, uint64_t *record)
+{
+    size_t length = strlen(line);
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        line[--length] = '\0';
+    
+    // QNAME FLAG RNAME POS MAPQ CIGAR
+    const char *fields[6];
+    size_t field_lengths[6];
+    const char *s = line;
+    for (int i = 0; i < 6; i++) {
+        if (!s) return false;
+        fields[i] = s;
+        s = strchr(s, '\t');
+        field_lengths[i] = s ? (size_t)(s - fields[i]) : strlen(fields[i]);
+        if (s) s++;
+    }
+    
+    char strand = (atoi(fields[1]) & 16) ? '-' : '+';
+    uint64_t hash = FNV_OFFSET_BASIS;
+    hash = hash_bytes(hash, fields[0], field_lengths[0] + 1); // + 1 for the tab
+    hash = hash_bytes(hash, &strand, 1);
+    hash = hash_bytes(hash, fields[2], field_lengths[2] + 1);
+    hash = hash_bytes(hash, fields[3], field_lengths[3] + 1);
+    hash = hash_bytes(hash, fields[5], field_lengths[5]);
+    *key = hash ? hash : 1; // zero marks empty slots
+    *record = hash_bytes(FNV_OFFSET_BASIS, line, length);
+    return true;
+}
+
+struct comparison {
+    const char *filenames[2];
+    size_t records[2];
+    size_t counts[NO_DIFFERENCES];
+    // the first difference in each category; for a missing record we
+    // only know its line number, for the others we keep the line
+    size_t first_line[NO_DIFFERENCES];
+    char *first_record[NO_DIFFERENCES];
+    size_t first_expected_line; // the first file's version of the first different record
+};
+
+static void note_difference(struct comparison *comparison, enum difference difference,
+                            size_t line, const char *record)
+{
+    if (comparison->counts[difference] == 0) {
+        comparison->first_line[difference] = line;
+        if (record) {
+            size_t n = strlen(record);
+            comparison->first_record[difference] = (char*)malloc(n + 1);
+            memcpy(comparison->first_record[difference], record, n + 1);
+        }
+    }
+    comparison->counts[difference]++;
+}
+
+static FILE *open_sam(const char *filename)
+{
+    FILE *file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (!file) fprintf(stderr, "Could not open %s.\n", filename);
+    return file;
+}
+
+static void close_sam(FILE *file)
+{
+    if (file != stdin) fclose(file);
+}
+
+static int read_first(struct record_table *table, struct comparison *comparison)
+{
+    FILE *file = open_sam(comparison->filenames[0]);
+    if (!file) return 1;
+    
+    char *line = 0;
+    size_t line_size = 0;
+    size_t line_no = 0;
+    uint64_t key, record;
+    while (getline(&line, &line_size, file) != -1) {
+        line_no++;
+        if (line[0] == '@' || !hash_record(line, &key, &record)) continue;
+        comparison->records[0]++;
+        
+        struct record_entry *entry = insert_record(table, key);
+        if (entry->count++ == 0) {
+            entry->record = record;
+            entry->line = line_no;
+        }
+    }
+    free(line);
+    close_sam(file);
+    return 0;
+}
+
+static int stream_second(struct record_table *table, struct comparison *comparison)
+{
+    FILE *file = open_sam(comparison->filenames[1]);
+    if (!file) return 1;
+    
+    char *line = 0;
+    size_t line_size = 0;
+    size_t line_no = 0;
+    uint64_t key, record;
+    while (getline(&line, &line_size, file) != -1) {
+        line_no++;
+        if (line[0] == '@' || !hash_record(line, &key, &record)) continue;
+        comparison->records[1]++;
+        
+        struct record_entry *entry = lookup_record(table, key);
+        if (!entry || entry->matched == entry->count) {
+            note_difference(comparison, EXTRA, line_no, line);
+            continue;
+        }
+        entry->matched++;
+        if (entry->record != record) {
+            if (comparison->counts[DIFFERENT] == 0)
+                comparison->first_expected_line = entry->line;
+            note_difference(comparison, DIFFERENT, line_no, line);
+        }
+    }
+    free(line);
+    close_sam(file);
+    
+    // what is left in the table is missing from the second file; we
+    // report the first of them by its line in the first file
+    for (size_t i = 0; i < table->size; i++) {
+        struct record_entry *entry = &table->entries[i];
+        if (entry->key == 0 || entry->matched == entry->count) continue;
+        size_t count = entry->count - entry->matched;
+        if (comparison->counts[MISSING] == 0 || entry->line < comparison->first_line[MISSING])
+            comparison->first_line[MISSING] = entry->line;
+        comparison->counts[MISSING] += count;
+    }
+    return 0;
+}
+
+// Get line number line_no from a file, for reporting the first
+// missing record. We can't if we read the file from stdin.
+static char *get_line(const char *filename, size_t line_no)
+{
+    if (strcmp(filename, "-") == 0) return 0;
+    FILE *file = fopen(filename, "r");
+    if (!file) return 0;
+    char *line = 0;
+    size_t line_size = 0;
+    for (size_t i = 0; i < line_no; i++) {
+        if (getline(&line, &line_size, file) == -1) {
+            free(line);
+            line = 0;
+            break;
+        }
+    }
+    fclose(file);
+    if (line) line[strcspn(line, "\r\n")] = '\0';
+    return line;
+}
+
+static void report(struct comparison *comparison)
+{
+    printf("records\t%lu\t%lu\n", comparison->records[0], comparison->records[1]);
+    for (int d = 0; d < NO_DIFFERENCES; d++) {
+        printf("%s\t%lu\n", difference_names[d], comparison->counts[d]);
+    }
+    
+    if (comparison->counts[MISSING] > 0) {
+        size_t line_no = comparison->first_line[MISSING];
+        char *line = get_line(comparison->filenames[0], line_no);
+        printf("first missing record, %s line %lu:\t%s\n",
+               comparison->filenames[0], line_no, line ? line : "");
+        free(line);
+    }
+    for (int d = EXTRA; d < NO_DIFFERENCES; d++) {
+        if (comparison->counts[d] == 0) continue;
+        printf("first %s record, %s line %lu:\t%s\n", difference_names[d],
+               comparison->filenames[1], comparison->first_line[d],
+               comparison->first_record[d]);
+    }
+    if (comparison->counts[DIFFERENT] > 0) {
+        size_t line_no = comparison->first_expected_line;
+        char *line = get_line(comparison->filenames[0], line_no);
+        printf("expected, %s line %lu:\t%s\n",
+               comparison->filenames[0], line_no, line ? line : "");
+        free(line);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 || (strcmp(argv[1], "-") == 0 && strcmp(argv[2], "-") == 0)) {
+        fprintf(stderr, "Usage: %s expected.sam actual.sam\n\n", argv[0]);
+        fprintf(stderr, "Use - to read one of the files from stdin.\n");
+        return 2;
+    }
+    
+    struct comparison comparison;
+    memset(&comparison, 0, sizeof(comparison));
+    comparison.filenames[0] = argv[1];
+    comparison.filenames[1] = argv[2];
+    
+    struct record_table table;
+    init_record_table(&table);
+    if (read_first(&table, &comparison) != 0 ||
+        stream_second(&table, &comparison) != 0) {
+        free(table.entries);
+        return 2;
+    }
+    free(table.entries);
+    
+    report(&comparison);
+    
+    bool same = true;
+    for (int d = 0; d < NO_DIFFERENCES; d++) {
+        same = same && comparison.counts[d] == 0;
+        free(comparison.first_record[d]);
+    }
+    return same ? 0 : 1;
+}
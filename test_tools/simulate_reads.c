@@ -0,0 +1,533 @@
+/*
+ Simulate reads from a reference genome.
+
+ This does the same as data/simulate-fastq.py, and writes the same
+ FASTQ and the same log of where each read came from, but it is fast
+ enough to make benchmark sets of many millions of reads.
+
+ We sample a position uniformly over the genome -- so longer sequences
+ get more reads -- and take the m bases there, either from the forward
+ strand or, with the --reverse probability, from the reverse strand.
+ Then we add errors to the sample in two ways:
+
+ - each base of the sample is substituted, deleted, or has a random
+   base inserted in front of it with the rates given by --sub, --del
+   and --ins. The rates apply to the first base of the read and change
+   linearly along it to --end-factor times the rates at the last base,
+   so we can simulate reads that get worse towards the end.
+ - then we make -d random edits, like simulate-fastq.py does.
+
+ Samples with anything but ACGT in them (in either case) are, by
+ default, rejected and we sample again. With --ns=keep we keep them,
+ and with --ns=random we replace the other characters with random
+ bases.
+
+ Each read gets its own random number generator, seeded from the seed
+ and the read number, so the output only depends on the seed and not on
+ the number of threads. The threads simulate blocks of reads and write
+ them in order.
+ */
+
+#include "fasta.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_NO_READS 10
+#define DEFAULT_READ_LENGTH 100
+#define BLOCK_SIZE (1 << 14) // reads per block
+#define MAX_TRIES 1000       // samples we try before we give up finding one without Ns
+
+enum n_handling { SKIP_NS, KEEP_NS, RANDOM_NS };
+
+struct simulation {
+    struct fasta_records *reference;
+    size_t *windows; // windows[k]: number of positions we can sample in sequences before k
+    size_t no_windows;
+    
+    size_t no_reads;
+    size_t m;
+    int d;
+    double sub_rate, ins_rate, del_rate;
+    double end_factor;
+    double reverse;
+    enum n_handling ns;
+    uint64_t seed;
+    
+    FILE *out, *log;
+    
+    // the threads take blocks in order and wait for their turn to write them
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    size_t next_block;
+    size_t next_to_write;
+    bool write_failed;
+};
+
+struct buffer {
+    char *data;
+    size_t size;
+    size_t used;
+};
+
+static void reserve(struct buffer *buffer, size_t n)
+{
+    if (buffer->used + n <= buffer->size) return;
+    while (buffer->used + n > buffer->size) {
+        buffer->size = buffer->size ? 2 * buffer->size : 1 << 20;
+    }
+    buffer->data = (char*)realloc(buffer->data, buffer->size);
+}
+
+static void append(struct buffer *buffer, const char *s, size_t n)
+{
+    reserve(buffer, n);
+    memcpy(buffer->data + buffer->used, s, n);
+    buffer->used += n;
+}
+
+static void append_char(struct buffer *buffer, char c)
+{
+    reserve(buffer, 1);
+    buffer->data[buffer->used++] = c;
+}
+
+static void append_size(struct buffer *buffer, size_t x)
+{
+    char digits[32];
+    int n = 0;
+    do {
+        digits[n++] = '0' + x % 10;
+        x /= 10;
+    } while (x > 0);
+    reserve(buffer, (size_t)n);
+    while (n > 0) buffer->data[buffer->used++] = digits[--n];
+}
+
+// splitmix64: small, fast, and any 64-bit seed is a good seed.
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double random_uniform(uint64_t *state)
+{
+    return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0); // 2^53
+}
+
+static size_t random_below(uint64_t *state, size_t n)
+{
+    return (size_t)(next_random(state) % n);
+}
+
+static const char *bases = "ACGT";
+
+static char random_base(uint64_t *state)
+{
+    return bases[next_random(state) >> 62];
+}
+
+// A base different from b, if b is a base.
+static char substitute(char b, uint64_t *state)
+{
+    char c;
+    do {
+        c = random_base(state);
+    } while (c == b || c == b - 'a' + 'A');
+    return c;
+}
+
+static bool is_base(char b)
+{
+    switch (b) {
+        case 'A': case 'C': case 'G': case 'T':
+        case 'a': case 'c': case 'g': case 't':
+            return true;
+        default:
+            return false;
+    }
+}
+
+static char complement(char b)
+{
+    switch (b) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        case 'a': return 't';
+        case 'c': return 'g';
+        case 'g': return 'c';
+        case 't': return 'a';
+        default:  return b;
+    }
+}
+
+static void reverse_complement(char *s, size_t n)
+{
+    for (size_t i = 0, j = n; i < j; i++) {
+        char c = complement(s[--j]);
+        s[j] = complement(s[i]);
+        s[i] = c;
+    }
+}
+
+// Pick a sequence and position; the position is 0-based.
+static void sample_position(const struct simulation *sim, uint64_t *state,
+                            size_t *seq, size_t *pos)
+{
+    size_t w = random_below(state, sim->no_windows);
+    // the last sequence with windows[k] <= w
+    size_t lo = 0, hi = sim->reference->sequences->used;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sim->windows[mid] <= w) lo = mid;
+        else hi = mid;
+    }
+    *seq = lo;
+    *pos = w - sim->windows[lo];
+}
+
+// Sample m bases into sample. Returns false if we couldn't find a
+// sample without Ns and should.
+static bool sample_read(const struct simulation *sim, uint64_t *state,
+                        size_t *seq, size_t *pos, char *sample)
+{
+    size_t m = sim->m;
+    for (int tries = 0; tries < MAX_TRIES; tries++) {
+        sample_position(sim, state, seq, pos);
+        memcpy(sample, sim->reference->sequences->strings[*seq] + *pos, m);
+        
+        bool only_bases = true;
+        for (size_t i = 0; i < m && only_bases; i++) {
+            only_bases = is_base(sample[i]);
+        }
+        if (only_bases || sim->ns == KEEP_NS) return true;
+        if (sim->ns == RANDOM_NS) {
+            for (size_t i = 0; i < m; i++) {
+                if (!is_base(sample[i])) sample[i] = random_base(state);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add errors to the sample. read must have room for 2m + d characters.
+// Returns the length of the read.
+static size_t mutate(const struct simulation *sim, uint64_t *state,
+                     const char *sample, char *read)
+{
+    size_t m = sim->m;
+    size_t n = 0;
+    for (size_t i = 0; i < m; i++) {
+        double f = m > 1 ? 1.0 + (sim->end_factor - 1.0) * (double)i / (double)(m - 1) : 1.0;
+        double p_del = f * sim->del_rate;
+        double p_ins = p_del + f * sim->ins_rate;
+        double p_sub = p_ins + f * sim->sub_rate;
+        double r = p_sub > 0.0 ? random_uniform(state) : 1.0;
+        if (r < p_del) continue;
+        if (r < p_ins) {
+            read[n++] = random_base(state);
+            read[n++] = sample[i];
+        } else if (r < p_sub) {
+            read[n++] = substitute(sample[i], state);
+        } else {
+            read[n++] = sample[i];
+        }
+    }
+    
+    for (int e = 0; e < sim->d && n > 0; e++) {
+        size_t kind = random_below(state, 3);
+        size_t i = random_below(state, n);
+        if (kind == 0) {
+            read[i] = random_base(state);
+        } else if (kind == 1) {
+            memmove(read + i, read + i + 1, n - i - 1);
+            n--;
+        } else {
+            memmove(read + i + 1, read + i, n - i);
+            read[i] = random_base(state);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void simulate_block(const struct simulation *sim, size_t block,
+                           char *sample, char *read,
+                           struct buffer *fastq, struct buffer *log)
+{
+    size_t m = sim->m;
+    size_t first = block * BLOCK_SIZE;
+    size_t last = first + BLOCK_SIZE < sim->no_reads ? first + BLOCK_SIZE : sim->no_reads;
+    for (size_t r = first; r < last; r++) {
+        uint64_t seed = r;
+        uint64_t state = sim->seed ^ next_random(&seed);
+        
+        size_t seq, pos;
+        if (!sample_read(sim, &state, &seq, &pos, sample)) {
+            fprintf(stderr, "Could not find a sample without Ns in %d tries; "
+                            "use --ns=keep or --ns=random.\n", MAX_TRIES);
+            exit(EXIT_FAILURE);
+        }
+        bool reverse = sim->reverse > 0.0 && random_uniform(&state) < sim->reverse;
+        if (reverse) reverse_complement(sample, m);
+        size_t n = mutate(sim, &state, sample, read);
+        
+        append(fastq, "@read", 5);
+        append_size(fastq, r);
+        append_char(fastq, '\n');
+        append(fastq, read, n);
+        append(fastq, "\n+\n", 3);
+        reserve(fastq, n + 1);
+        memset(fastq->data + fastq->used, '~', n);
+        fastq->used += n;
+        append_char(fastq, '\n');
+        
+        if (sim->log) {
+            const char *name = sim->reference->names->strings[seq];
+            append(log, name, strlen(name));
+            append_char(log, '\t');
+            append_size(log, pos + 1); // 1-based like SAM
+            append_char(log, '\t');
+            append(log, sample, m);
+            append_char(log, '\t');
+            append(log, read, n);
+            append_char(log, '\t');
+            append_char(log, reverse ? '-' : '+');
+            append_char(log, '\n');
+        }
+    }
+}
+
+static void *simulation_thread(void *data)
+{
+    struct simulation *sim = (struct simulation*)data;
+    size_t no_blocks = (sim->no_reads + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char *sample = (char*)malloc(sim->m);
+    char *read = (char*)malloc(2 * sim->m + (size_t)sim->d);
+    struct buffer fastq = { 0, 0, 0 };
+    struct buffer log = { 0, 0, 0 };
+    
+    for (;;) {
+        pthread_mutex_lock(&sim->lock);
+        size_t block = sim->next_block++;
+        pthread_mutex_unlock(&sim->lock);
+        if (block >= no_blocks) break;
+        
+        fastq.used = log.used = 0;
+        simulate_block(sim, block, sample, read, &fastq, &log);
+        
+        pthread_mutex_lock(&sim->lock);
+        while (sim->next_to_write != block) {
+            pthread_cond_wait(&sim->turn, &sim->lock);
+        }
+        pthread_mutex_unlock(&sim->lock);
+        
+        // only this thread writes until we move next_to_write on
+        if (fwrite(fastq.data, 1, fastq.used, sim->out) != fastq.used ||
+            (sim->log && fwrite(log.data, 1, log.used, sim->log) != log.used))
+            sim->write_failed = true;
+        
+        pthread_mutex_lock(&sim->lock);
+        sim->next_to_write++;
+        pthread_cond_broadcast(&sim->turn);
+        pthread_mutex_unlock(&sim->lock);
+    }
+    
+    free(fastq.data);
+    free(log.data);
+    free(sample);
+    free(read);
+    return 0;
+}
+
+static void print_usage(const char *progname, FILE *file)
+{
+    fprintf(file, "Usage: %s [options] reference.fa\n\n", progname);
+    fprintf(file, "Options:\n");
+    fprintf(file, "\t-h | --help:\t\t Show this message.\n");
+    fprintf(file, "\t-n | --reads:\t\t Number of reads (default %d).\n", DEFAULT_NO_READS);
+    fprintf(file, "\t-m | --length:\t\t Length of the reads (default %d).\n", DEFAULT_READ_LENGTH);
+    fprintf(file, "\t-d | --edits:\t\t Random edits per read, like simulate-fastq.py (default 0).\n");
+    fprintf(file, "\t-s | --seed:\t\t Seed for the random number generator (default random).\n");
+    fprintf(file, "\t-l | --log:\t\t Write where each read came from to this file.\n");
+    fprintf(file, "\t-o | --output:\t\t Write the reads to this file instead of stdout.\n");
+    fprintf(file, "\t-t | --threads:\t\t Number of threads (default 1).\n");
+    fprintf(file, "\t-r | --reverse:\t\t Probability that a read is from the reverse strand (default 0).\n");
+    fprintf(file, "\t--sub, --ins, --del:\t Per-base substitution, insertion and deletion rates (default 0).\n");
+    fprintf(file, "\t--end-factor:\t\t The rates at the end of the read relative to the start (default 1).\n");
+    fprintf(file, "\t--ns=skip|keep|random:\t What to do with samples containing non-ACGT characters\n"
+                  "\t\t\t\t (default skip).\n");
+    fprintf(file, "\n");
+}
+
+enum { SUB_OPTION = 256, INS_OPTION, DEL_OPTION, END_FACTOR_OPTION, NS_OPTION };
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    struct simulation sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.no_reads = DEFAULT_NO_READS;
+    sim.m = DEFAULT_READ_LENGTH;
+    sim.end_factor = 1.0;
+    sim.ns = SKIP_NS;
+    sim.seed = (uint64_t)time(0);
+    const char *log_filename = 0;
+    const char *out_filename = 0;
+    long no_threads = 1;
+    
+    int opt;
+    static struct option longopts[] = {
+        { "help",       no_argument,       NULL, 'h' },
+        { "reads",      required_argument, NULL, 'n' },
+        { "length",     required_argument, NULL, 'm' },
+        { "edits",      required_argument, NULL, 'd' },
+        { "seed",       required_argument, NULL, 's' },
+        { "log",        required_argument, NULL, 'l' },
+        { "output",     required_argument, NULL, 'o' },
+        { "threads",    required_argument, NULL, 't' },
+        { "reverse",    required_argument, NULL, 'r' },
+        { "sub",        required_argument, NULL, SUB_OPTION },
+        { "ins",        required_argument, NULL, INS_OPTION },
+        { "del",        required_argument, NULL, DEL_OPTION },
+        { "end-factor", required_argument, NULL, END_FACTOR_OPTION },
+        { "ns",         required_argument, NULL, NS_OPTION },
+        { NULL,         0,                 NULL,  0  }
+    };
+    while ((opt = getopt_long(argc, argv, "hn:m:d:s:l:o:t:r:", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'h':
+                print_usage(progname, stdout);
+                return EXIT_SUCCESS;
+            case 'n':
+                sim.no_reads = (size_t)atol(optarg);
+                break;
+            case 'm':
+                sim.m = (size_t)atol(optarg);
+                break;
+            case 'd':
+                sim.d = atoi(optarg);
+                break;
+            case 's':
+                sim.seed = (uint64_t)strtoull(optarg, 0, 10);
+                break;
+            case 'l':
+                log_filename = optarg;
+                break;
+            case 'o':
+                out_filename = optarg;
+                break;
+            case 't':
+                no_threads = atol(optarg);
+                break;
+            case 'r':
+                sim.reverse = atof(optarg);
+                break;
+            case SUB_OPTION:
+                sim.sub_rate = atof(optarg);
+                break;
+            case INS_OPTION:
+                sim.ins_rate = atof(optarg);
+                break;
+            case DEL_OPTION:
+                sim.del_rate = atof(optarg);
+                break;
+            case END_FACTOR_OPTION:
+                sim.end_factor = atof(optarg);
+                break;
+            case NS_OPTION:
+                if (strcmp(optarg, "skip") == 0) sim.ns = SKIP_NS;
+                else if (strcmp(optarg, "keep") == 0) sim.ns = KEEP_NS;
+                else if (strcmp(optarg, "random") == 0) sim.ns = RANDOM_NS;
+                else {
+                    print_usage(progname, stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                print_usage(progname, stderr);
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1 || sim.m == 0 || sim.d < 0 || no_threads < 1) {
+        print_usage(progname, stderr);
+        return EXIT_FAILURE;
+    }
+    
+    FILE *fasta_file = fopen(argv[0], "r");
+    if (!fasta_file) {
+        fprintf(stderr, "Could not open %s.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    sim.reference = empty_fasta_records();
+    int status = read_fasta_records(sim.reference, fasta_file);
+    fclose(fasta_file);
+    if (status != 0) {
+        fprintf(stderr, "Could not read FASTA file %s.\n", argv[0]);
+        delete_fasta_records(sim.reference);
+        return EXIT_FAILURE;
+    }
+    
+    size_t no_seqs = sim.reference->sequences->used;
+    sim.windows = (size_t*)malloc(no_seqs * sizeof(size_t));
+    for (size_t k = 0; k < no_seqs; k++) {
+        size_t n = sim.reference->seq_sizes->sizes[k];
+        sim.windows[k] = sim.no_windows;
+        if (n >= sim.m) sim.no_windows += n - sim.m + 1;
+    }
+    if (sim.no_windows == 0) {
+        fprintf(stderr, "All the reference sequences are shorter than the reads.\n");
+        free(sim.windows);
+        delete_fasta_records(sim.reference);
+        return EXIT_FAILURE;
+    }
+    
+    sim.out = out_filename ? fopen(out_filename, "w") : stdout;
+    sim.log = log_filename ? fopen(log_filename, "w") : 0;
+    if (!sim.out || (log_filename && !sim.log)) {
+        fprintf(stderr, "Could not open %s.\n", !sim.out ? out_filename : log_filename);
+        return EXIT_FAILURE;
+    }
+    
+    pthread_mutex_init(&sim.lock, 0);
+    pthread_cond_init(&sim.turn, 0);
+    pthread_t *threads = (pthread_t*)malloc((size_t)no_threads * sizeof(pthread_t));
+    for (long i = 0; i < no_threads; i++) {
+        if (0 != pthread_create(&threads[i], 0, simulation_thread, &sim)) {
+            fprintf(stderr, "Could not create thread.\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (long i = 0; i < no_threads; i++) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+    pthread_cond_destroy(&sim.turn);
+    pthread_mutex_destroy(&sim.lock);
+    
+    if (fflush(sim.out) != 0 || (sim.out != stdout && fclose(sim.out) != 0))
+        sim.write_failed = true;
+    if (sim.log && fclose(sim.log) != 0) sim.write_failed = true;
+    free(sim.windows);
+    delete_fasta_records(sim.reference);
+    
+    if (sim.write_failed) {
+        fprintf(stderr, "Could not write the reads.\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}